@@ -0,0 +1,553 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "btree.h"
+
+// Benchmarks, results are printed as CSV:
+// benchmark,allocator,workload,node_size,key_size,value_size,keys,
+// ns_per_op,p50_ns,p99_ns,p999_ns
+// Percentiles are left empty where single operations aren't timed.
+// The nodes_* and fill_* rows report the number of nodes and the average
+// fill of the nodes in percent as ns_per_op instead.
+//
+// Usage: bench [keys per case]
+// File allocator cases use a temporary file in $BENCH_DIR (default: the
+// current directory). The cold cache case only means something if that
+// is on a disk and not a tmpfs, as for the cold_* rows.
+
+#define DEFAULT_KEYS (1<<18)
+// Only every LATENCY_SAMPLE-th operation is timed on its own,
+// so that reading the clock barely affects the throughput
+#define LATENCY_SAMPLE 16
+
+enum workload { SEQUENTIAL, RANDOM, ZIPFIAN };
+static const char *workload_names[] = {"sequential", "random", "zipfian"};
+
+enum operation { INSERT, GET, CONTAINS, REMOVE };
+static const char *operation_names[] = {"insert", "get", "contains", "remove"};
+
+typedef struct {
+    const char *allocator;
+    enum workload workload;
+    int node_size;
+    int key_size;
+    int value_size;
+    uint64_t keys;
+} bench_case;
+
+static uint64_t now_ns(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000000000llu + t.tv_nsec;
+}
+
+static int compare_uint64(const void *key1, const void *key2, size_t size){
+    uint64_t a, b;
+    memcpy(&a, key1, sizeof(uint64_t));
+    memcpy(&b, key2, sizeof(uint64_t));
+    return (a > b) - (a < b);
+}
+
+// Spread sequential numbers over the whole key space
+static uint64_t scramble(uint64_t x){
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdllu;
+    x ^= x >> 33;
+    return x;
+}
+
+// xorshift64*, seeded per case so that runs are reproducible
+static uint64_t random_state;
+static uint64_t next_random(void){
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545f4914f6cdd1dllu;
+}
+
+// Zipfian distribution over [0, n) as in YCSB
+// (Gray et al., "Quickly Generating Billion-Record Synthetic Databases")
+typedef struct {
+    uint64_t n;
+    double theta, alpha, zeta_n, eta;
+} zipf_gen;
+
+static double zeta(uint64_t n, double theta){
+    double sum = 0;
+    for(uint64_t i = 1; i <= n; i++)
+        sum += 1/pow(i, theta);
+    return sum;
+}
+
+static zipf_gen zipf_init(uint64_t n, double theta){
+    zipf_gen z = {n, theta, 1/(1-theta), zeta(n, theta)};
+    z.eta = (1 - pow(2.0/n, 1-theta)) / (1 - zeta(2, theta)/z.zeta_n);
+    return z;
+}
+
+static uint64_t zipf_next(const zipf_gen *z){
+    double u = (next_random() >> 11) * (1.0/(1llu << 53));
+    double uz = u * z->zeta_n;
+    if(uz < 1)
+        return 0;
+    if(uz < 1 + pow(0.5, z->theta))
+        return 1;
+    uint64_t x = z->n * pow(z->eta*u - z->eta + 1, z->alpha);
+    return x < z->n ? x : z->n-1;
+}
+
+// Fills keys in the order the workload inserts them (insert_order) or
+// accesses them afterwards. Random lookups are a shuffle of the inserted
+// keys. Zipfian keys are scrambled so that the popular ones aren't
+// neighbours, which also makes inserting them random.
+static void generate_keys(uint64_t *keys, uint64_t n, enum workload workload,
+        bool insert_order, const zipf_gen *zipf){
+    for(uint64_t i = 0; i < n; i++){
+        if(workload == SEQUENTIAL)
+            keys[i] = i+1;
+        else if(workload == RANDOM)
+            keys[i] = scramble(i+1);
+        else
+            keys[i] = scramble(zipf_next(zipf)+1);
+    }
+    if(workload == RANDOM && !insert_order)
+        for(uint64_t i = n-1; i > 0; i--){
+            uint64_t j = next_random() % (i+1);
+            uint64_t tmp = keys[i];
+            keys[i] = keys[j];
+            keys[j] = tmp;
+        }
+}
+
+// Keys are compared with memcmp, so store the number big endian
+// in the last (up to) 8 bytes
+static void make_key(uint8_t *key, int key_size, uint64_t x){
+    memset(key, 0, key_size);
+    for(int i = key_size-1; i >= 0 && x; i--, x >>= 8)
+        key[i] = x;
+}
+
+static int compare_latency(const void *a, const void *b){
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Prints a line of results, latencies (may be NULL) holds count samples
+static void print_result(const bench_case *c, const char *benchmark, uint64_t ops,
+        uint64_t time, uint32_t *latencies, uint64_t count){
+    printf("%s,%s,%s,%d,%d,%d,%lu,%.1f", benchmark, c->allocator,
+           workload_names[c->workload], c->node_size, c->key_size,
+           c->value_size, c->keys, (double)time/ops);
+    if(latencies && count){
+        qsort(latencies, count, sizeof(uint32_t), compare_latency);
+        printf(",%u,%u,%u\n", latencies[count/2], latencies[count*99/100],
+               latencies[count*999/1000]);
+    } else {
+        puts(",,,");
+    }
+    fflush(stdout);
+}
+
+typedef struct {
+    bench_case c;
+    btree tree;
+    int fd;
+    const struct bt_file_options *options;
+    // Reopen the file allocator and drop the page cache before each phase
+    bool cold;
+    uint32_t *latencies;
+    uint64_t count;
+    uint64_t last;
+} bench_state;
+
+// Reopen the allocator of a file tree with a cold page cache
+static bt_alloc_ptr reopen_cold(bt_alloc_ptr alloc, int fd,
+        const struct bt_file_options *options){
+    btree_close_file_alloc(alloc);
+    fsync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    alloc = btree_load_file_alloc(fd, NULL, options, NULL);
+    if(!alloc){
+        perror("Couldn't reopen benchmark file");
+        exit(1);
+    }
+    return alloc;
+}
+
+static void drop_cache(bench_state *s){
+    if(s->cold)
+        s->tree.alloc = reopen_cold(s->tree.alloc, s->fd, s->options);
+}
+
+static void run_phase(bench_state *s, enum operation op, const uint64_t *keys){
+    uint8_t key[s->c.key_size], value[s->c.value_size];
+    memset(value, 0xab, s->c.value_size);
+    drop_cache(s);
+    s->count = 0;
+    uint64_t start = now_ns();
+    for(uint64_t i = 0; i < s->c.keys; i++){
+        make_key(key, s->c.key_size, keys[i]);
+        bool timed = i%LATENCY_SAMPLE == 0;
+        uint64_t op_start = timed ? now_ns() : 0;
+        switch(op){
+        case INSERT:   btree_insert(s->tree, key, value); break;
+        case GET:      btree_get(s->tree, key, value);    break;
+        case CONTAINS: btree_contains(s->tree, key);      break;
+        case REMOVE:   btree_remove(s->tree, key, NULL);  break;
+        }
+        if(timed)
+            s->latencies[s->count++] = now_ns() - op_start;
+    }
+    print_result(&s->c, operation_names[op], s->c.keys, now_ns()-start,
+                 s->latencies, s->count);
+}
+
+// Measures the time between calls, i.e. per pair
+static bool traverse_callback(const void *key, void *value, void *param){
+    bench_state *s = param;
+    uint64_t now = now_ns();
+    if(s->count < s->c.keys)
+        s->latencies[s->count++] = now - s->last;
+    s->last = now;
+    return false;
+}
+
+static void run_traverse(bench_state *s){
+    drop_cache(s);
+    s->count = 0;
+    uint64_t start = now_ns();
+    s->last = start;
+    btree_traverse(s->tree, traverse_callback, s, false);
+    print_result(&s->c, "traverse", s->count ? s->count : 1, now_ns()-start,
+                 s->latencies, s->count);
+}
+
+// Inserts the keys, looks them up, traverses the tree and removes them again
+static void run_case(bench_case c, bt_alloc_ptr alloc, int fd,
+        const struct bt_file_options *options, bool cold){
+    bench_state s = {c, btree_create(alloc, c.key_size, c.value_size, memcmp, 0, 0),
+                     fd, options};
+    s.latencies = malloc(c.keys*sizeof(uint32_t));
+    uint64_t *keys = malloc(c.keys*sizeof(uint64_t));
+    zipf_gen zipf;
+    if(c.workload == ZIPFIAN)
+        zipf = zipf_init(c.keys, 0.99);
+    random_state = 0x9e3779b97f4a7c15llu;
+
+    // Only the phases reading the tree are measured with a cold cache
+    generate_keys(keys, c.keys, c.workload, true, &zipf);
+    run_phase(&s, INSERT, keys);
+    s.cold = cold;
+    generate_keys(keys, c.keys, c.workload, false, &zipf);
+    run_phase(&s, GET, keys);
+    run_phase(&s, CONTAINS, keys);
+    run_traverse(&s);
+    s.cold = false;
+    run_phase(&s, REMOVE, keys);
+
+    btree_delete(s.tree);
+    if(fd != -1)
+        btree_close_file_alloc(s.tree.alloc);
+    else
+        btree_free_ram_alloc(s.tree.alloc);
+    free(keys);
+    free(s.latencies);
+}
+
+static void bench_ram(int node_size, int key_size, int value_size, uint64_t keys){
+    for(enum workload w = SEQUENTIAL; w <= ZIPFIAN; w++){
+        bt_alloc_ptr alloc = btree_new_ram_alloc(node_size, NULL, NULL);
+        bench_case c = {"ram", w, node_size, key_size, value_size, keys};
+        run_case(c, alloc, -1, NULL, false);
+    }
+}
+
+static void bench_file(const char *name, const struct bt_file_options *options,
+        int key_size, int value_size, uint64_t keys, bool cold){
+    const char *dir = getenv("BENCH_DIR");
+    for(enum workload w = SEQUENTIAL; w <= ZIPFIAN; w++){
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/btree_bench_XXXXXX", dir ? dir : ".");
+        int fd = mkstemp(path);
+        if(fd == -1){
+            perror("Couldn't create benchmark file");
+            exit(1);
+        }
+        unlink(path);
+        bt_alloc_ptr alloc = btree_new_file_alloc(fd, NULL, 0, options, NULL);
+        char allocator[64];
+        snprintf(allocator, sizeof(allocator), "%s_%s", name, cold ? "cold" : "warm");
+        bench_case c = {allocator, w, alloc->node_size, key_size, value_size, keys};
+        run_case(c, alloc, fd, options, cold);
+        close(fd);
+    }
+}
+
+static bool next_sequential(void *key, void *value, void *param){
+    uint64_t *remaining = param;
+    if(!remaining[0])
+        return false;
+    remaining[0]--;
+    remaining[1]++;
+    memcpy(key, &remaining[1], sizeof(uint64_t));
+    memcpy(value, &remaining[1], sizeof(uint64_t));
+    return true;
+}
+
+static bool count_pairs(const void *key, void *value, void *param){
+    (*(uint64_t*)param)++;
+    return false;
+}
+
+// Sequential and random insertions with full leaves split in halves versus
+// shared with their neighbours, then how many nodes the tree takes and how
+// fast traversing it is
+static void bench_fill(int node_size, uint64_t len, int flags){
+    uint64_t *keys = malloc(len*sizeof(uint64_t));
+    const char *names[2] = {"share_leaves", "split_halves"};
+    for(enum workload w = SEQUENTIAL; w <= RANDOM; w++){
+        generate_keys(keys, len, w, true, NULL);
+        bench_case c = {"ram", w, node_size, sizeof(uint64_t), sizeof(uint64_t), len};
+        for(int split = 0; split < 2; split++){
+            bt_alloc_ptr alloc = btree_new_ram_alloc(node_size, NULL, NULL);
+            btree tree = btree_create(alloc, sizeof(uint64_t), sizeof(uint64_t),
+                            btree_compare_u64, 0, flags | (split ? BT_SPLIT_HALVES : 0));
+            char name[64];
+            uint64_t start = now_ns();
+            for(uint64_t i = 0; i < len; i++)
+                btree_insert(tree, keys+i, keys+i);
+            snprintf(name, sizeof(name), "insert_%s", names[split]);
+            print_result(&c, name, len, now_ns()-start, NULL, 0);
+
+            // Best of a few, the first one warms up the caches
+            uint64_t best = UINT64_MAX;
+            for(int run = 0; run < 5; run++){
+                uint64_t pairs = 0;
+                start = now_ns();
+                btree_traverse(tree, count_pairs, &pairs, false);
+                if(now_ns()-start < best)
+                    best = now_ns()-start;
+            }
+            snprintf(name, sizeof(name), "traverse_%s", names[split]);
+            print_result(&c, name, len, best, NULL, 0);
+
+            struct bt_stats stats;
+            btree_stats(tree, &stats);
+            snprintf(name, sizeof(name), "nodes_%s", names[split]);
+            print_result(&c, name, 1, stats.total_nodes, NULL, 0);
+            snprintf(name, sizeof(name), "fill_%s", names[split]);
+            print_result(&c, name, 1, (uint64_t)(100*stats.avg_fill), NULL, 0);
+            btree_delete(tree);
+            btree_free_ram_alloc(alloc);
+        }
+    }
+    free(keys);
+}
+
+// Full scans (a traversal and a cursor over all keys) of a buffered file tree
+// with a cold page cache, its leaves scattered over the file by random
+// insertions: reading the nodes one by one, with the allocator reading the
+// next ones ahead (bt_alloc.prefetch), and the latter after compacting the tree
+static void bench_cold_scan(uint64_t len, int flags){
+    const char *dir = getenv("BENCH_DIR");
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/btree_bench_XXXXXX", dir ? dir : ".");
+    int fd = mkstemp(path);
+    if(fd == -1){
+        perror("Couldn't create benchmark file");
+        exit(1);
+    }
+    unlink(path);
+    struct bt_file_options buffered = {.cache_nodes = 1<<14, .buffered = true};
+    bt_alloc_ptr alloc = btree_new_file_alloc(fd, NULL, 0, &buffered, NULL);
+    btree tree = btree_create(alloc, sizeof(uint64_t), sizeof(uint64_t),
+                    btree_compare_u64, 0, flags);
+    uint64_t *keys = malloc(len*sizeof(uint64_t));
+    generate_keys(keys, len, RANDOM, true, NULL);
+    for(uint64_t i = 0; i < len; i++)
+        btree_insert(tree, keys+i, keys+i);
+    free(keys);
+
+    const char *names[3] = {"buffered", "buffered_prefetch", "buffered_compacted"};
+    for(int variant = 0; variant < 3; variant++){
+        char allocator[64];
+        snprintf(allocator, sizeof(allocator), "%s%s", names[variant],
+                 flags & BT_BPLUS ? "_bplus" : "");
+        bench_case c = {allocator, RANDOM, alloc->node_size,
+                        sizeof(uint64_t), sizeof(uint64_t), len};
+        if(variant == 2)
+            btree_compact(tree);
+        buffered.no_prefetch = !variant;
+        for(int range = 0; range < 2; range++){
+            tree.alloc = alloc = reopen_cold(alloc, fd, &buffered);
+            uint64_t pairs = 0, start = now_ns();
+            if(range)
+                btree_traverse_range(tree, NULL, NULL, count_pairs, &pairs, false);
+            else
+                btree_traverse(tree, count_pairs, &pairs, false);
+            print_result(&c, range ? "cold_range" : "cold_traverse", pairs,
+                         now_ns()-start, NULL, 0);
+        }
+    }
+    btree_close_file_alloc(alloc);
+    close(fd);
+}
+
+// Random lookups in a tree much larger than the last level cache,
+// btree_get() one by one versus btree_get_many() in groups
+static void bench_get_many(int node_size, uint64_t len, uint64_t lookups, size_t group){
+    bt_alloc_ptr alloc = btree_new_ram_alloc(node_size, NULL, NULL);
+    uint64_t state[2] = {len, 0};
+    btree tree = btree_bulk_load(alloc, sizeof(uint64_t), sizeof(uint64_t),
+                    compare_uint64, 0, 0, 0.7, next_sequential, state);
+    bench_case c = {"ram", RANDOM, node_size, sizeof(uint64_t), sizeof(uint64_t), len};
+
+    uint64_t *keys = malloc(lookups*sizeof(uint64_t));
+    uint64_t *values = malloc(lookups*sizeof(uint64_t));
+    for(uint64_t i = 0; i < lookups; i++)
+        keys[i] = scramble(i)%len + 1;
+
+    uint64_t start = now_ns();
+    for(uint64_t i = 0; i < lookups; i++)
+        btree_get(tree, keys+i, values+i);
+    print_result(&c, "get_one_by_one", lookups, now_ns()-start, NULL, 0);
+
+    start = now_ns();
+    for(uint64_t i = 0; i < lookups; i += group)
+        btree_get_many(tree, keys+i, lookups-i < group ? lookups-i : group,
+                       values+i, NULL);
+    print_result(&c, "get_many", lookups, now_ns()-start, NULL, 0);
+
+    btree_delete(tree);
+    free(keys);
+    free(values);
+    btree_free_ram_alloc(alloc);
+}
+
+// Random lookups with a custom comparison function versus the built-in
+// u64 keys, which don't call it for each key
+static void bench_key_type(int node_size, uint64_t len, uint64_t lookups, int flags){
+    bt_key_comp compares[] = {compare_uint64, btree_compare_u64};
+    const char *names[2][2] = {{"get_custom_compare", "get_u64_keys"},
+                               {"get_custom_compare_bplus", "get_u64_keys_bplus"}};
+    bench_case c = {"ram", RANDOM, node_size, sizeof(uint64_t), sizeof(uint64_t), len};
+    uint64_t *keys = malloc(lookups*sizeof(uint64_t));
+    for(uint64_t i = 0; i < lookups; i++)
+        keys[i] = scramble(i)%len + 1;
+    for(int k = 0; k < 2; k++){
+        bt_alloc_ptr alloc = btree_new_ram_alloc(node_size, NULL, NULL);
+        uint64_t state[2] = {len, 0};
+        btree tree = btree_bulk_load(alloc, sizeof(uint64_t), sizeof(uint64_t),
+                        compares[k], 0, flags, 0.7, next_sequential, state);
+        uint64_t value, start = now_ns();
+        for(uint64_t i = 0; i < lookups; i++)
+            btree_get(tree, keys+i, &value);
+        print_result(&c, names[flags == BT_BPLUS][k], lookups, now_ns()-start, NULL, 0);
+        btree_delete(tree);
+        btree_free_ram_alloc(alloc);
+    }
+    free(keys);
+}
+
+typedef struct {
+    btree tree;
+    uint64_t len;
+    uint64_t ops;
+    uint64_t seed;
+    // Every write_every-th operation inserts or removes a key
+    int write_every;
+} concurrent_worker;
+
+static void *run_concurrent_worker(void *param){
+    concurrent_worker *w = param;
+    // xorshift64* per thread, next_random() is shared
+    uint64_t state = w->seed, key, value;
+    for(uint64_t i = 0; i < w->ops; i++){
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        key = (state * 0x2545f4914f6cdd1dllu)%w->len*2 + 1;
+        if(w->write_every && i%w->write_every == 0){
+            if(i/w->write_every % 2)
+                btree_remove(w->tree, &key, NULL);
+            else
+                btree_insert(w->tree, &key, &key);
+        } else {
+            btree_get(w->tree, &key, &value);
+        }
+    }
+    return NULL;
+}
+
+// Random lookups (and insertions/removals if write_every isn't 0) on one
+// BT_CONCURRENT tree from 1 to 32 threads, ns_per_op is wall time divided
+// by the operations of all threads, so it goes down as long as they scale
+static void bench_concurrent(int node_size, uint64_t len, uint64_t ops, int write_every){
+    bt_alloc_ptr alloc = btree_new_ram_alloc(node_size, NULL, NULL);
+    btree tree = btree_create(alloc, sizeof(uint64_t), sizeof(uint64_t),
+                    btree_compare_u64, 0, BT_CONCURRENT);
+    // Every other key, so that half of the insertions add a new one
+    for(uint64_t i = 0; i < len; i++){
+        uint64_t key = scramble(i)%len*2 + 1;
+        btree_insert(tree, &key, &key);
+    }
+    bench_case c = {"ram", RANDOM, node_size, sizeof(uint64_t), sizeof(uint64_t), len};
+    for(int threads = 1; threads <= 32; threads *= 2){
+        pthread_t handles[threads];
+        concurrent_worker workers[threads];
+        uint64_t start = now_ns();
+        for(int t = 0; t < threads; t++){
+            workers[t] = (concurrent_worker){tree, len, ops/threads,
+                                             scramble(t+1) | 1, write_every};
+            pthread_create(handles+t, NULL, run_concurrent_worker, workers+t);
+        }
+        for(int t = 0; t < threads; t++)
+            pthread_join(handles[t], NULL);
+        char name[64];
+        snprintf(name, sizeof(name), "%s_%d_threads",
+                 write_every ? "concurrent_mixed" : "concurrent_get", threads);
+        print_result(&c, name, ops/threads*threads, now_ns()-start, NULL, 0);
+    }
+    btree_delete(tree);
+    btree_free_ram_alloc(alloc);
+}
+
+int main(int argc, char **argv){
+    uint64_t keys = argc > 1 ? strtoull(argv[1], NULL, 0) : DEFAULT_KEYS;
+    puts("benchmark,allocator,workload,node_size,key_size,value_size,keys,"
+         "ns_per_op,p50_ns,p99_ns,p999_ns");
+
+    // Node sizes with small pairs, node_size is 16 bit so 64 KiB - 1 is the largest
+    int node_sizes[] = {256, 1024, 4096, 16384, 65535};
+    for(int i = 0; i < sizeof(node_sizes)/sizeof(*node_sizes); i++)
+        bench_ram(node_sizes[i], 8, 8, keys);
+    // Larger pairs
+    bench_ram(1024, 16, 64, keys);
+    bench_ram(4096, 16, 64, keys);
+    bench_ram(4096, 8, 200, keys);
+    // File allocator with the page cache warm and cold, mapping nodes and
+    // reading them into a pool of frames (64 MiB)
+    bench_file("file", NULL, 8, 8, keys, false);
+    bench_file("file", NULL, 8, 8, keys, true);
+    struct bt_file_options buffered = {.cache_nodes = 1<<14, .buffered = true};
+    bench_file("buffered", &buffered, 8, 8, keys, false);
+    bench_file("buffered", &buffered, 8, 8, keys, true);
+
+    bench_key_type(4096, 1<<16, 1<<22, 0);
+    bench_key_type(4096, 1<<16, 1<<22, BT_BPLUS);
+    bench_cold_scan(1<<22, 0);
+    bench_cold_scan(1<<22, BT_BPLUS);
+    bench_fill(4096, 1<<22, 0);
+    bench_fill(4096, 1<<22, BT_BPLUS);
+    bench_get_many(4096, 1<<23, 1<<20, 64);
+    bench_get_many(512, 1<<23, 1<<20, 64);
+    bench_concurrent(4096, 1<<20, 1<<22, 0);
+    bench_concurrent(4096, 1<<20, 1<<22, 10);
+    return 0;
+}
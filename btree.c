@@ -1,7 +1,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "btree.h"
+#include "btree_internal.h"
 
 /*************
  * DATATYPES *
@@ -19,6 +25,11 @@ typedef void bt_node;
  * // only in interior nodes:
  *  bt_node_id children[max_keys+1]
  */
+// In B+ trees, the pairs of interior nodes consist of only the key
+// and leaves contain the ids of their siblings instead of children:
+/*  bt_node_id prev
+ *  bt_node_id next
+ */
 
 // Tree metadata, kept in a node
 typedef struct {
@@ -37,17 +48,77 @@ typedef struct {
     // Size of key & value datatypes in bytes
     uint8_t key_size;
     uint8_t value_size;
+    // enum bt_flags given on creation, SNAPSHOT for snapshots
+    uint8_t flags;
+    // Id of the tree of the snapshots, 0 if none (see btree_snapshot()).
+    // Snapshots store the id of the tree they were taken of here instead.
+    // Unaligned, so that the root keeps its space (see get_snapshots()).
+    uint8_t snapshots[sizeof(bt_node_id)];
     // Custom data (variable length) stored alongside tree
     char userdata;
 } btree_data;
 
+// Flag of the metadata of snapshots, which are read-only
+#define SNAPSHOT 0x80
+// The tree of the snapshots maps the generation of each snapshot to the id of
+// its metadata. It also maps RETAINED|id of each node removed from the tree
+// that snapshots may still use to the generations it was created (upper half)
+// and removed in (lower half).
+#define RETAINED ((uint64_t)1<<63)
+
+// Kinds of keys that search_keys() has a specialized search for,
+// selected by the comparison function of the tree
+enum {
+    KEY_CUSTOM,
+    KEY_U32,    // btree_compare_u32()
+    KEY_U64,    // btree_compare_u64()
+    KEY_MEMCMP, // memcmp()
+};
+
+// Latches held by an operation on a concurrent tree (BT_CONCURRENT),
+// from the root down. Those below index first are released already.
+#define LATCH_PATH_MAX 68
+typedef struct {
+    void *nodes[LATCH_PATH_MAX];
+    int count;
+    int first;
+} latch_path;
+
+// Nodes an insertion or removal passes on its way down, indexed by their
+// height, so that it can work its way back up without recursion
+#define TREE_PATH_MAX 64
+typedef struct {
+    bt_node *node;
+    // 0 for the root
+    bt_node_id id;
+    // Index of the child descended into (or of the pair in a leaf)
+    int child;
+} path_step;
+typedef path_step tree_path[TREE_PATH_MAX];
+
 // Small structure passed amoung internal functions,
 // contains metadata neccessary for managing nodes
 // Maybe make thread-local variables instead?
 typedef struct {
     btree tree;
     uint8_t key_size;
+    // Size of the values in the pairs of the nodes worked on, see at_height()
     uint8_t value_size;
+    // Size of the values stored in the tree
+    uint8_t leaf_value_size;
+    bool bplus;
+    uint8_t key_type;
+    bool concurrent;
+    // Latches of the current operation, NULL unless the tree is concurrent
+    latch_path *latches;
+    // Bytes per stored child id
+    uint8_t id_size;
+    // Generation new nodes are stamped with, nodes of this one or older
+    // are shared with snapshots (0 if there are none)
+    uint32_t generation;
+    uint32_t shared_generation;
+    // BT_SPLIT_HALVES
+    bool split_halves;
 } tree_param;
 
 
@@ -65,20 +136,88 @@ typedef struct {
 # define PAIRS(node)    ((void*)((int16_t*)node+2))
 # define PAIR(node, i)  ((uint8_t*)PAIRS(node)+(i)*(tree.key_size+tree.value_size))
 # define VALUE(pair)    (pair+tree.key_size)
-# define CHILDREN(node) ((bt_node_id*)(((char*)PAIRS(node))\
-                            +(tree.key_size+tree.value_size)*MAX_KEYS(node)))
-# define CHILD(node, i) (CHILDREN(node)+(i))
+// Children take tree.id_size bytes each (see BT_IDS32/48), so they are read
+// and written with GET_CHILD()/SET_CHILD() and moved with CHILD()
+# define CHILDREN(node) ((uint8_t*)PAIRS(node)\
+                            +(tree.key_size+tree.value_size)*MAX_KEYS(node))
+# define CHILD(node, i) (CHILDREN(node)+(i)*tree.id_size)
+# define GET_CHILD(node, i) get_child(tree, node, i)
+# define SET_CHILD(node, i, id) set_child(tree, node, i, id)
+// Siblings of leaves in B+ trees (0 if none)
+# define PREV_LEAF(node) GET_CHILD(node, 0)
+# define NEXT_LEAF(node) GET_CHILD(node, 1)
+# define SET_PREV_LEAF(node, id) SET_CHILD(node, 0, id)
+# define SET_NEXT_LEAF(node, id) SET_CHILD(node, 1, id)
 
 # define ROOT(tree_data) ((bt_node*)((char*)(tree_data)+(tree_data)->root_offset))
 
-# define LOAD(node) (tree.tree.alloc->load(tree.tree, node))
-# define LOAD_TREE(b_tree) (b_tree.alloc->load(b_tree, b_tree.root))
-# define UNLOAD(node) (tree.tree.alloc->unload(tree.tree, node))
-# define UNLOAD_TREE(b_tree, tree_data) (b_tree.alloc->unload(b_tree, tree_data))
-# define NEW_NODE() (tree.tree.alloc->new(tree.tree.alloc))
-# define FREE(node_id) (tree.tree.alloc->free(tree.tree.alloc, node_id))
+// Add n to a counter of the allocator if it collects statistics
+# define COUNT(alloc, counter, n) ((alloc)->stats ? (void)((alloc)->stats->counter += (n)) : (void)0)
+
+// Report an event to the callback of the allocator if it has one
+# define EVENT(alloc, event, arg) ((alloc)->stats && (alloc)->stats->event_callback ? \
+        (alloc)->stats->event_callback(alloc, event, arg, (alloc)->stats->event_param) : (void)0)
+
+# define LOAD(node) (COUNT(tree.tree.alloc, loads, 1), \
+                     tree.tree.alloc->load(tree.tree, node))
+# define LOAD_TREE(b_tree) (COUNT(b_tree.alloc, loads, 1), \
+                            b_tree.alloc->load(b_tree, b_tree.root))
+# define UNLOAD(node) (COUNT(tree.tree.alloc, unloads, 1), \
+                       tree.tree.alloc->unload(tree.tree, node))
+# define UNLOAD_TREE(b_tree, tree_data) (COUNT(b_tree.alloc, unloads, 1), \
+                                         b_tree.alloc->unload(b_tree, tree_data))
+// Tell the allocator that a loaded node was changed, node may point anywhere
+// into it (e.g. the root inside the tree's metadata node)
+# define DIRTY(node) (tree.tree.alloc->dirty ? \
+                      tree.tree.alloc->dirty(tree.tree, node) : (void)0)
+# define DIRTY_TREE(b_tree, tree_data) (b_tree.alloc->dirty ? \
+                                        b_tree.alloc->dirty(b_tree, tree_data) : (void)0)
+# define NEW_NODE() (COUNT(tree.tree.alloc, news, 1), \
+                     tree.tree.alloc->new(tree.tree.alloc))
+# define FREE(node_id) (COUNT(tree.tree.alloc, frees, 1), \
+                        tree.tree.alloc->free(tree.tree.alloc, node_id))
+// Free a node that lookups of concurrent trees may still be reading
+# define RETIRE(node_id) (tree.concurrent ? retire_node(tree, node_id) : FREE(node_id))
 # define NOTIFY_DELETED() (tree.tree.alloc->tree_deleted(tree.tree))
 
+// Child ids are stored in tree.id_size bytes, possibly unaligned.
+// 6 byte ids are split into their low 4 and high 2 bytes.
+static inline bt_node_id load_id(tree_param tree, const uint8_t *p){
+    if(tree.id_size == sizeof(bt_node_id)){
+        bt_node_id id;
+        memcpy(&id, p, sizeof(bt_node_id));
+        return id;
+    }
+    uint32_t low;
+    memcpy(&low, p, sizeof(uint32_t));
+    if(tree.id_size == sizeof(uint32_t))
+        return low;
+    uint16_t high;
+    memcpy(&high, p+sizeof(uint32_t), sizeof(uint16_t));
+    return (bt_node_id)high<<32 | low;
+}
+
+static inline void store_id(tree_param tree, uint8_t *p, bt_node_id id){
+    if(tree.id_size == sizeof(bt_node_id)){
+        memcpy(p, &id, sizeof(bt_node_id));
+        return;
+    }
+    uint32_t low = id;
+    memcpy(p, &low, sizeof(uint32_t));
+    if(tree.id_size > sizeof(uint32_t)){
+        uint16_t high = id>>32;
+        memcpy(p+sizeof(uint32_t), &high, sizeof(uint16_t));
+    }
+}
+
+static inline bt_node_id get_child(tree_param tree, const bt_node *node, int i){
+    return load_id(tree, CHILD(node, i));
+}
+
+static inline void set_child(tree_param tree, bt_node *node, int i, bt_node_id id){
+    store_id(tree, CHILD(node, i), id);
+}
+
 /**  Temporary functions to aid in debugging as gdb can't see makros */
 /*********************************************************************/
 /**/ int16_t numkeys(bt_node *node) {return NUM_KEYS(node);}
@@ -87,7 +226,8 @@ typedef struct {
 /**/ uint8_t *pairs(bt_node *node) {return PAIRS(node);}
 /**/ uint8_t *pair(tree_param tree, bt_node *node, int i)
 /**/          {return PAIR(node, i);}
-/**/ bt_node_id *children(tree_param tree, bt_node *node) {return CHILDREN(node);}
+/**/ bt_node_id child(tree_param tree, bt_node *node, int i)
+/**/          {return GET_CHILD(node, i);}
 /**/ bt_node *root(btree_data *tree_data) {return ROOT(tree_data);}
 /*********************************************************************/
 
@@ -98,108 +238,818 @@ typedef struct {
  * FUNCTIONS *
  *************/
 
+int btree_compare_u32(const void *key1, const void *key2, size_t size){
+    uint32_t a, b;
+    memcpy(&a, key1, sizeof(uint32_t));
+    memcpy(&b, key2, sizeof(uint32_t));
+    return (a > b) - (a < b);
+}
+
+int btree_compare_u64(const void *key1, const void *key2, size_t size){
+    uint64_t a, b;
+    memcpy(&a, key1, sizeof(uint64_t));
+    memcpy(&b, key2, sizeof(uint64_t));
+    return (a > b) - (a < b);
+}
+
+static uint8_t get_key_type(bt_key_comp compare, uint8_t key_size){
+    if(compare == btree_compare_u32 && key_size == sizeof(uint32_t))
+        return KEY_U32;
+    if(compare == btree_compare_u64 && key_size == sizeof(uint64_t))
+        return KEY_U64;
+    if(compare == memcmp)
+        return KEY_MEMCMP;
+    return KEY_CUSTOM;
+}
+
+// Bytes the children of trees with the given flags are stored in
+static uint8_t flags_id_size(int flags){
+    return flags & BT_IDS32 ? 4 : flags & BT_IDS48 ? 6 : sizeof(bt_node_id);
+}
+
+static inline uint32_t *tree_generation(bt_alloc_ptr, const btree_data*);
+static inline uint32_t *newest_snapshot(bt_alloc_ptr, const btree_data*);
+
+static tree_param get_tree_param(btree b_tree, const btree_data *tree_data){
+    return (tree_param){b_tree, tree_data->key_size, tree_data->value_size,
+                        tree_data->value_size, tree_data->flags & BT_BPLUS,
+                        get_key_type(b_tree.compare, tree_data->key_size),
+                        tree_data->flags & BT_CONCURRENT, NULL,
+                        flags_id_size(tree_data->flags),
+                        *tree_generation(b_tree.alloc, tree_data),
+                        *newest_snapshot(b_tree.alloc, tree_data),
+                        tree_data->flags & BT_SPLIT_HALVES};
+}
+
+// Insertions and removals are refused for snapshots
+static void check_writable(const btree_data *tree_data){
+    if(tree_data->flags & SNAPSHOT){
+        fputs("Error: Snapshots of trees are read-only\n", stderr);
+        exit(1);
+    }
+}
+
+// Adjust the pair size to the nodes at the given height,
+// interior nodes of B+ trees store only keys
+static inline tree_param at_height(tree_param tree, int height){
+    tree.value_size = tree.bplus && height ? 0 : tree.leaf_value_size;
+    return tree;
+}
+
+// Whether the index returned by search_keys() points to the pair with the key
+// itself, the keys of interior B+ nodes only separate the children.
+// Otherwise the key is in (or belongs into) child (index+1)/2.
+static inline bool found_pair(tree_param tree, int index, int height){
+    return index%2 && !(tree.bplus && height);
+}
+
+// Nodes of concurrent trees are latched top down: insertions and removals
+// latch a child and release the latches above it once it can't split or fall
+// below its minimum number of keys. Siblings are only latched while holding
+// their parent and the first leaf of the next parent while holding the last
+// one before it, so latches are acquired from the top down and from left to
+// right, which avoids deadlocks.
+// A latch is stored in the unused space at the end of its node. It is a
+// version that is odd while the node is latched and advances when a latch
+// is released after changing the node. Lookups don't latch: they note the
+// version of a node, look at it and check that the version is unchanged,
+// otherwise they start over (see search_optimistic()).
+// For the root, that is the node with the tree's metadata, which also has
+// the gate: the number of insertions/removals in progress (if positive)
+// or of scans, which don't check versions (if negative).
+static inline uint32_t *node_latch(bt_alloc_ptr alloc, void *node){
+    return (uint32_t*)((char*)node + ((alloc->node_size-2*sizeof(uint32_t)) & ~7));
+}
+
+static inline int32_t *tree_gate(bt_alloc_ptr alloc, btree_data *tree_data){
+    return (int32_t*)(node_latch(alloc, tree_data)+1);
+}
+
+// Generation a node was created in, stored in front of its latch
+static inline uint32_t *node_birth(bt_alloc_ptr alloc, void *node){
+    return node_latch(alloc, node)-2;
+}
+
+// Nodes are stamped with the generation they were created in, each snapshot
+// starts a new one. The metadata of a tree keeps the current generation and
+// that of the newest snapshot (0 if none) in front of the latch as well:
+// nodes of that generation or older may be shared with snapshots.
+static inline uint32_t *tree_generation(bt_alloc_ptr alloc, const btree_data *tree_data){
+    return node_latch(alloc, (void*)tree_data)-1;
+}
+
+static inline uint32_t *newest_snapshot(bt_alloc_ptr alloc, const btree_data *tree_data){
+    return node_latch(alloc, (void*)tree_data)-2;
+}
+
+static inline bt_node_id get_snapshots(const btree_data *tree_data){
+    bt_node_id id;
+    memcpy(&id, tree_data->snapshots, sizeof(bt_node_id));
+    return id;
+}
+
+static inline void set_snapshots(btree_data *tree_data, bt_node_id id){
+    memcpy(tree_data->snapshots, &id, sizeof(bt_node_id));
+}
+
+static void latch_backoff(int *spins){
+    if(++*spins < 100){
+#ifdef __SSE2__
+        _mm_pause();
+#endif
+    } else {
+        sched_yield();
+    }
+}
+
+static void latch_acquire(uint32_t *latch){
+    int spins = 0;
+    for(;;){
+        uint32_t version = __atomic_load_n(latch, __ATOMIC_RELAXED);
+        if(!(version & 1) && __atomic_compare_exchange_n(latch, &version, version+1,
+                    true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            // Keep the changes to the node from being seen before the latch
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            return;
+        }
+        latch_backoff(&spins);
+    }
+}
+
+// If the node wasn't changed, the version goes back to what it was
+// before, so that lookups which have looked at it don't start over
+static void latch_release(uint32_t *latch, bool changed){
+    if(changed)
+        __atomic_fetch_add(latch, 1, __ATOMIC_RELEASE);
+    else
+        __atomic_fetch_sub(latch, 1, __ATOMIC_RELEASE);
+}
+
+// Version of a node, once it isn't latched
+static uint32_t version_read(const uint32_t *latch){
+    int spins = 0;
+    uint32_t version;
+    while((version = __atomic_load_n(latch, __ATOMIC_ACQUIRE)) & 1)
+        latch_backoff(&spins);
+    return version;
+}
+
+// Whether the node read since version_read() returned version is unchanged
+static bool version_check(const uint32_t *latch, uint32_t version){
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(latch, __ATOMIC_RELAXED) == version;
+}
+
+// Gates of the scans the current thread is in, so that an insertion/removal
+// of the thread fails instead of waiting for itself forever.
+// Scans nested deeper aren't noted.
+#define MAX_THREAD_SCANS 16
+static _Thread_local struct {
+    int32_t *gates[MAX_THREAD_SCANS];
+    int count;
+} thread_scans;
+
+// Let an insertion/removal (scan==false) or a scan of the tree pass the gate
+static void gate_enter(bt_alloc_ptr alloc, btree_data *tree_data, bool scan){
+    int32_t *gate = tree_gate(alloc, tree_data);
+    if(scan){
+        if(thread_scans.count < MAX_THREAD_SCANS)
+            thread_scans.gates[thread_scans.count++] = gate;
+    } else {
+        for(int i = 0; i < thread_scans.count; i++)
+            if(thread_scans.gates[i] == gate){
+                fputs("Error: A thread can't modify a concurrent tree while it is "
+                      "scanning it (e.g. holding a cursor to it)\n", stderr);
+                exit(1);
+            }
+    }
+    int spins = 0;
+    for(;;){
+        int32_t state = __atomic_load_n(gate, __ATOMIC_RELAXED);
+        if((scan ? state <= 0 : state >= 0)
+                && __atomic_compare_exchange_n(gate, &state, state + (scan ? -1 : 1),
+                        true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+        latch_backoff(&spins);
+    }
+}
+
+static void gate_leave(bt_alloc_ptr alloc, btree_data *tree_data, bool scan){
+    int32_t *gate = tree_gate(alloc, tree_data);
+    for(int i = thread_scans.count; scan && i --> 0;)
+        if(thread_scans.gates[i] == gate){
+            thread_scans.gates[i] = thread_scans.gates[--thread_scans.count];
+            break;
+        }
+    __atomic_fetch_add(gate, scan ? 1 : -1, __ATOMIC_RELEASE);
+}
+
+// Latch node below the ones held by the current operation
+static void latch_push(tree_param tree, void *node){
+    latch_path *path = tree.latches;
+    if(!path)
+        return;
+    latch_acquire(node_latch(tree.tree.alloc, node));
+    path->nodes[path->count++] = node;
+}
+
+// Release the latches above the last one, the nodes haven't been changed yet
+static void latch_release_above(tree_param tree){
+    latch_path *path = tree.latches;
+    if(!path)
+        return;
+    for(; path->first < path->count-1; path->first++)
+        latch_release(node_latch(tree.tree.alloc, path->nodes[path->first]), false);
+}
+
+// Release the last latch (if not already released)
+static void latch_pop(tree_param tree){
+    latch_path *path = tree.latches;
+    if(!path)
+        return;
+    path->count--;
+    if(path->count >= path->first)
+        latch_release(node_latch(tree.tree.alloc, path->nodes[path->count]), true);
+    else
+        path->first = path->count;
+}
+
+// Whether the current operation still holds the root latch
+static inline bool root_latched(tree_param tree){
+    return !tree.latches || tree.latches->first == 0;
+}
+
+// Whether the current operation still holds the latch of the parent of the
+// last latched node. If not, the node won't split or fall below its minimum
+// number of keys and others may already be changing the nodes above it.
+static inline bool parent_latched(tree_param tree){
+    return !tree.latches || tree.latches->first < tree.latches->count-1;
+}
+
+// Latch a node outside of the path, e.g. a sibling
+static void latch_node(tree_param tree, void *node){
+    if(tree.latches)
+        latch_acquire(node_latch(tree.tree.alloc, node));
+}
+
+static void unlatch_node(tree_param tree, void *node){
+    if(tree.latches)
+        latch_release(node_latch(tree.tree.alloc, node), true);
+}
+
+// Start an insertion/removal by latching the root.
+// Returns tree set up to latch the nodes on the way down.
+static tree_param latch_root(tree_param tree, latch_path *path, btree_data *tree_data){
+    if(!tree.concurrent)
+        return tree;
+    gate_enter(tree.tree.alloc, tree_data, false);
+    *path = (latch_path){0};
+    tree.latches = path;
+    latch_push(tree, tree_data);
+    return tree;
+}
+
+// End an operation started with latch_root()
+static void unlatch_root(tree_param tree, btree_data *tree_data){
+    if(!tree.latches)
+        return;
+    latch_pop(tree);
+    gate_leave(tree.tree.alloc, tree_data, false);
+}
+
+// Scans of concurrent trees wait for running insertions/removals
+// and keep new ones out until scan_end()
+static void scan_begin(tree_param tree, btree_data *tree_data){
+    if(tree.concurrent)
+        gate_enter(tree.tree.alloc, tree_data, true);
+}
+
+static void scan_end(tree_param tree, btree_data *tree_data){
+    if(tree.concurrent)
+        gate_leave(tree.tree.alloc, tree_data, true);
+}
+
+// Lookups may still be reading nodes that a removal has merged away.
+// Each thread doing lookups has a slot with the epoch it started its current
+// lookup in (0 if none), freed nodes are kept along with the epoch they were
+// retired in and only handed back to their allocator once all lookups
+// in that or an earlier epoch are done.
+typedef struct epoch_slot {
+    uint64_t epoch;
+    bool used;
+    struct epoch_slot *next;
+} epoch_slot;
+
+typedef struct {
+    btree tree;
+    bt_node_id node_id;
+    uint64_t epoch;
+} retired_node;
+
+// Retired nodes are freed once there are this many
+#define RECLAIM_BATCH 64
+
+static uint64_t global_epoch = 1;
+// Slots are never freed, those of threads that have exited are reused
+static epoch_slot *epoch_slots;
+static pthread_key_t epoch_slot_key;
+static pthread_once_t epoch_slot_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+static retired_node *retired;
+static size_t retired_count, retired_capacity;
+
+static void epoch_slot_release(void *slot){
+    __atomic_store_n(&((epoch_slot*)slot)->used, false, __ATOMIC_RELEASE);
+}
+
+static void epoch_slot_key_create(void){
+    pthread_key_create(&epoch_slot_key, epoch_slot_release);
+}
+
+static epoch_slot *get_epoch_slot(void){
+    pthread_once(&epoch_slot_once, epoch_slot_key_create);
+    epoch_slot *slot = pthread_getspecific(epoch_slot_key);
+    if(slot)
+        return slot;
+    for(slot = __atomic_load_n(&epoch_slots, __ATOMIC_ACQUIRE); slot; slot = slot->next){
+        bool used = false;
+        if(__atomic_compare_exchange_n(&slot->used, &used, true, false,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if(!slot){
+        slot = calloc(1, sizeof(epoch_slot));
+        if(!slot){
+            fputs("Error: Failed to allocate btree epoch slot, not enough RAM\n", stderr);
+            exit(1);
+        }
+        slot->used = true;
+        slot->next = __atomic_load_n(&epoch_slots, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&epoch_slots, &slot->next, slot, true,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    pthread_setspecific(epoch_slot_key, slot);
+    return slot;
+}
+
+static epoch_slot *epoch_enter(void){
+    epoch_slot *slot = get_epoch_slot();
+    __atomic_store_n(&slot->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+    // Either a removal sees the slot or this thread sees the removed node unlinked
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return slot;
+}
+
+static void epoch_leave(epoch_slot *slot){
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Oldest epoch a lookup is still running in, UINT64_MAX if none
+static uint64_t oldest_epoch(void){
+    uint64_t oldest = UINT64_MAX;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for(epoch_slot *slot = __atomic_load_n(&epoch_slots, __ATOMIC_ACQUIRE); slot; slot = slot->next){
+        uint64_t epoch = __atomic_load_n(&slot->epoch, __ATOMIC_SEQ_CST);
+        if(epoch && epoch < oldest)
+            oldest = epoch;
+    }
+    return oldest;
+}
+
+// Free the retired nodes no lookup can still be reading, or all of those
+// of the tree only if given (there may be no lookups running on it then).
+// Requires retired_lock.
+static void reclaim_nodes(const btree *only){
+    uint64_t oldest = only ? 0 : oldest_epoch();
+    size_t kept = 0;
+    for(size_t i = 0; i < retired_count; i++){
+        retired_node r = retired[i];
+        if(only ? r.tree.alloc == only->alloc && r.tree.root == only->root
+                : r.epoch < oldest)
+            r.tree.alloc->free(r.tree.alloc, r.node_id);
+        else
+            retired[kept++] = r;
+    }
+    retired_count = kept;
+}
+
+void btree_reclaim_retired(bt_alloc_ptr alloc){
+    pthread_mutex_lock(&retired_lock);
+    size_t kept = 0;
+    for(size_t i = 0; i < retired_count; i++){
+        retired_node r = retired[i];
+        if(r.tree.alloc == alloc)
+            alloc->free(alloc, r.node_id);
+        else
+            retired[kept++] = r;
+    }
+    retired_count = kept;
+    pthread_mutex_unlock(&retired_lock);
+}
+
+// Free a node of a concurrent tree after it was unlinked from the tree
+static void retire_node(tree_param tree, bt_node_id node_id){
+    COUNT(tree.tree.alloc, frees, 1);
+    pthread_mutex_lock(&retired_lock);
+    if(retired_count == retired_capacity){
+        size_t capacity = retired_capacity ? 2*retired_capacity : RECLAIM_BATCH;
+        retired_node *grown = realloc(retired, capacity*sizeof(retired_node));
+        if(!grown){
+            // Wait for the lookups that might see the node instead
+            uint64_t epoch = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+            int spins = 0;
+            while(oldest_epoch() <= epoch)
+                latch_backoff(&spins);
+            tree.tree.alloc->free(tree.tree.alloc, node_id);
+            pthread_mutex_unlock(&retired_lock);
+            return;
+        }
+        retired = grown;
+        retired_capacity = capacity;
+    }
+    retired[retired_count++] = (retired_node){tree.tree, node_id,
+                    __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST)};
+    if(retired_count >= RECLAIM_BATCH)
+        reclaim_nodes(NULL);
+    pthread_mutex_unlock(&retired_lock);
+}
+
 btree btree_create(bt_alloc_ptr alloc, uint8_t key_size, uint8_t value_size,
-        bt_key_comp compare, uint16_t userdata_size){
+        bt_key_comp compare, uint16_t userdata_size, int flags){
+    COUNT(alloc, news, 1);
     bt_node_id tree_node_id = alloc->new(alloc);
     btree tree = (btree){alloc, tree_node_id, compare?compare:memcmp};
     btree_data *tree_data = LOAD_TREE(tree);
+    if(flags & BT_CONCURRENT)
+        flags |= BT_BPLUS;
+    // Store children in as few bytes as the ids of the allocator fit in
+    size_t alloc_id_size = alloc->id_size ? alloc->id_size : sizeof(bt_node_id);
+    if(!(flags & (BT_IDS32|BT_IDS48)))
+        flags |= alloc_id_size <= 4 ? BT_IDS32 : alloc_id_size <= 6 ? BT_IDS48 : 0;
+    size_t id_size = flags_id_size(flags);
+    if(id_size < alloc_id_size){
+        fputs("Error: The ids of the allocator don't fit into BT_IDS32/48\n", stderr);
+        exit(1);
+    }
     tree_data->height = -1;
     tree_data->key_size = key_size;
     tree_data->value_size = value_size;
+    tree_data->flags = flags;
+    set_snapshots(tree_data, 0);
+    *tree_generation(alloc, tree_data) = 1;
+    *newest_snapshot(alloc, tree_data) = 0;
+    *node_latch(alloc, tree_data) = 0;
+    *tree_gate(alloc, tree_data) = 0;
     // Calculate how many keys will fit in each type of node
     // TODO: check correctness, esp. in regards to padding
-    tree_data->max_interior_keys = (alloc->node_size-32)
-                            / (key_size+value_size+sizeof(bt_node_id)) - 1;
-    tree_data->max_leaf_keys = (alloc->node_size-32) / (key_size+value_size) - 1;
+    if(flags & BT_BPLUS){
+        tree_data->max_interior_keys = (alloc->node_size-32)
+                                / (key_size+id_size) - 1;
+        tree_data->max_leaf_keys = (alloc->node_size-32-2*id_size)
+                                / (key_size+value_size) - 1;
+    } else {
+        tree_data->max_interior_keys = (alloc->node_size-32)
+                                / (key_size+value_size+id_size) - 1;
+        tree_data->max_leaf_keys = (alloc->node_size-32) / (key_size+value_size) - 1;
+    }
+    // The root can be either, as leaf it won't need links to siblings
     uint16_t max_root_keys = (alloc->node_size-32-sizeof(btree_data)-userdata_size)
-                           / (key_size+value_size+sizeof(bt_node_id)) - 1;
+                           / (key_size+value_size+id_size) - 1;
     tree_data->root_offset = &tree_data->userdata+userdata_size-(char*)tree_data+1;
     // TODO checks that e.g. there is enough space for root
     NUM_KEYS(ROOT(tree_data)) = 0;
     MAX_KEYS(ROOT(tree_data)) = max_root_keys;
+    DIRTY_TREE(tree, tree_data);
     UNLOAD_TREE(tree, tree_data);
     return tree;
 }
 
 void *btree_load_userdata(btree tree){
-    btree_data *tree_data = tree.alloc->load(tree, tree.root);
+    btree_data *tree_data = LOAD_TREE(tree);
     return &tree_data->userdata;
 }
 
 void btree_unload_userdata(btree tree, void *userdata){
+    // It might have been changed
+    DIRTY_TREE(tree, userdata);
     // offsetof(btree_data, userdata) doesn't work
-    tree.alloc->unload(tree, (uint8_t*)userdata
+    UNLOAD_TREE(tree, (uint8_t*)userdata
             - (&((btree_data*)NULL)->userdata-(char*)NULL));
 }
 
+void btree_alloc_stats(bt_alloc_ptr alloc, struct bt_alloc_stats *stats){
+    alloc->stats = stats;
+}
+
+// Start time of an operation if latencies are recorded, else 0
+static inline uint64_t latency_start(bt_alloc_ptr alloc){
+    if(!alloc->stats || !alloc->stats->record_latency)
+        return 0;
+    return now_ns();
+}
+
+// Adds the time since start to the histogram of operation op
+static inline void latency_end(bt_alloc_ptr alloc, enum bt_operation op, uint64_t start){
+    if(!start || !alloc->stats)
+        return;
+    record_latency(alloc->stats->latency[op], now_ns()-start);
+}
+
+// Calls the comparison function of the tree
+static inline int compare_keys(tree_param tree, const void *key1, const void *key2){
+    COUNT(tree.tree.alloc, compares, 1);
+    return tree.tree.compare(key1, key2, tree.key_size);
+}
+
+// Keys may be unaligned
+static inline uint32_t load_u32(const void *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t load_u64(const void *p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Load keys compared by memcmp() so that they compare the same as integers
+static inline uint32_t load_be32(const void *p){
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap32(load_u32(p));
+#else
+    return load_u32(p);
+#endif
+}
+
+static inline uint64_t load_be64(const void *p){
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(load_u64(p));
+#else
+    return load_u64(p);
+#endif
+}
+
+// Defines a search_keys() for keys loaded as integer type by load().
+// The branchless lower bound search halves the range without jumps that
+// depend on the keys, so there are no mispredictions.
+# define INT_SEARCH(name, type, load) \
+static int name(tree_param tree, const bt_node *node, const void *key_ptr){ \
+    type key = load(key_ptr); \
+    size_t stride = tree.key_size+tree.value_size; \
+    const uint8_t *keys = PAIRS(node); \
+    int min = 0, len = NUM_KEYS(node); \
+    while(len > 1){ \
+        int half = len/2; \
+        min += load(keys+(min+half-1)*stride) < key ? half : 0; \
+        len -= half; \
+    } \
+    if(len) \
+        min += load(keys+min*stride) < key; \
+    return 2*min + (min < NUM_KEYS(node) && load(keys+min*stride) == key); \
+}
+
+INT_SEARCH(search_u32, uint32_t, load_u32)
+INT_SEARCH(search_u64, uint64_t, load_u64)
+INT_SEARCH(search_be32, uint32_t, load_be32)
+INT_SEARCH(search_be64, uint64_t, load_be64)
+
+#ifdef __SSE2__
+// Search for u32 keys without values in between (interior nodes of B+ trees):
+// narrow down the range, then count the keys less than key four at a time
+static int search_u32_packed(const bt_node *node, const void *key_ptr){
+    uint32_t key = load_u32(key_ptr);
+    const uint8_t *keys = PAIRS(node);
+    int min = 0, len = NUM_KEYS(node);
+    while(len > 16){
+        int half = len/2;
+        min += load_u32(keys+(min+half-1)*sizeof(uint32_t)) < key ? half : 0;
+        len -= half;
+    }
+    // SSE2 only compares signed, flipping the sign bits keeps the order
+    const __m128i flip = _mm_set1_epi32(INT32_MIN);
+    const __m128i key_vec = _mm_xor_si128(_mm_set1_epi32(key), flip);
+    int end = min+len, less = 0, i = min;
+    for(; i+4 <= end; i += 4){
+        __m128i vec = _mm_loadu_si128((const __m128i*)(keys+i*sizeof(uint32_t)));
+        __m128i lt = _mm_cmplt_epi32(_mm_xor_si128(vec, flip), key_vec);
+        less += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(lt)));
+    }
+    for(; i < end; i++)
+        less += load_u32(keys+i*sizeof(uint32_t)) < key;
+    min += less;
+    return 2*min + (min < NUM_KEYS(node) && load_u32(keys+min*sizeof(uint32_t)) == key);
+}
+#endif
+
+// Search for keys of any size compared by memcmp(), called directly
+static int search_memcmp(tree_param tree, const bt_node *node, const void *key){
+    size_t stride = tree.key_size+tree.value_size;
+    const uint8_t *keys = PAIRS(node);
+    int min = 0, len = NUM_KEYS(node);
+    while(len > 1){
+        int half = len/2;
+        min += memcmp(keys+(min+half-1)*stride, key, tree.key_size) < 0 ? half : 0;
+        len -= half;
+    }
+    if(len)
+        min += memcmp(keys+min*stride, key, tree.key_size) < 0;
+    return 2*min + (min < NUM_KEYS(node)
+                    && !memcmp(keys+min*stride, key, tree.key_size));
+}
+
 // Returns 2*(index of key)+1 if found, even number if between indices
 static int search_keys(tree_param tree, const bt_node *node, const void *key){
+    // The specialized searches don't call the comparison function,
+    // count the keys they look at (about log2 of the number of keys)
+    if(tree.key_type != KEY_CUSTOM && NUM_KEYS(node))
+        COUNT(tree.tree.alloc, compares, 65-__builtin_clzll(NUM_KEYS(node)));
+    switch(tree.key_type){
+    case KEY_U32:
+#ifdef __SSE2__
+        if(!tree.value_size)
+            return search_u32_packed(node, key);
+#endif
+        return search_u32(tree, node, key);
+    case KEY_U64:
+        return search_u64(tree, node, key);
+    case KEY_MEMCMP:
+        if(tree.key_size == sizeof(uint32_t))
+            return search_be32(tree, node, key);
+        if(tree.key_size == sizeof(uint64_t))
+            return search_be64(tree, node, key);
+        return search_memcmp(tree, node, key);
+    }
     int min = 0;              // min inclusive
     int max = NUM_KEYS(node); // max exclusive
     // binary search
     while(max-min>7){
        int median = (min+max)/2;
-       if(tree.tree.compare(key, PAIR(node, median), tree.key_size)<0)
+       if(compare_keys(tree, key, PAIR(node, median))<0)
            max = median;
        else
            min = median;
     }
     // linear search (could maybe be removed)
     for(;min<max; min++){
-        if(tree.tree.compare(key, PAIR(node, min), tree.key_size)<0)
+        int order = compare_keys(tree, key, PAIR(node, min));
+        if(order<0)
             return 2*min;
-        if(tree.tree.compare(key, PAIR(node, min), tree.key_size)==0)
+        if(order==0)
             return 2*min+1;
     }
     return 2*min;
 }
 
+// Snapshots (see btree_snapshot()) share the nodes that existed when they
+// were taken with the tree. Insertions and removals copy such a node before
+// changing it, the copy takes its place in the parent. So they copy the path
+// from the root (which is in the metadata of the tree, of which snapshots have
+// their own copy) down to the changed nodes, snapshots never see a change.
+// Nodes removed from the tree are retained until no snapshot uses them anymore.
+static inline bool is_shared(tree_param tree, uint32_t birth){
+    return birth <= tree.shared_generation;
+}
+
+// Remember that snapshots still use the node removed from the tree
+static void retain_node(tree_param tree, bt_node_id node_id, uint32_t birth){
+    btree_data *tree_data = LOAD(tree.tree.root);
+    btree snapshots = {tree.tree.alloc, get_snapshots(tree_data), btree_compare_u64};
+    uint64_t key = RETAINED | node_id;
+    uint64_t generations = (uint64_t)birth<<32 | tree.generation;
+    btree_insert(snapshots, &key, &generations);
+    UNLOAD(tree_data);
+}
+
+// Free a node removed from the tree (birth is its node_birth()) unless
+// snapshots still use it
+# define DROP(node_id, birth) (is_shared(tree, birth) ? \
+                               retain_node(tree, node_id, birth) : RETIRE(node_id))
+
+// Make child i of node, which is loaded as *child with id *child_id,
+// safe to change: a shared child is replaced by a copy
+static void unshare_child(tree_param tree, bt_node *node, int i,
+        bt_node_id *child_id, bt_node **child){
+    uint32_t birth = *node_birth(tree.tree.alloc, *child);
+    if(!is_shared(tree, birth))
+        return;
+    bt_node_id copy_id = NEW_NODE();
+    bt_node *copy = LOAD(copy_id);
+    DIRTY(copy);
+    memcpy(copy, *child, tree.tree.alloc->node_size);
+    *node_birth(tree.tree.alloc, copy) = tree.generation;
+    UNLOAD(*child);
+    retain_node(tree, *child_id, birth);
+    DIRTY(node);
+    SET_CHILD(node, i, copy_id);
+    *child_id = copy_id;
+    *child = copy;
+}
+
+// Load child i of node to change it
+static bt_node *load_child_unshared(tree_param tree, bt_node *node, int i,
+        bt_node_id *child_id){
+    *child_id = GET_CHILD(node, i);
+    bt_node *child = LOAD(*child_id);
+    unshare_child(tree, node, i, child_id, &child);
+    return child;
+}
+
 static bt_node *init_node(tree_param tree, bt_node_id node_id, bool leaf){
     bt_node *node = LOAD(node_id);
     btree_data *tree_data = LOAD(tree.tree.root);
+    DIRTY(node);
     NUM_KEYS(node) = 0;
     MAX_KEYS(node) = leaf ? tree_data->max_leaf_keys:
                             tree_data->max_interior_keys;
     UNLOAD(tree_data);
+    *node_birth(tree.tree.alloc, node) = tree.generation;
+    if(tree.concurrent)
+        *node_latch(tree.tree.alloc, node) = 0;
+    tree = at_height(tree, !leaf);
+    if(leaf && tree.bplus)
+        SET_PREV_LEAF(node, 0), SET_NEXT_LEAF(node, 0);
     return node;
 }
 
-// Recursively insert key&value into node. If the node splits, store the id
-// of the new node in split_new_node and the seperator between them in split_pair.
-// Return true if the key was already present, else false.
-static bool insert(tree_param tree, bt_node *node, const uint8_t *pair, int height, void *split_pair, bt_node_id *split_new_node_id){
-    int index = search_keys(tree, node, pair);
-    if(index%2){ // key already present
-        memcpy(PAIR(node, index/2), VALUE(pair), tree.value_size);
-        return true;
+// Split the full leaf node (with id node_id, 0 for the root) of a B+ tree,
+// inserting pair at position child. The separator stays in the new right leaf,
+// only a copy of its key is stored in split_pair. The new leaf is linked in
+// after node; if node is the root, grow_root() links the leaves instead.
+static void split_linked_leaf(tree_param tree, bt_node *node, bt_node_id node_id,
+        int child, const uint8_t *pair, void *split_pair, bt_node_id *split_new_node_id){
+    size_t pair_size = tree.key_size+tree.value_size;
+    bt_node_id right_id = NEW_NODE();
+    bt_node *right = init_node(tree, right_id, true);
+    DIRTY(node);
+    int total = MAX_KEYS(node)+1;
+    int left_keys = (total+1)/2;
+    if(child < left_keys){
+        memcpy(PAIRS(right), PAIR(node, left_keys-1), (total-left_keys)*pair_size);
+        memmove(PAIR(node, child+1), PAIR(node, child), (left_keys-1-child)*pair_size);
+        memcpy(PAIR(node, child), pair, pair_size);
+    } else {
+        memcpy(PAIRS(right), PAIR(node, left_keys), (child-left_keys)*pair_size);
+        memcpy(PAIR(right, child-left_keys), pair, pair_size);
+        memcpy(PAIR(right, child-left_keys+1), PAIR(node, child),
+               (MAX_KEYS(node)-child)*pair_size);
     }
-    bt_node_id new_node_id = 0;
-    int child = index/2;
-    uint8_t child_split_pair[(tree.key_size+tree.value_size)];
-    if(height){
-        bt_node *child_node = LOAD(CHILDREN(node)[child]);
-        bool present = insert(tree, child_node, pair, height-1, 
-                              child_split_pair, &new_node_id);
-        UNLOAD(child_node);
-        if(!new_node_id)
-            return present;
-        pair = child_split_pair;
+    NUM_KEYS(node) = left_keys;
+    NUM_KEYS(right) = total-left_keys;
+
+    bt_node_id next_id = node_id ? NEXT_LEAF(node) : 0;
+    SET_PREV_LEAF(right, node_id);
+    SET_NEXT_LEAF(right, next_id);
+    if(next_id){
+        bt_node *next = LOAD(next_id);
+        latch_node(tree, next);
+        DIRTY(next);
+        SET_PREV_LEAF(next, right_id);
+        unlatch_node(tree, next);
+        UNLOAD(next);
     }
+    if(node_id)
+        SET_NEXT_LEAF(node, right_id);
+
+    memcpy(split_pair, PAIRS(right), tree.key_size);
+    *split_new_node_id = right_id;
+    UNLOAD(right);
+}
+
+// Insert pair at position child of node, in interior nodes new_node_id
+// becomes the child following it. If the node splits, store the id of the new
+// node in split_new_node and the seperator between them in split_pair.
+// node_id is the id of node, or 0 if it is the root.
+static void insert_at(tree_param tree, bt_node *node, bt_node_id node_id, int child,
+        const uint8_t *pair, bt_node_id new_node_id, int height,
+        void *split_pair, bt_node_id *split_new_node_id){
+    tree = at_height(tree, height);
+    DIRTY(node);
     if(NUM_KEYS(node) < MAX_KEYS(node)){
         // enough room, insert new child
         memmove(PAIR(node, child+1), PAIR(node, child), 
                 (tree.key_size+tree.value_size)*(NUM_KEYS(node)-child));
         if(height) // height==0 means leaf → no children
             memmove(CHILD(node, child+2), CHILD(node, child+1), 
-                    sizeof(bt_node_id)*(NUM_KEYS(node)-child));
+                    tree.id_size*(NUM_KEYS(node)-child));
         NUM_KEYS(node)++;
         memcpy(PAIR(node, child), pair, (tree.key_size+tree.value_size));
         if(height)
-            CHILDREN(node)[child+1] = new_node_id;
-        return true;
+            SET_CHILD(node, child+1, new_node_id);
     } else {
         // Node full
-        // TODO: try to push into siblings instead of splitting
+        // btree_insert() only gets here for leaves after trying to share
+        // them with their neighbours (see insert_into_neighbours()).
+        // Interior nodes, batches and BT_SPLIT_HALVES trees split right away.
+        COUNT(tree.tree.alloc, splits, 1);
+        EVENT(tree.tree.alloc, BT_EVENT_SPLIT, height);
+        if(!height && tree.bplus){
+            split_linked_leaf(tree, node, node_id, child, pair,
+                              split_pair, split_new_node_id);
+            return;
+        }
         
         // Split node:
         // Initialize new node
@@ -210,251 +1060,1451 @@ static bool insert(tree_param tree, bt_node *node, const uint8_t *pair, int heig
         NUM_KEYS(right) = MIN_KEYS(node);
 
         // If the key is less than the median insert it into the old node,
-        // if greater insert into the new one.
+        // if greater insert into the new one. The median goes to split_pair,
+        // which doesn't overlap pair.
         // Copy half of the keys into the right node, lower the left ones num_keys.
-        uint8_t median[(tree.key_size+tree.value_size)];
         if(child == NUM_KEYS(node)){
             // Key in middle
-            memcpy(median, pair, (tree.key_size+tree.value_size));
+            memcpy(split_pair, pair, (tree.key_size+tree.value_size));
             memmove(PAIRS(right), PAIR(node, NUM_KEYS(node)),
                     (tree.key_size+tree.value_size)*NUM_KEYS(right));
             if(height)
-                CHILDREN(right)[0] = new_node_id;
+                SET_CHILD(right, 0, new_node_id);
             if(height)
                 for(int i = MAX_KEYS(node)+1; i --> NUM_KEYS(node)+1;)
-                    CHILDREN(right)[i-NUM_KEYS(node)] = CHILDREN(node)[i];
+                    SET_CHILD(right, i-NUM_KEYS(node), GET_CHILD(node, i));
         } else if(child <= MIN_KEYS(node)){
             // Key in left node
             memmove(PAIRS(right), PAIR(node, NUM_KEYS(node)),
                     (tree.key_size+tree.value_size)*NUM_KEYS(right));
             if(height)
                 for(int i = MAX_KEYS(node)+1; i --> NUM_KEYS(node);)
-                    CHILDREN(right)[i-NUM_KEYS(node)] = CHILDREN(node)[i];
-            memcpy(median, PAIR(node, NUM_KEYS(node)-1), (tree.key_size+tree.value_size));
+                    SET_CHILD(right, i-NUM_KEYS(node), GET_CHILD(node, i));
+            memcpy(split_pair, PAIR(node, NUM_KEYS(node)-1), (tree.key_size+tree.value_size));
             memmove(PAIR(node, child+1), PAIR(node, child),
-                    (tree.key_size+tree.value_size)*(NUM_KEYS(node)-child));
+                    (tree.key_size+tree.value_size)*(NUM_KEYS(node)-1-child));
             if(height)
                 for(int i = NUM_KEYS(node); i --> child+1;)
-                    CHILDREN(node)[i+1] = CHILDREN(node)[i];
+                    SET_CHILD(node, i+1, GET_CHILD(node, i));
             memcpy(PAIR(node, child), pair, (tree.key_size+tree.value_size));
             if(height)
-                CHILDREN(node)[child+1] = new_node_id;
+                SET_CHILD(node, child+1, new_node_id);
         } else {
             // Key in right node
-            memcpy(median, PAIR(node, NUM_KEYS(node)), (tree.key_size+tree.value_size));
+            memcpy(split_pair, PAIR(node, NUM_KEYS(node)), (tree.key_size+tree.value_size));
             memmove(PAIRS(right), PAIR(node, NUM_KEYS(node)+1),
                     (tree.key_size+tree.value_size)*(child-NUM_KEYS(node)-1));
             if(height)
                 for(int i = child+1; i --> NUM_KEYS(node)+1;)
-                    CHILDREN(right)[i-NUM_KEYS(node)-1] = CHILDREN(node)[i];
+                    SET_CHILD(right, i-NUM_KEYS(node)-1, GET_CHILD(node, i));
             memcpy(PAIR(right, child-NUM_KEYS(node)-1), pair, (tree.key_size+tree.value_size));
             if(height)
-                CHILDREN(right)[child-NUM_KEYS(node)] = new_node_id;
+                SET_CHILD(right, child-NUM_KEYS(node), new_node_id);
             memmove(PAIR(right, child-NUM_KEYS(node)), PAIR(node, child),
                     (tree.key_size+tree.value_size)*(MAX_KEYS(node)-child));
             if(height)
                 for(int i = MAX_KEYS(node)+1; i --> child+1;)
-                    CHILDREN(right)[i-NUM_KEYS(node)] = CHILDREN(node)[i];
+                    SET_CHILD(right, i-NUM_KEYS(node), GET_CHILD(node, i));
+        }
+        *split_new_node_id = right_id;
+        UNLOAD(right);
+    }
+}
+
+// Move pairs between the adjacent leaves left and right, so that left ends
+// up with left_keys of them. In B-trees their separator (in the parent) takes
+// part in the move, in B+ trees it becomes a copy of the first key of right.
+static void shift_pairs(tree_param tree, bt_node *left, bt_node *right,
+        uint8_t *separator, int left_keys){
+    size_t pair_size = tree.key_size+tree.value_size;
+    if(left_keys == NUM_KEYS(left))
+        return;
+    DIRTY(left);
+    DIRTY(right);
+    if(left_keys < NUM_KEYS(left)){
+        int count = NUM_KEYS(left)-left_keys;
+        memmove(PAIR(right, count), PAIRS(right), NUM_KEYS(right)*pair_size);
+        if(tree.bplus){
+            memcpy(PAIRS(right), PAIR(left, left_keys), count*pair_size);
+        } else {
+            memcpy(PAIR(right, count-1), separator, pair_size);
+            memcpy(PAIRS(right), PAIR(left, left_keys+1), (count-1)*pair_size);
+            memcpy(separator, PAIR(left, left_keys), pair_size);
+        }
+        NUM_KEYS(right) += count;
+    } else {
+        int count = left_keys-NUM_KEYS(left);
+        if(tree.bplus){
+            memcpy(PAIR(left, NUM_KEYS(left)), PAIRS(right), count*pair_size);
+        } else {
+            memcpy(PAIR(left, NUM_KEYS(left)), separator, pair_size);
+            memcpy(PAIR(left, NUM_KEYS(left)+1), PAIRS(right), (count-1)*pair_size);
+            memcpy(separator, PAIR(right, count-1), pair_size);
         }
-        //TODO: eliminate this memcpy
-        memcpy(split_pair, median, (tree.key_size+tree.value_size));
-        *split_new_node_id = right_id;   //Unload?
+        memmove(PAIRS(right), PAIR(right, count), (NUM_KEYS(right)-count)*pair_size);
+        NUM_KEYS(right) -= count;
+    }
+    NUM_KEYS(left) = left_keys;
+    if(tree.bplus)
+        memcpy(separator, PAIRS(right), tree.key_size);
+}
+
+// Release a neighbour loaded by insert_into_neighbours()
+static void release_neighbour(tree_param tree, bt_node *node){
+    if(!node)
+        return;
+    unlatch_node(tree, node);
+    UNLOAD(node);
+}
+
+// The leaf cn, child child_index of node, is full and pair is about to be
+// inserted into it at position pos. Rather than splitting cn in two halves,
+// shift pairs into a neighbouring leaf with room or, if there is none, split
+// cn and a full neighbour into three leaves (like B*-trees), so that leaves
+// stay about two thirds full at least. Appending to a leaf (as ascending keys
+// do) fills the leaf before it completely instead of sharing evenly.
+// Returns false if neither works out, else pair has been inserted. After a
+// split into three, the new leaf *split_new_node_id and the separator before
+// it (split_pair) have to be inserted into node at *split_index.
+// children and separators are those of node, tree is set for the leaves.
+static bool insert_into_neighbours(tree_param tree, bt_node *node, uint8_t *children,
+        uint8_t *separators, int child_index, bt_node_id cn_id, bt_node *cn, int pos,
+        const uint8_t *pair, int *split_index, void *split_pair, bt_node_id *split_new_node_id){
+    size_t separator_size = tree.bplus ? tree.key_size : tree.key_size+tree.value_size;
+    bool append = pos == NUM_KEYS(cn);
+    bt_node_id prev_id = child_index>0 ? load_id(tree, children+(child_index-1)*tree.id_size) : 0;
+    bt_node_id next_id = child_index<NUM_KEYS(node) ?
+                         load_id(tree, children+(child_index+1)*tree.id_size) : 0;
+    bt_node *prev = prev_id ? LOAD(prev_id) : NULL;
+    bt_node *next = next_id ? LOAD(next_id) : NULL;
+    if(prev)
+        latch_node(tree, prev);
+    if(next)
+        latch_node(tree, next);
+
+    // Shifting evenly needs room for two pairs, so that both leaves end up
+    // with room for pair. Otherwise cn is split together with a neighbour,
+    // preferably the previous one: with ascending keys, that's where room is.
+    bool shift = true;
+    int left_index;
+    if(prev && NUM_KEYS(prev) < MAX_KEYS(prev)-!append)
+        left_index = child_index-1;
+    else if(next && NUM_KEYS(next) < MAX_KEYS(next)-1)
+        left_index = child_index;
+    else {
+        shift = false;
+        left_index = prev ? child_index-1 : child_index;
+    }
+    bt_node *left = left_index < child_index ? prev : cn;
+    bt_node *right = left_index < child_index ? cn : next;
+    bt_node_id left_id = left_index < child_index ? prev_id : cn_id;
+    bt_node_id right_id = left_index < child_index ? cn_id : next_id;
+    release_neighbour(tree, left_index < child_index ? next : prev);
+    // Only the leaf before cn is filled completely
+    bool pack = append && right == cn;
+    int total = right ? NUM_KEYS(left)+NUM_KEYS(right) : 0;
+    int left_keys, middle_keys = 0, right_keys = 0;
+    if(shift){
+        // In B-trees, the separator joins the pairs and one of them replaces it
+        left_keys = pack ? MAX_KEYS(left) : total/2;
+    } else {
+        // B-trees need a second separator
+        total -= !tree.bplus;
+        left_keys = pack ? total-2*MIN_KEYS(cn) : total/3;
+        if(left_keys > MAX_KEYS(cn))
+            left_keys = MAX_KEYS(cn);
+        right_keys = pack ? MIN_KEYS(cn) : total/3;
+        middle_keys = total-left_keys-right_keys;
+    }
+    // No neighbour, or leaves too small to be split into three
+    if(!right || (!shift && (left_keys < MIN_KEYS(cn) || left_keys > MAX_KEYS(cn)-!pack
+                             || middle_keys < MIN_KEYS(cn) || middle_keys >= MAX_KEYS(cn)
+                             || right_keys < MIN_KEYS(cn) || right_keys >= MAX_KEYS(cn)))){
+        release_neighbour(tree, left != cn ? left : NULL);
+        release_neighbour(tree, right != cn ? right : NULL);
         return false;
     }
+
+    // A separator of node changes in any case
+    DIRTY(node);
+    if(left != cn)
+        unshare_child(tree, node, left_index, &left_id, &left);
+    if(right != cn)
+        unshare_child(tree, node, left_index+1, &right_id, &right);
+    uint8_t *separator = separators+left_index*separator_size;
+    bt_node *middle = NULL, *target;
+    bt_node_id middle_id = 0, target_id;
+    if(shift){
+        COUNT(tree.tree.alloc, shifts, 1);
+        shift_pairs(tree, left, right, separator, left_keys);
+    } else {
+        COUNT(tree.tree.alloc, splits, 1);
+        EVENT(tree.tree.alloc, BT_EVENT_SPLIT, 0);
+        // The new leaf starts out empty between left and right,
+        // then takes pairs from both
+        middle_id = NEW_NODE();
+        middle = init_node(tree, middle_id, true);
+        latch_node(tree, middle);
+        DIRTY(left);
+        DIRTY(right);
+        if(tree.bplus){
+            memcpy(split_pair, separator, tree.key_size);
+            SET_NEXT_LEAF(left, middle_id);
+            SET_PREV_LEAF(middle, left_id);
+            SET_NEXT_LEAF(middle, right_id);
+            SET_PREV_LEAF(right, middle_id);
+        } else {
+            NUM_KEYS(left)--;
+            memcpy(split_pair, PAIR(left, NUM_KEYS(left)), separator_size);
+        }
+        shift_pairs(tree, middle, right, separator, NUM_KEYS(right)-right_keys);
+        shift_pairs(tree, left, middle, split_pair, left_keys);
+    }
+    if(middle && compare_keys(tree, pair, split_pair) < 0)
+        target = left, target_id = left_id;
+    else if(middle && compare_keys(tree, pair, separator) < 0)
+        target = middle, target_id = middle_id;
+    else if(!middle && compare_keys(tree, pair, separator) < 0)
+        target = left, target_id = left_id;
+    else
+        target = right, target_id = right_id;
+    insert_at(tree, target, target_id, (search_keys(tree, target, pair)+1)/2,
+              pair, 0, 0, NULL, NULL);
+
+    *split_index = left_index;
+    *split_new_node_id = middle_id;
+    release_neighbour(tree, middle);
+    release_neighbour(tree, left != cn ? left : NULL);
+    release_neighbour(tree, right != cn ? right : NULL);
+    return true;
+}
+
+// The root has split into itself and the node split_id, with split_pair as
+// separator between them. Add a level to the tree.
+static void grow_root(tree_param tree, btree_data *tree_data, const uint8_t *split_pair, bt_node_id split_id){
+    bt_node *root = ROOT(tree_data);
+    bt_node *new_node = LOAD(split_id);
+    DIRTY(tree_data);
+    DIRTY(new_node);
+    tree = at_height(tree, tree_data->height);
+    // The separator of split B+ leaves is a copy of the first key of new_node
+    bool separator_copied = tree.bplus && !tree_data->height;
+    
+    // Root node may be smaller than others, in which case we can't
+    // split it (resulting nodes would be below their min_keys).
+    if(MAX_KEYS(root)<MAX_KEYS(new_node)){
+        // In that case move root node data into the new node
+        // and make that a child of the root (root will have 0 keys).
+        int moved = NUM_KEYS(root) + !separator_copied;
+        memmove(PAIR(new_node, moved), PAIRS(new_node),
+                NUM_KEYS(new_node)*(tree.key_size+tree.value_size));
+        if(!separator_copied)
+            memcpy(PAIR(new_node, NUM_KEYS(root)), split_pair, (tree.key_size+tree.value_size));
+        memmove(PAIRS(new_node), PAIRS(root),
+                NUM_KEYS(root)*(tree.key_size+tree.value_size));
+        if(tree_data->height){
+            for(int i=NUM_KEYS(new_node)+1; i --> 0;)
+                SET_CHILD(new_node, i+NUM_KEYS(root)+1, GET_CHILD(new_node, i));
+            for(int i=NUM_KEYS(root)+1; i --> 0;)
+                SET_CHILD(new_node, i, GET_CHILD(root, i));
+        }
+        
+        NUM_KEYS(new_node) += moved;
+        NUM_KEYS(root) = 0;
+        tree = at_height(tree, tree_data->height+1);
+        SET_CHILD(root, 0, split_id);
+    } else {
+        // If that is not the case, move the previous root out
+        // and store both nodes in the new root
+        bt_node_id new_left_id = NEW_NODE();
+        bt_node *new_left = LOAD(new_left_id);
+        DIRTY(new_left);
+        NUM_KEYS(new_left) = NUM_KEYS(root);
+        MAX_KEYS(new_left) = MAX_KEYS(root);
+        *node_birth(tree.tree.alloc, new_left) = tree.generation;
+        if(tree.concurrent)
+            *node_latch(tree.tree.alloc, new_left) = 0;
+        
+        memmove(PAIRS(new_left), PAIRS(root), NUM_KEYS(new_left)*(tree.key_size+tree.value_size));
+        if(tree_data->height)
+            for(int i=NUM_KEYS(new_left)+1; i --> 0;)
+                SET_CHILD(new_left, i, GET_CHILD(root, i));
+        else if(separator_copied){
+            SET_PREV_LEAF(new_left, 0);
+            SET_NEXT_LEAF(new_left, split_id);
+            SET_PREV_LEAF(new_node, new_left_id);
+        }
+
+        UNLOAD(new_left);
+        
+        tree = at_height(tree, tree_data->height+1);
+        NUM_KEYS(root) = 1;
+        memcpy(PAIR(root, 0), split_pair, (tree.key_size+tree.value_size));
+        SET_CHILD(root, 0, new_left_id);
+        SET_CHILD(root, 1, split_id);
+    }
+
+    UNLOAD(new_node);
+    tree_data->height++;
+}
+
+// Insert pair into the non-empty tree, return true if the key was already
+// present. Descends from the root remembering the path, then works back up
+// inserting the separators of splits into the parents.
+static bool insert(tree_param tree, btree_data *tree_data, const uint8_t *pair){
+    int height = tree_data->height;
+    tree_path path;
+    // Nodes on level h store the separator of their split in split_pairs[h%2],
+    // so that it never overwrites the one being inserted into them
+    uint8_t split_pairs[2][tree.key_size+tree.leaf_value_size];
+    bt_node_id split_id = 0;
+    bt_node *node = ROOT(tree_data);
+    bt_node_id node_id = 0;
+    int h = height;
+    int index = search_keys(at_height(tree, h), node, pair);
+    bool present = false;
+    for(;; h--){
+        tree = at_height(tree, h);
+        path[h] = (path_step){node, node_id, (index+1)/2};
+        if(found_pair(tree, index, h)){ // key already present
+            DIRTY(node);
+            memcpy(VALUE(PAIR(node, index/2)), VALUE(pair), tree.value_size);
+            present = true;
+            break;
+        }
+        if(!h){
+            insert_at(tree, node, node_id, path[0].child, pair, 0, 0,
+                      split_pairs[0], &split_id);
+            break;
+        }
+        bt_node *child = load_child_unshared(tree, node, path[h].child, &node_id);
+        latch_push(tree, child);
+        index = search_keys(at_height(tree, h-1), child, pair);
+        // If the child has room, it won't split and the nodes above stay as they are
+        if(NUM_KEYS(child) < MAX_KEYS(child))
+            latch_release_above(tree);
+        else if(h == 1 && !tree.split_halves && !found_pair(tree, index, 0)
+                && insert_into_neighbours(at_height(tree, 0), node, CHILDREN(node),
+                        PAIRS(node), path[1].child, node_id, child, (index+1)/2, pair,
+                        &path[1].child, split_pairs[0], &split_id)){
+            // The full leaf shared with its neighbours instead of splitting
+            path[0] = (path_step){child, node_id, 0};
+            h = 0;
+            break;
+        }
+        node = child;
+    }
+    for(; h < height; h++){
+        tree = at_height(tree, h+1);
+        latch_pop(tree);
+        UNLOAD(path[h].node);
+        if(split_id){
+            bt_node_id new_node_id = split_id;
+            split_id = 0;
+            insert_at(tree, path[h+1].node, path[h+1].id, path[h+1].child,
+                      split_pairs[h%2], new_node_id, h+1,
+                      split_pairs[(h+1)%2], &split_id);
+        }
+    }
+    if(split_id)
+        grow_root(tree, tree_data, split_pairs[height%2], split_id);
+    return present;
 }
 
 bool btree_insert(btree b_tree, const void *key, const void *value){
+    uint64_t start = latency_start(b_tree.alloc);
     btree_data *tree_data = LOAD_TREE(b_tree);
-    tree_param tree = {b_tree, tree_data->key_size, tree_data->value_size};
+    check_writable(tree_data);
+    latch_path path;
+    tree_param tree = latch_root(get_tree_param(b_tree, tree_data), &path, tree_data);
     bt_node *root = ROOT(tree_data);
     uint8_t pair[(tree.key_size+tree.value_size)];
     memcpy(pair, key, tree.key_size);
     memcpy(pair+tree.key_size, value, tree.value_size);
+    bool already_present = false;
     if(tree_data->height==-1){
         // Tree is empty
+        DIRTY(tree_data);
         tree_data->height = 0;
         NUM_KEYS(root) = 1;
         memcpy(PAIR(root, 0), pair, (tree.key_size+tree.value_size));
-
-        UNLOAD_TREE(b_tree, tree_data);
-        return false;
     } else {
-        uint8_t split_pair[(tree.key_size+tree.value_size)];
-        bt_node_id split_id = 0;
-        bool already_present = insert(tree, root,
-                pair, tree_data->height, split_pair, &split_id);
-        if(split_id){
-            bt_node *new_node = LOAD(split_id);
-            
-            // Root node may be smaller than others, in which case we can't
-            // split it (resulting nodes would be below their min_keys).
-            if(MAX_KEYS(root)<MAX_KEYS(new_node)){
-                // In that case move root node data into the new node
-				// and make that a child of the root (root will have 0 keys).
-				memmove(PAIR(new_node, NUM_KEYS(root)+1), PAIRS(new_node),
-						NUM_KEYS(new_node)*(tree.key_size+tree.value_size));
-				memcpy(PAIR(new_node, NUM_KEYS(root)), split_pair, (tree.key_size+tree.value_size));
-				memmove(PAIRS(new_node), PAIRS(root),
-						NUM_KEYS(root)*(tree.key_size+tree.value_size));
-				if(tree_data->height){
-					for(int i=NUM_KEYS(new_node)+1; i --> 0;)
-						CHILDREN(new_node)[i+NUM_KEYS(root)+1]
-							= CHILDREN(new_node)[i];
-					for(int i=NUM_KEYS(root)+1; i --> 0;)
-						CHILDREN(new_node)[i] = CHILDREN(root)[i];
-				}
-				
-				NUM_KEYS(new_node) += NUM_KEYS(root)+1;
-				NUM_KEYS(root) = 0;
-				CHILDREN(root)[0] = split_id;
-			} else {
-                // If that is not the case, move the previous root out
-                // and store both nodes in the new root
-                bt_node_id new_left_id = NEW_NODE();
-                bt_node *new_left = LOAD(new_left_id);
-                NUM_KEYS(new_left) = NUM_KEYS(root);
-                MAX_KEYS(new_left) = MAX_KEYS(root);
-                
-				memmove(PAIRS(new_left), PAIRS(root), NUM_KEYS(new_left)*(tree.key_size+tree.value_size));
-                // If execution reaches here, root is interior
-                for(int i=NUM_KEYS(new_left)+1; i --> 0;)
-                    CHILDREN(new_left)[i] = CHILDREN(root)[i];
-
-                UNLOAD(new_left);
-                
-                NUM_KEYS(root) = 1;
-                memcpy(PAIR(root, 0), split_pair, (tree.key_size+tree.value_size));
-                CHILDREN(root)[0] = new_left_id;
-                CHILDREN(root)[1] = split_id;
-			}
-
-            UNLOAD(new_node);
-            tree_data->height++;
-        }
-        UNLOAD_TREE(b_tree, tree_data);
-        return already_present;
+        already_present = insert(tree, tree_data, pair);
     }
+    unlatch_root(tree, tree_data);
+    UNLOAD_TREE(b_tree, tree_data);
+    latency_end(b_tree.alloc, BT_OP_INSERT, start);
+    return already_present;
 }
 
 
 
-bool btree_is_empty(btree b_tree){
-    btree_data *tree_data = LOAD_TREE(b_tree);
-    bool empty = tree_data->height == -1;
-    UNLOAD_TREE(b_tree, tree_data);
-    return empty;
+// Stable merge sort of n pairs by their keys, tmp needs space for n pairs
+static void sort_pairs(tree_param tree, uint8_t *pairs, uint8_t *tmp, size_t n){
+    size_t pair_size = tree.key_size+tree.value_size;
+    if(n < 2)
+        return;
+    size_t half = n/2;
+    uint8_t *right = pairs+half*pair_size;
+    sort_pairs(tree, pairs, tmp, half);
+    sort_pairs(tree, right, tmp, n-half);
+    // Already in order, which is common for batches of ascending keys
+    if(compare_keys(tree, right-pair_size, right) <= 0)
+        return;
+    size_t a = 0, b = half, out = 0;
+    while(a < half && b < n){
+        // Take from the left half on equality to keep the sort stable
+        if(compare_keys(tree, pairs+b*pair_size, pairs+a*pair_size) < 0)
+            memcpy(tmp+pair_size*out++, pairs+pair_size*b++, pair_size);
+        else
+            memcpy(tmp+pair_size*out++, pairs+pair_size*a++, pair_size);
+    }
+    memcpy(tmp+out*pair_size, pairs+a*pair_size, (half-a)*pair_size);
+    out += half-a;
+    memcpy(pairs, tmp, out*pair_size);
 }
 
+// Number of the n sorted pairs with a key less than that of separator
+static size_t count_below(tree_param tree, const uint8_t *pairs, size_t n, const uint8_t *separator){
+    size_t min = 0, max = n;
+    while(min < max){
+        size_t median = (min+max)/2;
+        if(compare_keys(tree, pairs+median*(tree.key_size+tree.leaf_value_size),
+                    separator) < 0)
+            min = median+1;
+        else
+            max = median;
+    }
+    return min;
+}
 
-
-static bool search(tree_param tree, const bt_node* node, const void *key, uint8_t height, void *value_writeback){
-    int index = search_keys(tree, node, key);
-    if(index%2==1) {
-        // key is in pairs
-        if(value_writeback)
-            memcpy(value_writeback, PAIR(node, index/2)+tree.key_size, tree.value_size);
+// Insert the n sorted pairs into the subtree of node, passing down each run of
+// pairs that belongs into the same child at once. The pairs must belong into
+// this subtree. Stops once node splits, as the remaining pairs might belong
+// into the new node; the split is reported like by insert().
+// Returns the number of pairs processed, counts already present keys in *present.
+static size_t insert_batch(tree_param tree, bt_node *node, bt_node_id node_id,
+        const uint8_t *pairs, size_t n, int height, size_t *present,
+        void *split_pair, bt_node_id *split_new_node_id){
+    size_t pair_size = tree.key_size+tree.leaf_value_size;
+    tree = at_height(tree, height);
+    size_t i = 0;
+    while(i < n){
+        const uint8_t *pair = pairs+i*pair_size;
+        int index = search_keys(tree, node, pair);
+        if(found_pair(tree, index, height)){ // key already present
+            DIRTY(node);
+            memcpy(VALUE(PAIR(node, index/2)), VALUE(pair), tree.value_size);
+            (*present)++;
+            i++;
+            continue;
+        }
+        int child = (index+1)/2;
+        if(!height){
+            i++;
+            insert_at(tree, node, node_id, child, pair, 0, 0, split_pair, split_new_node_id);
+            if(*split_new_node_id)
+                return i;
+            continue;
+        }
+        // All pairs before the separator following the child belong into it
+        size_t run = n-i;
+        if(child < NUM_KEYS(node))
+            run = count_below(tree, pair, run, PAIR(node, child));
+        uint8_t child_split_pair[pair_size];
+        bt_node_id new_node_id = 0;
+        bt_node_id child_id;
+        bt_node *child_node = load_child_unshared(tree, node, child, &child_id);
+        i += insert_batch(tree, child_node, child_id, pair, run, height-1, present,
+                          child_split_pair, &new_node_id);
+        UNLOAD(child_node);
+        if(new_node_id){
+            insert_at(tree, node, node_id, child, child_split_pair, new_node_id, height,
+                      split_pair, split_new_node_id);
+            if(*split_new_node_id)
+                return i;
+        }
+    }
+    return n;
+}
+
+size_t btree_insert_batch(btree b_tree, const void *keys, const void *values, size_t n){
+    btree_data *tree_data = LOAD_TREE(b_tree);
+    check_writable(tree_data);
+    tree_param tree = get_tree_param(b_tree, tree_data);
+    bt_node *root = ROOT(tree_data);
+    size_t pair_size = tree.key_size+tree.value_size;
+    size_t present = 0;
+
+    // Pairs followed by scratch space for sorting,
+    // concurrent trees are only latched for one pair at a time
+    uint8_t *pairs = tree.concurrent ? NULL : malloc(2*n*pair_size);
+    if(!pairs){
+        // Not worth failing over, insert the pairs one by one
+        for(size_t i = 0; i < n; i++)
+            present += btree_insert(b_tree, (const uint8_t*)keys+i*tree.key_size,
+                                    (const uint8_t*)values+i*tree.value_size);
+        UNLOAD_TREE(b_tree, tree_data);
+        return present;
+    }
+    for(size_t i = 0; i < n; i++){
+        memcpy(pairs+i*pair_size, (const uint8_t*)keys+i*tree.key_size, tree.key_size);
+        memcpy(pairs+i*pair_size+tree.key_size,
+               (const uint8_t*)values+i*tree.value_size, tree.value_size);
+    }
+    sort_pairs(tree, pairs, pairs+n*pair_size, n);
+
+    // Of equal keys only the last one is kept, as if inserted one by one
+    size_t unique = 0;
+    for(size_t i = 0; i < n; i++){
+        if(i+1 < n && !compare_keys(tree, pairs+i*pair_size, pairs+(i+1)*pair_size)){
+            present++;
+            continue;
+        }
+        memmove(pairs+unique*pair_size, pairs+i*pair_size, pair_size);
+        unique++;
+    }
+
+    size_t done = 0;
+    if(unique && tree_data->height==-1){
+        // Tree is empty
+        DIRTY(tree_data);
+        tree_data->height = 0;
+        NUM_KEYS(root) = 1;
+        memcpy(PAIR(root, 0), pairs, pair_size);
+        done = 1;
+    }
+    // Each pass ends at a split of the root
+    while(done < unique){
+        uint8_t split_pair[pair_size];
+        bt_node_id split_id = 0;
+        done += insert_batch(tree, root, 0, pairs+done*pair_size, unique-done,
+                             tree_data->height, &present, split_pair, &split_id);
+        if(split_id)
+            grow_root(tree, tree_data, split_pair, split_id);
+    }
+
+    free(pairs);
+    UNLOAD_TREE(b_tree, tree_data);
+    return present;
+}
+
+// Maximum height of trees created by btree_bulk_load()
+#define BULK_MAX_HEIGHT 64
+
+// Rightmost node of a level of a tree under construction by btree_bulk_load()
+typedef struct {
+    bt_node_id id;
+    bt_node *node;
+} bulk_level;
+
+// Append pair to the rightmost leaf. If that is already filled to its
+// target, the pair becomes a separator in the level above instead and a new
+// node is started, which may in turn fill the node above and so on.
+// In B+ trees the pair starts the new leaf and only its key becomes a separator.
+// Returns false if the tree would grow too high.
+static bool bulk_append(tree_param tree, bulk_level *levels, int *level_count,
+        const uint8_t *pair, const uint16_t *target){
+    if(!*level_count){
+        levels[0].id = NEW_NODE();
+        levels[0].node = init_node(tree, levels[0].id, true);
+        *level_count = 1;
+    }
+    // Child following the pair (none in leaves)
+    bt_node_id right_id = 0;
+    for(int level = 0;; level++){
+        tree = at_height(tree, level);
+        bt_node *node = levels[level].node;
+        if(NUM_KEYS(node) < target[level>0]){
+            memcpy(PAIR(node, NUM_KEYS(node)), pair, (tree.key_size+tree.value_size));
+            NUM_KEYS(node)++;
+            if(level)
+                SET_CHILD(node, NUM_KEYS(node), right_id);
+            return true;
+        }
+        // Node is filled, continue with a new one to the right of it
+        if(level+1 == *level_count){
+            // The level above doesn't exist yet, the full node is its first child
+            if(*level_count == BULK_MAX_HEIGHT)
+                return false;
+            levels[level+1].id = NEW_NODE();
+            levels[level+1].node = init_node(tree, levels[level+1].id, false);
+            tree = at_height(tree, level+1);
+            SET_CHILD(levels[level+1].node, 0, levels[level].id);
+            tree = at_height(tree, level);
+            (*level_count)++;
+        }
+        bt_node_id node_id = levels[level].id;
+        levels[level].id = NEW_NODE();
+        levels[level].node = init_node(tree, levels[level].id, level==0);
+        if(level)
+            SET_CHILD(levels[level].node, 0, right_id);
+        else if(tree.bplus){
+            memcpy(PAIRS(levels[0].node), pair, (tree.key_size+tree.value_size));
+            NUM_KEYS(levels[0].node) = 1;
+            SET_NEXT_LEAF(node, levels[0].id);
+            SET_PREV_LEAF(levels[0].node, node_id);
+        }
+        UNLOAD(node);
+        right_id = levels[level].id;
+    }
+}
+
+// The rightmost node of each level might have fewer than MIN_KEYS keys.
+// Make sure the rightmost node of the level has enough keys by moving keys
+// over from its left sibling or by merging it into the sibling.
+// The parent (rightmost node of level+1) has to have at least one key.
+// Returns true if the nodes were merged, so that the parent lost a key.
+static bool bulk_fix_level(tree_param tree, bulk_level *levels, int level){
+    bt_node *node = levels[level].node;
+    if(NUM_KEYS(node) >= MIN_KEYS(node))
+        return false;
+    bt_node *parent = levels[level+1].node;
+    int n = NUM_KEYS(node);
+    tree = at_height(tree, level+1);
+    uint8_t *separator = PAIR(parent, NUM_KEYS(parent)-1);
+    bt_node_id left_id = GET_CHILD(parent, NUM_KEYS(parent)-1);
+    tree = at_height(tree, level);
+    bt_node *left = LOAD(left_id);
+    // The left sibling was unloaded (and may have been written back) since
+    // it was filled, node and parent may have been written back meanwhile
+    DIRTY(left);
+    DIRTY(node);
+    DIRTY(parent);
+    int n_left = NUM_KEYS(left);
+    size_t pair_size = tree.key_size+tree.value_size;
+
+    if(!level && tree.bplus){
+        // The separator is only a copy of the first key of node
+        if(n_left + n >= 2*MIN_KEYS(node)){
+            int d = (n_left + n)/2 - n;
+            memmove(PAIR(node, d), PAIRS(node), n*pair_size);
+            memcpy(PAIRS(node), PAIR(left, n_left-d), d*pair_size);
+            memcpy(separator, PAIRS(node), tree.key_size);
+            NUM_KEYS(left) -= d;
+            NUM_KEYS(node) += d;
+            UNLOAD(left);
+            return false;
+        }
+        memcpy(PAIR(left, n_left), PAIRS(node), n*pair_size);
+        NUM_KEYS(left) += n;
+        SET_NEXT_LEAF(left, 0);
+        NUM_KEYS(parent)--;
+        UNLOAD(node);
+        FREE(levels[level].id);
+        levels[level].id = left_id;
+        levels[level].node = left;
+        return true;
+    }
+
+    if(n_left + n >= 2*MIN_KEYS(node)){
+        // Rotate d pairs (through the separator) so that both have half
+        int d = (n_left + n)/2 - n;
+        memmove(PAIR(node, d), PAIRS(node), n*pair_size);
+        memcpy(PAIR(node, d-1), separator, pair_size);
+        memcpy(PAIRS(node), PAIR(left, n_left-d+1), (d-1)*pair_size);
+        memcpy(separator, PAIR(left, n_left-d), pair_size);
+        if(level){
+            memmove(CHILD(node, d), CHILDREN(node), (n+1)*tree.id_size);
+            memcpy(CHILDREN(node), CHILD(left, n_left-d+1), d*tree.id_size);
+        }
+        NUM_KEYS(left) -= d;
+        NUM_KEYS(node) += d;
+        UNLOAD(left);
+        return false;
+    } else {
+        // Too few for two nodes, merge node into left
+        memcpy(PAIR(left, n_left), separator, pair_size);
+        memcpy(PAIR(left, n_left+1), PAIRS(node), n*pair_size);
+        if(level)
+            memcpy(CHILD(left, n_left+1), CHILDREN(node), (n+1)*tree.id_size);
+        NUM_KEYS(left) += 1 + n;
+        NUM_KEYS(parent)--;
+        UNLOAD(node);
+        FREE(levels[level].id);
+        levels[level].id = left_id;
+        levels[level].node = left;
+        return true;
+    }
+}
+
+btree btree_bulk_load(bt_alloc_ptr alloc, uint8_t key_size, uint8_t value_size,
+        bt_key_comp compare, uint16_t userdata_size, int flags, float fill,
+        bool (*next)(void *key, void *value, void *param), void *param){
+    btree b_tree = btree_create(alloc, key_size, value_size, compare, userdata_size, flags);
+    btree_data *tree_data = LOAD_TREE(b_tree);
+    tree_param tree = get_tree_param(b_tree, tree_data);
+    bt_node *root = ROOT(tree_data);
+
+    if(fill <= 0 || fill > 1)
+        fill = 1;
+    // Number of keys per filled leaf/interior node, at least the minimum
+    uint16_t target[2];
+    uint16_t max_keys[2] = {tree_data->max_leaf_keys, tree_data->max_interior_keys};
+    for(int i = 0; i < 2; i++){
+        target[i] = max_keys[i]*fill;
+        if(target[i] < max_keys[i]/2)
+            target[i] = max_keys[i]/2;
+        if(target[i] < 1)
+            target[i] = 1;
+    }
+
+    bulk_level levels[BULK_MAX_HEIGHT];
+    int level_count = 0;
+    uint8_t pair[(tree.key_size+tree.value_size)];
+    while(next(pair, VALUE(pair), param))
+        if(!bulk_append(tree, levels, &level_count, pair, target))
+            break;
+
+    if(level_count){
+        // Fix up the right edge from the top, after a merge the parent may
+        // have too few keys itself and needs to be fixed again
+        int top = level_count-1;
+        for(int level = top; level --> 0;){
+            for(int l = level; l < top && bulk_fix_level(tree, levels, l); l++);
+            // The top node might have lost its only key
+            if(top && NUM_KEYS(levels[top].node)==0){
+                UNLOAD(levels[top].node);
+                FREE(levels[top].id);
+                top--;
+            }
+        }
+
+        // Move the top node into the root if possible, else proxy it
+        bt_node *top_node = levels[top].node;
+        DIRTY(tree_data);
+        tree = at_height(tree, top);
+        if(NUM_KEYS(top_node) <= MAX_KEYS(root)){
+            NUM_KEYS(root) = NUM_KEYS(top_node);
+            memcpy(PAIRS(root), PAIRS(top_node),
+                    NUM_KEYS(root)*(tree.key_size+tree.value_size));
+            if(top)
+                memcpy(CHILDREN(root), CHILDREN(top_node),
+                        (NUM_KEYS(root)+1)*tree.id_size);
+            UNLOAD(top_node);
+            FREE(levels[top].id);
+            tree_data->height = top;
+        } else {
+            tree = at_height(tree, top+1);
+            NUM_KEYS(root) = 0;
+            SET_CHILD(root, 0, levels[top].id);
+            UNLOAD(top_node);
+            tree_data->height = top+1;
+        }
+        for(int level = top; level --> 0;)
+            UNLOAD(levels[level].node);
+    }
+
+    UNLOAD_TREE(b_tree, tree_data);
+    return b_tree;
+}
+
+bool btree_is_empty(btree b_tree){
+    btree_data *tree_data = LOAD_TREE(b_tree);
+    // Concurrent trees change the height as a single byte, no need to latch
+    bool empty = tree_data->height == -1;
+    UNLOAD_TREE(b_tree, tree_data);
+    return empty;
+}
+
+
+
+static bool search(tree_param tree, const bt_node* node, const void *key, uint8_t height, void *value_writeback){
+    tree = at_height(tree, height);
+    int index = search_keys(tree, node, key);
+    if(found_pair(tree, index, height)) {
+        // key is in pairs
+        if(value_writeback)
+            memcpy(value_writeback, PAIR(node, index/2)+tree.key_size, tree.value_size);
         return true;
     } if(height==0)
         // leaf node & key's not a child
         return false;
     else {
         // recurse
-        bt_node *child = LOAD(CHILDREN(node)[index/2]);
-        return search(tree, child, key, height-1, value_writeback);
+        bt_node *child = LOAD(GET_CHILD(node, (index+1)/2));
+        bool found = search(tree, child, key, height-1, value_writeback);
         UNLOAD(child);
+        return found;
+    }
+}
+
+// Lookup in a concurrent tree without latching: note the version of each node
+// before looking at it and check it afterwards, starting over from the root if
+// it changed. Before moving on to a child, the parent is checked once more to
+// make sure the child id was read from a consistent node.
+static bool search_optimistic(tree_param tree, btree_data *tree_data, const void *key,
+        void *value_writeback){
+    bt_alloc_ptr alloc = tree.tree.alloc;
+    uint8_t value[tree.value_size];
+    epoch_slot *slot = epoch_enter();
+    int spins = 0;
+    for(;;){
+        uint32_t *latch = node_latch(alloc, tree_data);
+        uint32_t version = version_read(latch);
+        int height = tree_data->height;
+        bt_node *node = ROOT(tree_data), *loaded = NULL;
+        bool found = false;
+        for(; height >= 0; height--){
+            tree = at_height(tree, height);
+            int index = search_keys(tree, node, key);
+            if(!height){
+                found = index%2;
+                if(found)
+                    memcpy(value, VALUE(PAIR(node, index/2)), tree.value_size);
+                break;
+            }
+            bt_node_id child_id = GET_CHILD(node, (index+1)/2);
+            if(!version_check(latch, version))
+                break;
+            bt_node *child = LOAD(child_id);
+            uint32_t *child_latch = node_latch(alloc, child);
+            uint32_t child_version = version_read(child_latch);
+            if(!version_check(latch, version)){
+                UNLOAD(child);
+                break;
+            }
+            if(loaded)
+                UNLOAD(loaded);
+            node = loaded = child;
+            latch = child_latch;
+            version = child_version;
+        }
+        bool valid = height <= 0 && version_check(latch, version);
+        if(loaded)
+            UNLOAD(loaded);
+        if(valid){
+            epoch_leave(slot);
+            if(found && value_writeback)
+                memcpy(value_writeback, value, tree.value_size);
+            return found;
+        }
+        latch_backoff(&spins);
     }
 }
 
 bool btree_contains(btree b_tree, const void *key){
+    return btree_get(b_tree, key, NULL);
+}
+
+bool btree_get(btree b_tree, const void *key, void *value){
+    uint64_t start = latency_start(b_tree.alloc);
     btree_data *tree_data = LOAD_TREE(b_tree);
-    tree_param tree = (tree_param){b_tree, tree_data->key_size, tree_data->value_size};
-    if(tree_data->height>=0){
-        UNLOAD_TREE(b_tree, tree_data);
-        return search(tree, ROOT(tree_data), key, tree_data->height, NULL);
-    } else {
+    tree_param tree = get_tree_param(b_tree, tree_data);
+    bool found = false;
+    if(tree.concurrent)
+        found = search_optimistic(tree, tree_data, key, value);
+    else if(tree_data->height>=0)
+        found = search(tree, ROOT(tree_data), key, tree_data->height, value);
+    UNLOAD_TREE(b_tree, tree_data);
+    latency_end(b_tree.alloc, BT_OP_GET, start);
+    return found;
+}
+
+// Number of lookups btree_get_many() interleaves
+#define GET_MANY_GROUP 16
+
+// Hint the CPU to fetch the parts of a node that search_keys() reads first
+static void prefetch_node(tree_param tree, const bt_node *node, int max_keys){
+    size_t pairs_size = (size_t)max_keys*(tree.key_size+tree.value_size);
+    __builtin_prefetch(node);
+    __builtin_prefetch((const char*)PAIRS(node) + pairs_size/4);
+    __builtin_prefetch((const char*)PAIRS(node) + pairs_size/2);
+    __builtin_prefetch((const char*)PAIRS(node) + pairs_size*3/4);
+}
+
+size_t btree_get_many(btree b_tree, const void *keys, size_t n, void *values_out, bool *found_out){
+    btree_data *tree_data = LOAD_TREE(b_tree);
+    tree_param tree = get_tree_param(b_tree, tree_data);
+    size_t found_count = 0;
+    scan_begin(tree, tree_data);
+    if(tree_data->height<0){
+        if(found_out)
+            memset(found_out, 0, n*sizeof(bool));
+        scan_end(tree, tree_data);
         UNLOAD_TREE(b_tree, tree_data);
-        return false;
+        return 0;
+    }
+    bt_node *root = ROOT(tree_data);
+
+    // Descend with a group of lookups at once, one level per round,
+    // so that the cache misses of the lookups overlap
+    for(size_t start = 0; start < n; start += GET_MANY_GROUP){
+        int count = n-start < GET_MANY_GROUP ? n-start : GET_MANY_GROUP;
+        bt_node *nodes[GET_MANY_GROUP];
+        for(int i = 0; i < count; i++)
+            nodes[i] = root;
+        int active = count;
+        for(int height = tree_data->height; active; height--){
+            tree = at_height(tree, height);
+            for(int i = 0; i < count; i++){
+                bt_node *node = nodes[i];
+                if(!node)
+                    continue;
+                size_t k = start+i;
+                const uint8_t *key = (const uint8_t*)keys + k*tree.key_size;
+                int index = search_keys(tree, node, key);
+                bool found = found_pair(tree, index, height);
+                bt_node *child = NULL;
+                if(found){
+                    if(values_out)
+                        memcpy((uint8_t*)values_out + k*tree.value_size,
+                               VALUE(PAIR(node, index/2)), tree.value_size);
+                    found_count++;
+                } else if(height){
+                    child = LOAD(GET_CHILD(node, (index+1)/2));
+                    // Hidden behind the searches of the other lookups
+                    prefetch_node(at_height(tree, height-1), child,
+                                  height>1 ? tree_data->max_interior_keys
+                                           : tree_data->max_leaf_keys);
+                }
+                if(found_out && (found || !height))
+                    found_out[k] = found;
+                if(node != root)
+                    UNLOAD(node);
+                nodes[i] = child;
+                if(!child)
+                    active--;
+            }
+        }
     }
+
+    scan_end(tree, tree_data);
+    UNLOAD_TREE(b_tree, tree_data);
+    return found_count;
 }
 
-bool btree_get(btree b_tree, const void *key, void *value){
+// Find the biggest key less than or equal to key, store its pair in pair_out.
+// Keys found deeper in the tree are closer to key than the separator
+// left of the child, which is only used if the subtree has no candidate.
+// In B+ trees, the candidate is in the leaf the key belongs into or else the
+// last key of the previous leaf. node_id is the id of node, 0 for the root.
+static bool search_floor(tree_param tree, const bt_node *node, bt_node_id node_id,
+        const void *key, int height, void *pair_out){
+    tree = at_height(tree, height);
+    int index = search_keys(tree, node, key);
+    if(found_pair(tree, index, height)){
+        memcpy(pair_out, PAIR(node, index/2), tree.key_size+tree.value_size);
+        return true;
+    }
+    bool found = false;
+    if(height){
+        bt_node_id child_id = GET_CHILD(node, (index+1)/2);
+        bt_node *child = LOAD(child_id);
+        found = search_floor(tree, child, child_id, key, height-1, pair_out);
+        UNLOAD(child);
+        if(tree.bplus)
+            return found;
+    }
+    if(!found && index/2>0){
+        memcpy(pair_out, PAIR(node, index/2-1), tree.key_size+tree.value_size);
+        found = true;
+    } else if(!found && tree.bplus && node_id && PREV_LEAF(node)){
+        bt_node *prev = LOAD(PREV_LEAF(node));
+        memcpy(pair_out, PAIR(prev, NUM_KEYS(prev)-1), tree.key_size+tree.value_size);
+        UNLOAD(prev);
+        found = true;
+    }
+    return found;
+}
+
+// Copy the pair into key_out and value_out, either of which may be NULL
+static void split_pair_out(tree_param tree, const uint8_t *pair, void *key_out, void *value_out){
+    if(key_out)
+        memcpy(key_out, pair, tree.key_size);
+    if(value_out)
+        memcpy(value_out, VALUE(pair), tree.value_size);
+}
+
+bool btree_get_floor(btree b_tree, const void *key, void *key_out, void *value_out){
     btree_data *tree_data = LOAD_TREE(b_tree);
-    tree_param tree = (tree_param){b_tree, tree_data->key_size, tree_data->value_size};
+    tree_param tree = get_tree_param(b_tree, tree_data);
+    uint8_t pair[(tree.key_size+tree.value_size)];
     bool found = false;
-    if(tree_data->height>=0){
-        found = search(tree, ROOT(tree_data), key, tree_data->height, value);
+    scan_begin(tree, tree_data);
+    if(tree_data->height>=0)
+        found = search_floor(tree, ROOT(tree_data), 0, key, tree_data->height, pair);
+    scan_end(tree, tree_data);
+    if(found)
+        split_pair_out(tree, pair, key_out, value_out);
+    UNLOAD_TREE(b_tree, tree_data);
+    return found;
+}
+
+// Find the smallest key greater than or equal to key, like search_floor()
+// the other way round: the separator right of the child is only used if
+// the subtree has no candidate, in B+ trees the first key of the next leaf.
+static bool search_ceil(tree_param tree, const bt_node *node, bt_node_id node_id,
+        const void *key, int height, void *pair_out){
+    tree = at_height(tree, height);
+    int index = search_keys(tree, node, key);
+    if(found_pair(tree, index, height)){
+        memcpy(pair_out, PAIR(node, index/2), tree.key_size+tree.value_size);
+        return true;
+    }
+    bool found = false;
+    if(height){
+        bt_node_id child_id = GET_CHILD(node, (index+1)/2);
+        bt_node *child = LOAD(child_id);
+        found = search_ceil(tree, child, child_id, key, height-1, pair_out);
+        UNLOAD(child);
+        if(tree.bplus)
+            return found;
+    }
+    if(!found && (index+1)/2 < NUM_KEYS(node)){
+        memcpy(pair_out, PAIR(node, (index+1)/2), tree.key_size+tree.value_size);
+        found = true;
+    } else if(!found && tree.bplus && node_id && NEXT_LEAF(node)){
+        bt_node *next = LOAD(NEXT_LEAF(node));
+        memcpy(pair_out, PAIRS(next), tree.key_size+tree.value_size);
+        UNLOAD(next);
+        found = true;
     }
+    return found;
+}
+
+bool btree_get_ceil(btree b_tree, const void *key, void *key_out, void *value_out){
+    btree_data *tree_data = LOAD_TREE(b_tree);
+    tree_param tree = get_tree_param(b_tree, tree_data);
+    uint8_t pair[(tree.key_size+tree.value_size)];
+    bool found = false;
+    scan_begin(tree, tree_data);
+    if(tree_data->height>=0)
+        found = search_ceil(tree, ROOT(tree_data), 0, key, tree_data->height, pair);
+    scan_end(tree, tree_data);
+    if(found)
+        split_pair_out(tree, pair, key_out, value_out);
     UNLOAD_TREE(b_tree, tree_data);
     return found;
 }
 
+static void find_smallest(tree_param tree, const bt_node *node, int height, void *writeback);
+
+bool btree_get_min(btree b_tree, void *key_out, void *value_out){
+    btree_data *tree_data = LOAD_TREE(b_tree);
+    tree_param tree = get_tree_param(b_tree, tree_data);
+    scan_begin(tree, tree_data);
+    bool found = tree_data->height>=0;
+    if(found){
+        uint8_t pair[(tree.key_size+tree.value_size)];
+        find_smallest(tree, ROOT(tree_data), tree_data->height, pair);
+        split_pair_out(tree, pair, key_out, value_out);
+    }
+    scan_end(tree, tree_data);
+    UNLOAD_TREE(b_tree, tree_data);
+    return found;
+}
+
+
 
+// Children of a node that a scan announced (see prefetch_children()),
+// step is 0 until it started
+#define PREFETCH_NODES 16
+typedef struct {
+    int next;
+    int step;
+} prefetch_state;
+
+// Announce the children of node that a scan at child (going backwards if
+// reverse) will load next to the allocator, up to PREFETCH_NODES ahead in
+// batches of half that, so that reading them overlaps
+static void prefetch_children(tree_param tree, const bt_node *node, int child,
+        bool reverse, prefetch_state *state){
+    bt_alloc_ptr alloc = tree.tree.alloc;
+    if(!alloc->prefetch)
+        return;
+    int step = reverse ? -1 : 1;
+    // The scan started or turned
+    if(state->step != step || (state->next-child)*step < 0)
+        *state = (prefetch_state){child, step};
+    if((state->next-child)*step > PREFETCH_NODES/2)
+        return;
+    bt_node_id ids[PREFETCH_NODES+1];
+    int count = 0;
+    for(; state->next >= 0 && state->next <= NUM_KEYS(node)
+            && (state->next-child)*step <= PREFETCH_NODES; state->next += step)
+        ids[count++] = GET_CHILD(node, state->next);
+    if(count)
+        alloc->prefetch(tree.tree, ids, count);
+}
 
+// In B+ trees, this visits the leaves through their parents as well, so that
+// the next ones can be announced if the allocator takes them
 static bool traverse(tree_param tree, bt_node *node,
         bool (*callback)(const void*, void*, void*),
         void* params, bool reverse, int height){
+    tree = at_height(tree, height);
+    // Interior pairs of B+ trees are only copies of keys
+    int pairs = tree.bplus && height ? 0 : NUM_KEYS(node);
+    prefetch_state prefetch = {0};
     if(!reverse)
         for(int i=0; i <= NUM_KEYS(node); i++){
             if(height) {
-                bt_node *child = LOAD(CHILDREN(node)[i]);
-                traverse(tree, child, callback, params, reverse, height-1);
+                prefetch_children(tree, node, i, false, &prefetch);
+                bt_node *child = LOAD(GET_CHILD(node, i));
+                bool aborted = traverse(tree, child, callback, params, reverse, height-1);
                 UNLOAD(child);
+                if(aborted)
+                    return true;
             }
-            if(i<NUM_KEYS(node))
+            if(i<pairs)
                 if(callback(PAIR(node, i), VALUE(PAIR(node, i)), params))
                     return true;
         }
     else
         for(int i=NUM_KEYS(node)+1; i --> 0;){
+            if(i<pairs)
+                if(callback(PAIR(node, i), VALUE(PAIR(node, i)), params))
+                    return true;
             if(height) {
-                bt_node *child = LOAD(CHILDREN(node)[i]);
-                traverse(tree, child, callback, params, reverse, height-1);
+                prefetch_children(tree, node, i, true, &prefetch);
+                bt_node *child = LOAD(GET_CHILD(node, i));
+                bool aborted = traverse(tree, child, callback, params, reverse, height-1);
                 UNLOAD(child);
-            }
-            if(i<NUM_KEYS(node))
-                if(callback(PAIR(node, i), VALUE(PAIR(node, i)), params))
+                if(aborted)
                     return true;
+            }
         }
     return false;
 }
 
+// Traversal of B+ trees if the allocator doesn't prefetch: descend to the
+// first (or last) leaf once, then follow the links between the leaves
+static bool traverse_leaves(tree_param tree, bt_node *root,
+        bool (*callback)(const void*, void*, void*),
+        void* params, bool reverse, int height){
+    bt_node *node = root;
+    for(int h = height; h > 0; h--){
+        tree = at_height(tree, h);
+        bt_node *child = LOAD(GET_CHILD(node, reverse ? NUM_KEYS(node) : 0));
+        if(node != root)
+            UNLOAD((bt_node*)node);
+        node = child;
+    }
+    tree = at_height(tree, 0);
+    for(;;){
+        for(int i = 0; i < NUM_KEYS(node); i++){
+            uint8_t *pair = PAIR(node, reverse ? NUM_KEYS(node)-1-i : i);
+            if(callback(pair, VALUE(pair), params)){
+                if(node != root)
+                    UNLOAD(node);
+                return true;
+            }
+        }
+        // A root leaf has no siblings
+        if(node == root)
+            return false;
+        bt_node_id sibling = reverse ? PREV_LEAF(node) : NEXT_LEAF(node);
+        UNLOAD(node);
+        if(!sibling)
+            return false;
+        node = LOAD(sibling);
+    }
+}
+
 bool btree_traverse(btree b_tree, 
         bool (*callback)(const void*, void*, void*),
         void* id, bool reverse){
+    uint64_t start = latency_start(b_tree.alloc);
     btree_data *tree_data = LOAD_TREE(b_tree);
-    tree_param tree = (tree_param){b_tree, tree_data->key_size, tree_data->value_size};
+    tree_param tree = get_tree_param(b_tree, tree_data);
     bool aborted = false;
-    if(tree_data->height>=0)
+    scan_begin(tree, tree_data);
+    if(tree_data->height>=0 && tree.bplus && !b_tree.alloc->prefetch)
+        aborted = traverse_leaves(tree, ROOT(tree_data), callback,
+                                  id, reverse, tree_data->height);
+    else if(tree_data->height>=0)
         aborted = traverse(tree, ROOT(tree_data), callback, 
                            id, reverse, tree_data->height);
+    scan_end(tree, tree_data);
     UNLOAD_TREE(b_tree, tree_data);
+    latency_end(b_tree.alloc, BT_OP_TRAVERSE, start);
     return aborted;
 }
 
-static void find_smallest(tree_param tree, const bt_node *node, int height, void *writeback){
-    if(!height)
-        memcpy(writeback, PAIR(node, 0), (tree.key_size+tree.value_size));
-    else {
-        bt_node *child = LOAD(CHILDREN(node)[0]);
-        find_smallest(tree, child, height-1, writeback);
-        UNLOAD(child);
+
+// A cursor keeps the path from the root to its current pair loaded.
+// nodes[0] is the root, nodes[depth-1] contains the current pair at
+// indices[depth-1]; for the nodes above, indices is the child taken.
+// Node nodes[i] is at height height-i.
+// Moving on to the next child of a node announces the children after it
+// (see prefetch_children()). In B+ trees, the cursor moves along the linked
+// leaves, so the path above the leaf is out of date after that (only used
+// again on a new seek). Only if the allocator prefetches, it moves from leaf
+// to leaf through their parents instead, to announce the next leaves.
+struct bt_cursor {
+    tree_param tree;
+    btree_data *tree_data;
+    int height;
+    int depth;
+    bool valid;
+    struct {
+        bt_node *node;
+        int index;
+        prefetch_state prefetch;
+    } path[];
+};
+
+bt_cursor *btree_cursor_open(btree b_tree){
+    btree_data *tree_data = LOAD_TREE(b_tree);
+    tree_param tree = get_tree_param(b_tree, tree_data);
+    scan_begin(tree, tree_data);
+    int height = tree_data->height >= 0 ? tree_data->height : 0;
+    bt_cursor *cursor = malloc(sizeof(bt_cursor) + (height+1)*sizeof(cursor->path[0]));
+    if(!cursor){
+        scan_end(tree, tree_data);
+        UNLOAD_TREE(b_tree, tree_data);
+        return NULL;
     }
+    cursor->tree = tree;
+    cursor->tree_data = tree_data;
+    cursor->height = tree_data->height;
+    cursor->depth = 0;
+    cursor->valid = false;
+    return cursor;
 }
 
-static void find_biggest(tree_param tree, const bt_node *node, int height, void *writeback){
-    if(!height)
-        memcpy(writeback, PAIR(node, NUM_KEYS(node)-1), (tree.key_size+tree.value_size));
-    else {
-        bt_node *child = LOAD(CHILDREN(node)[0]);
-        find_biggest(tree, child, height-1, writeback);
-        UNLOAD(child);
+// Unload the path below depth
+static void cursor_truncate(bt_cursor *cursor, int depth){
+    tree_param tree = cursor->tree;
+    // The root is part of the tree data
+    for(; cursor->depth > depth; cursor->depth--)
+        if(cursor->depth > 1)
+            UNLOAD(cursor->path[cursor->depth-1].node);
+    cursor->valid = false;
+}
+
+// Append the child of the last node on the path. Unless seeking, the cursor
+// moves on through the children, backwards if reverse.
+static bt_node *cursor_push_child(bt_cursor *cursor, int child, bool seeking, bool reverse){
+    tree_param tree = at_height(cursor->tree, cursor->height-cursor->depth+1);
+    bt_node *node = cursor->path[cursor->depth-1].node;
+    cursor->path[cursor->depth-1].index = child;
+    if(!seeking)
+        prefetch_children(tree, node, child, reverse, &cursor->path[cursor->depth-1].prefetch);
+    bt_node *child_node = LOAD(GET_CHILD(node, child));
+    cursor->path[cursor->depth].node = child_node;
+    cursor->path[cursor->depth++].prefetch.step = 0;
+    return child_node;
+}
+
+// Descend from the last node on the path to the leftmost/rightmost pair
+static void cursor_descend(bt_cursor *cursor, bool rightmost){
+    bt_node *node = cursor->path[cursor->depth-1].node;
+    while(cursor->depth <= cursor->height)
+        node = cursor_push_child(cursor, rightmost ? NUM_KEYS(node) : 0, false, rightmost);
+    cursor->path[cursor->depth-1].index = rightmost ? NUM_KEYS(node)-1 : 0;
+    cursor->valid = true;
+}
+
+static bool cursor_start(bt_cursor *cursor){
+    cursor_truncate(cursor, 0);
+    if(cursor->height < 0)
+        return false;
+    cursor->path[0].node = ROOT(cursor->tree_data);
+    cursor->path[0].prefetch.step = 0;
+    cursor->depth = 1;
+    return true;
+}
+
+bool btree_cursor_first(bt_cursor *cursor){
+    if(cursor_start(cursor))
+        cursor_descend(cursor, false);
+    return cursor->valid;
+}
+
+bool btree_cursor_last(bt_cursor *cursor){
+    if(cursor_start(cursor))
+        cursor_descend(cursor, true);
+    return cursor->valid;
+}
+
+// Move to the next/previous pair in a B+ tree
+static bool cursor_step_leaf(bt_cursor *cursor, bool forward){
+    tree_param tree = at_height(cursor->tree, 0);
+    int level = cursor->depth-1;
+    bt_node *node = cursor->path[level].node;
+    int index = cursor->path[level].index + (forward ? 1 : -1);
+    if(index >= 0 && index < NUM_KEYS(node)){
+        cursor->path[level].index = index;
+        return true;
+    }
+    if(!tree.tree.alloc->prefetch){
+        // A root leaf has no siblings
+        bt_node_id sibling = !level ? 0 : forward ? NEXT_LEAF(node) : PREV_LEAF(node);
+        if(!sibling){
+            cursor_truncate(cursor, 0);
+            return false;
+        }
+        UNLOAD(node);
+        node = LOAD(sibling);
+        cursor->path[level].node = node;
+        cursor->path[level].index = forward ? 0 : NUM_KEYS(node)-1;
+        return true;
+    }
+    // Go up to the first ancestor with a child after (before) the one taken
+    for(level--; level >= 0; level--){
+        int child = cursor->path[level].index + (forward ? 1 : -1);
+        if(child >= 0 && child <= NUM_KEYS(cursor->path[level].node)){
+            cursor_truncate(cursor, level+1);
+            cursor_push_child(cursor, child, false, !forward);
+            cursor_descend(cursor, !forward);
+            return true;
+        }
+    }
+    cursor_truncate(cursor, 0);
+    return false;
+}
+
+bool btree_cursor_next(bt_cursor *cursor){
+    if(!cursor->valid)
+        return false;
+    if(cursor->tree.bplus)
+        return cursor_step_leaf(cursor, true);
+    int level = cursor->depth-1;
+    bt_node *node = cursor->path[level].node;
+    if(level < cursor->height){
+        // The next pair is the smallest in the right subtree
+        cursor_push_child(cursor, cursor->path[level].index+1, false, false);
+        cursor_descend(cursor, false);
+        return true;
+    }
+    if(++cursor->path[level].index < NUM_KEYS(node))
+        return true;
+    // Go up to the first ancestor that has a pair right of the child taken
+    for(; level >= 0; level--){
+        if(cursor->path[level].index < NUM_KEYS(cursor->path[level].node)){
+            cursor_truncate(cursor, level+1);
+            cursor->valid = true;
+            return true;
+        }
+    }
+    cursor_truncate(cursor, 0);
+    return false;
+}
+
+bool btree_cursor_prev(bt_cursor *cursor){
+    if(!cursor->valid)
+        return false;
+    if(cursor->tree.bplus)
+        return cursor_step_leaf(cursor, false);
+    int level = cursor->depth-1;
+    if(level < cursor->height){
+        // The previous pair is the biggest in the left subtree
+        cursor_push_child(cursor, cursor->path[level].index, false, true);
+        cursor_descend(cursor, true);
+        return true;
+    }
+    if(--cursor->path[level].index >= 0)
+        return true;
+    // Go up to the first ancestor that has a pair left of the child taken
+    for(level--; level >= 0; level--){
+        if(cursor->path[level].index > 0){
+            cursor->path[level].index--;
+            cursor_truncate(cursor, level+1);
+            cursor->valid = true;
+            return true;
+        }
+    }
+    cursor_truncate(cursor, 0);
+    return false;
+}
+
+bool btree_cursor_seek(bt_cursor *cursor, const void *key){
+    if(!cursor_start(cursor))
+        return false;
+    for(;;){
+        int height = cursor->height-cursor->depth+1;
+        tree_param tree = at_height(cursor->tree, height);
+        bt_node *node = cursor->path[cursor->depth-1].node;
+        int index = search_keys(tree, node, key);
+        if(found_pair(tree, index, height) || !height){
+            cursor->path[cursor->depth-1].index = index/2;
+            cursor->valid = true;
+            // All keys in the leaf are smaller, continue after the last one
+            if(index/2 == NUM_KEYS(node)){
+                cursor->path[cursor->depth-1].index--;
+                return btree_cursor_next(cursor);
+            }
+            return true;
+        }
+        cursor_push_child(cursor, (index+1)/2, true, false);
     }
 }
 
+bool btree_cursor_get(bt_cursor *cursor, const void **key, void **value){
+    if(!cursor->valid)
+        return false;
+    tree_param tree = at_height(cursor->tree, cursor->height-cursor->depth+1);
+    uint8_t *pair = PAIR(cursor->path[cursor->depth-1].node,
+                         cursor->path[cursor->depth-1].index);
+    if(key)
+        *key = pair;
+    if(value)
+        *value = VALUE(pair);
+    return true;
+}
+
+void btree_cursor_close(bt_cursor *cursor){
+    cursor_truncate(cursor, 0);
+    scan_end(cursor->tree, cursor->tree_data);
+    UNLOAD_TREE(cursor->tree.tree, cursor->tree_data);
+    free(cursor);
+}
+
+bool btree_traverse_range(btree b_tree, const void *from, const void *to,
+        bool (*callback)(const void*, void*, void*),
+        void *params, bool reverse){
+    bt_cursor *cursor = btree_cursor_open(b_tree);
+    if(!cursor)
+        return false;
+    bool aborted = false;
+    const void *key;
+    void *value;
+    if(!reverse){
+        if(from ? btree_cursor_seek(cursor, from) : btree_cursor_first(cursor))
+            do {
+                btree_cursor_get(cursor, &key, &value);
+                if(to && compare_keys(cursor->tree, key, to) >= 0)
+                    break;
+                aborted = callback(key, value, params);
+            } while(!aborted && btree_cursor_next(cursor));
+    } else {
+        // Start at the last key less than to
+        bool positioned = to && btree_cursor_seek(cursor, to) ?
+                          btree_cursor_prev(cursor) : btree_cursor_last(cursor);
+        if(positioned)
+            do {
+                btree_cursor_get(cursor, &key, &value);
+                if(from && compare_keys(cursor->tree, key, from) < 0)
+                    break;
+                aborted = callback(key, value, params);
+            } while(!aborted && btree_cursor_prev(cursor));
+    }
+    btree_cursor_close(cursor);
+    return aborted;
+}
+
+static void find_smallest(tree_param tree, const bt_node *node, int height, void *writeback){
+    const bt_node *root = node;
+    for(; height; height--){
+        tree = at_height(tree, height);
+        bt_node *child = LOAD(GET_CHILD(node, 0));
+        if(node != root)
+            UNLOAD((bt_node*)node);
+        node = child;
+    }
+    tree = at_height(tree, 0);
+    memcpy(writeback, PAIR(node, 0), (tree.key_size+tree.value_size));
+    if(node != root)
+        UNLOAD((bt_node*)node);
+}
+
 static void free_node(tree_param tree, bt_node *node, int height){
+    tree = at_height(tree, height);
     if(height>0)
         for(int i=NUM_KEYS(node)+1; i --> 0;){
-            bt_node_id child_id = CHILDREN(node)[i];
+            bt_node_id child_id = GET_CHILD(node, i);
             if(height>1) {
                 bt_node *child = LOAD(child_id);
                 free_node(tree, child, height-1);
@@ -466,174 +2516,553 @@ static void free_node(tree_param tree, bt_node *node, int height){
 
 void btree_delete(btree b_tree){
     btree_data *tree_data = LOAD_TREE(b_tree);
-    tree_param tree = (tree_param){b_tree, tree_data->key_size, tree_data->value_size};
+    check_writable(tree_data);
+    if(get_snapshots(tree_data)){
+        fputs("Error: The snapshots of a tree have to be released before deleting it\n", stderr);
+        exit(1);
+    }
+    tree_param tree = get_tree_param(b_tree, tree_data);
+    if(tree.concurrent){
+        pthread_mutex_lock(&retired_lock);
+        reclaim_nodes(&b_tree);
+        pthread_mutex_unlock(&retired_lock);
+    }
     if(tree_data->height>=0)
         free_node(tree, ROOT(tree_data), tree_data->height);
     UNLOAD_TREE(b_tree, tree_data);
     FREE(b_tree.root);
 }
 
-static bool remove_key(tree_param tree, bt_node *node, const void *key, void *value_out, int height){
-    int index = search_keys(tree, node, key);
-    if(!height){
-        if(!(index%2))
-            return false;
-        if(value_out)
-            memmove(value_out, VALUE(PAIR(node, index/2)), tree.value_size);
-        memmove(PAIR(node, index/2), PAIR(node, index/2+1), 
-                (NUM_KEYS(node)-1-index/2)*(tree.key_size+tree.value_size));
-        // parent will check if below min number of keys
-        NUM_KEYS(node)--;
+// Counts the nodes below node, noting the lowest id among them in *lowest
+static uint64_t count_nodes(tree_param tree, const bt_node *node, int height,
+        bt_node_id *lowest){
+    tree = at_height(tree, height);
+    uint64_t count = 0;
+    for(int i = 0; i <= NUM_KEYS(node); i++){
+        bt_node_id child_id = GET_CHILD(node, i);
+        if(child_id < *lowest)
+            *lowest = child_id;
+        count++;
+        if(height > 1){
+            bt_node *child = LOAD(child_id);
+            count += count_nodes(tree, child, height-1, lowest);
+            UNLOAD(child);
+        }
+    }
+    return count;
+}
+
+// Moves the nodes of the subtree of node on level target (a height) to the
+// ids from *next_id on, in key order, and frees their old ids. Moved leaves
+// of B+ trees are linked to *prev_leaf, the last one moved before them.
+static void relocate_level(tree_param tree, bt_node *node, int height, int target,
+        bt_node_id *next_id, bt_node_id *prev_leaf){
+    tree = at_height(tree, height);
+    for(int i = 0; i <= NUM_KEYS(node); i++){
+        bt_node_id child_id = GET_CHILD(node, i);
+        bt_node *child = LOAD(child_id);
+        if(height-1 > target){
+            relocate_level(tree, child, height-1, target, next_id, prev_leaf);
+            UNLOAD(child);
+            continue;
+        }
+        bt_node_id copy_id = (*next_id)++;
+        bt_node *copy = LOAD(copy_id);
+        DIRTY(copy);
+        memcpy(copy, child, tree.tree.alloc->node_size);
+        UNLOAD(child);
+        FREE(child_id);
+        DIRTY(node);
+        SET_CHILD(node, i, copy_id);
+        if(!target && tree.bplus){
+            // The next leaf links itself to the copy once it is moved
+            tree = at_height(tree, 0);
+            SET_PREV_LEAF(copy, *prev_leaf);
+            SET_NEXT_LEAF(copy, 0);
+            if(*prev_leaf){
+                bt_node *prev = LOAD(*prev_leaf);
+                DIRTY(prev);
+                SET_NEXT_LEAF(prev, copy_id);
+                UNLOAD(prev);
+            }
+            *prev_leaf = copy_id;
+            tree = at_height(tree, height);
+        }
+        UNLOAD(copy);
+    }
+}
+
+void btree_compact(btree b_tree){
+    btree_data *tree_data = LOAD_TREE(b_tree);
+    check_writable(tree_data);
+    if(get_snapshots(tree_data)){
+        fputs("Error: The snapshots of a tree have to be released before compacting it\n", stderr);
+        exit(1);
+    }
+    tree_param tree = get_tree_param(b_tree, tree_data);
+    bt_alloc_ptr alloc = b_tree.alloc;
+    if(!alloc->new_range){
+        UNLOAD_TREE(b_tree, tree_data);
+        return;
+    }
+    if(tree.concurrent){
+        pthread_mutex_lock(&retired_lock);
+        reclaim_nodes(&b_tree);
+        pthread_mutex_unlock(&retired_lock);
+    }
+    int height = tree_data->height;
+    bt_node *root = ROOT(tree_data);
+    bt_node_id lowest = UINT64_MAX;
+    uint64_t count = height > 0 ? count_nodes(tree, root, height, &lowest) : 0;
+    // If the range is behind the tree (as it is at the end of the file when
+    // the free space in front is fragmented), the tree has left a gap
+    // in front that it most likely fits into
+    for(int pass = 0; pass < 2 && count; pass++){
+        bt_node_id start = alloc->new_range(alloc, count);
+        // On failure, the error callback has been called already
+        if(!start)
+            break;
+        bt_node_id next_id = start, prev_leaf = 0;
+        for(int target = height-1; target >= 0; target--)
+            relocate_level(tree, root, height, target, &next_id, &prev_leaf);
+        if(start < lowest)
+            break;
+        lowest = start;
+    }
+    UNLOAD_TREE(b_tree, tree_data);
+    if(alloc->trim)
+        alloc->trim(alloc);
+}
+
+btree btree_snapshot(btree b_tree){
+    btree_data *tree_data = LOAD_TREE(b_tree);
+    tree_param tree = get_tree_param(b_tree, tree_data);
+    if(tree_data->flags & (BT_BPLUS|SNAPSHOT)){
+        fputs("Error: Only trees without BT_BPLUS/BT_CONCURRENT can have snapshots\n", stderr);
+        exit(1);
+    }
+    bt_node_id snapshot_id = NEW_NODE();
+    btree_data *snapshot = LOAD(snapshot_id);
+    DIRTY(snapshot);
+    memcpy(snapshot, tree_data, b_tree.alloc->node_size);
+    snapshot->flags |= SNAPSHOT;
+    set_snapshots(snapshot, b_tree.root);
+    UNLOAD(snapshot);
+
+    DIRTY_TREE(b_tree, tree_data);
+    if(!get_snapshots(tree_data))
+        set_snapshots(tree_data, btree_create(b_tree.alloc, sizeof(uint64_t),
+                sizeof(uint64_t), btree_compare_u64, 0, 0).root);
+    btree snapshots = {b_tree.alloc, get_snapshots(tree_data), btree_compare_u64};
+    uint64_t generation = tree.generation;
+    btree_insert(snapshots, &generation, &snapshot_id);
+    // All nodes existing now are shared
+    *newest_snapshot(b_tree.alloc, tree_data) = tree.generation;
+    *tree_generation(b_tree.alloc, tree_data) = tree.generation+1;
+    UNLOAD_TREE(b_tree, tree_data);
+    return (btree){b_tree.alloc, snapshot_id, b_tree.compare};
+}
+
+struct retained_search {
+    btree snapshots;
+    // Keys of the retained nodes no snapshot uses anymore
+    uint64_t *unused;
+    size_t count, capacity;
+};
+
+static bool find_unused(const void *key, void *value, void *param){
+    struct retained_search *search = param;
+    uint64_t generations, newest;
+    memcpy(&generations, value, sizeof(uint64_t));
+    // Nodes are used by the snapshots taken after they were created
+    // and before they were removed
+    uint64_t birth = generations>>32, last = (uint32_t)generations - 1;
+    if(btree_get_floor(search->snapshots, &last, &newest, NULL) && newest >= birth)
+        return false;
+    if(search->count == search->capacity){
+        size_t capacity = search->capacity ? 2*search->capacity : 64;
+        uint64_t *unused = realloc(search->unused, capacity*sizeof(uint64_t));
+        // The rest stays retained until the next release
+        if(!unused)
+            return true;
+        search->unused = unused;
+        search->capacity = capacity;
+    }
+    memcpy(search->unused + search->count++, key, sizeof(uint64_t));
+    return false;
+}
+
+void btree_release_snapshot(btree snapshot){
+    btree_data *snapshot_data = LOAD_TREE(snapshot);
+    if(!(snapshot_data->flags & SNAPSHOT)){
+        fputs("Error: Only snapshots can be released\n", stderr);
+        exit(1);
+    }
+    btree b_tree = {snapshot.alloc, get_snapshots(snapshot_data), snapshot.compare};
+    uint64_t generation = *tree_generation(snapshot.alloc, snapshot_data);
+    UNLOAD_TREE(snapshot, snapshot_data);
+
+    btree_data *tree_data = LOAD_TREE(b_tree);
+    tree_param tree = get_tree_param(b_tree, tree_data);
+    DIRTY_TREE(b_tree, tree_data);
+    struct retained_search search = {
+        {b_tree.alloc, get_snapshots(tree_data), btree_compare_u64}
+    };
+    btree_remove(search.snapshots, &generation, NULL);
+    uint64_t newest = 0;
+    btree_get_floor(search.snapshots, &(uint64_t){UINT32_MAX}, &newest, NULL);
+    *newest_snapshot(b_tree.alloc, tree_data) = newest;
+
+    btree_traverse_range(search.snapshots, &(uint64_t){RETAINED}, NULL,
+                         find_unused, &search, false);
+    for(size_t i = 0; i < search.count; i++){
+        btree_remove(search.snapshots, search.unused+i, NULL);
+        FREE(search.unused[i] & ~RETAINED);
+    }
+    free(search.unused);
+    // Without snapshots, nothing can be retained anymore
+    if(!newest){
+        btree_delete(search.snapshots);
+        set_snapshots(tree_data, 0);
+    }
+    UNLOAD_TREE(b_tree, tree_data);
+    FREE(snapshot.root);
+}
+
+// Rebalance the B+ leaf cn, child child_index of node, which has fallen below
+// its minimum number of keys. The separators of node are only copies of keys,
+// so pairs move between the leaves directly and separators are replaced.
+// children and separators are those of node, tree is set for the leaves.
+// Returns false if cn was merged into its left sibling and freed.
+static bool rebalance_linked_leaf(tree_param tree, bt_node *node, uint8_t *children,
+        uint8_t *separators, int child_index, bt_node_id cn_id, bt_node *cn){
+    size_t pair_size = tree.key_size+tree.value_size;
+    // A separator or child of node changes in any case
+    DIRTY(node);
+    DIRTY(cn);
+    bt_node_id prev_id = child_index>0 ? load_id(tree, children+(child_index-1)*tree.id_size) : 0;
+    bt_node *prev = prev_id ? LOAD(prev_id) : NULL;
+    if(prev)
+        latch_node(tree, prev);
+    if(prev && NUM_KEYS(prev)>MIN_KEYS(prev)){
+        // Take the last pair of prev
+        COUNT(tree.tree.alloc, borrows, 1);
+        DIRTY(prev);
+        memmove(PAIR(cn, 1), PAIRS(cn), NUM_KEYS(cn)*pair_size);
+        memcpy(PAIRS(cn), PAIR(prev, NUM_KEYS(prev)-1), pair_size);
+        memcpy(separators+(child_index-1)*tree.key_size, PAIRS(cn), tree.key_size);
+        NUM_KEYS(prev)--;
+        NUM_KEYS(cn)++;
+        unlatch_node(tree, prev);
+        UNLOAD(prev);
+        return true;
+    }
+    bt_node_id next_id = child_index<NUM_KEYS(node) ?
+                         load_id(tree, children+(child_index+1)*tree.id_size) : 0;
+    bt_node *next = next_id ? LOAD(next_id) : NULL;
+    if(next)
+        latch_node(tree, next);
+    if(next && NUM_KEYS(next)>MIN_KEYS(next)){
+        // Take the first pair of next
+        COUNT(tree.tree.alloc, borrows, 1);
+        DIRTY(next);
+        memcpy(PAIR(cn, NUM_KEYS(cn)), PAIRS(next), pair_size);
+        memmove(PAIRS(next), PAIR(next, 1), (NUM_KEYS(next)-1)*pair_size);
+        memcpy(separators+child_index*tree.key_size, PAIRS(next), tree.key_size);
+        NUM_KEYS(next)--;
+        NUM_KEYS(cn)++;
+        unlatch_node(tree, next);
+        UNLOAD(next);
+        if(prev){
+            unlatch_node(tree, prev);
+            UNLOAD(prev);
+        }
         return true;
+    }
+
+    // Merge right into left, preferably into the previous leaf
+    COUNT(tree.tree.alloc, merges, 1);
+    EVENT(tree.tree.alloc, BT_EVENT_MERGE, 0);
+    bt_node *left = prev ? prev : cn;
+    bt_node *right = prev ? cn : next;
+    bt_node_id left_id = prev ? prev_id : cn_id;
+    int left_index = prev ? child_index-1 : child_index;
+    DIRTY(left);
+    memcpy(PAIR(left, NUM_KEYS(left)), PAIRS(right), NUM_KEYS(right)*pair_size);
+    NUM_KEYS(left) += NUM_KEYS(right);
+    SET_NEXT_LEAF(left, NEXT_LEAF(right));
+    if(NEXT_LEAF(left) && NEXT_LEAF(left) == next_id){
+        // Already latched
+        DIRTY(next);
+        SET_PREV_LEAF(next, left_id);
+    } else if(NEXT_LEAF(left)){
+        bt_node *after = LOAD(NEXT_LEAF(left));
+        latch_node(tree, after);
+        DIRTY(after);
+        SET_PREV_LEAF(after, left_id);
+        unlatch_node(tree, after);
+        UNLOAD(after);
+    }
+    memmove(separators+left_index*tree.key_size, separators+(left_index+1)*tree.key_size,
+            (NUM_KEYS(node)-left_index-1)*tree.key_size);
+    memmove(children+(left_index+1)*tree.id_size, children+(left_index+2)*tree.id_size,
+            (NUM_KEYS(node)-left_index-1)*tree.id_size);
+    NUM_KEYS(node)--;
+
+    if(next){
+        unlatch_node(tree, next);
+        UNLOAD(next);
+    }
+    if(prev){
+        unlatch_node(tree, prev);
+        UNLOAD(prev);
+        latch_pop(tree);
+        UNLOAD(cn);
+        RETIRE(cn_id);
+        return false;
+    }
+    RETIRE(next_id);
+    return true;
+}
+
+// Rebalance cn, child child_index of the interior node (both on the path
+// of a removal), which has fallen below its minimum number of keys, by taking
+// a pair from a sibling or merging with one. Siblings are only loaded as needed.
+// Returns false if cn was merged into its left sibling and freed.
+static bool rebalance_child(tree_param tree, bt_node *node, int child_index,
+        bt_node_id child_id, bt_node *cn, int height){
+    DIRTY(node);
+    DIRTY(cn);
+    // check immediate siblings for available key
+    // take from left if possible
+    // (siblings are only loaded if they exist)
+    bt_node_id prev_id = 0, next_id = 0;
+    bt_node *prev = NULL, *next = NULL;
+    bool kept = true;
+    if(child_index>0){
+        prev_id = GET_CHILD(node, child_index-1);
+        prev = LOAD(prev_id);
+        latch_node(tree, prev);
+    }
+    if(prev && NUM_KEYS(prev)>MIN_KEYS(prev)){
+        COUNT(tree.tree.alloc, borrows, 1);
+        unshare_child(tree, node, child_index-1, &prev_id, &prev);
+        DIRTY(prev);
+        memmove(PAIR(cn, 1), PAIRS(cn), NUM_KEYS(cn)*(tree.key_size+tree.value_size));
+        if(height-1)
+            for(int i = NUM_KEYS(cn)+1; i --> 0;)
+                SET_CHILD(cn, i+1, GET_CHILD(cn, i));
+        memcpy(PAIR(cn, 0), PAIR(node, child_index-1), (tree.key_size+tree.value_size));
+        memcpy(PAIR(node, child_index-1), PAIR(prev, NUM_KEYS(prev)-1),
+                (tree.key_size+tree.value_size));
+        if(height-1)
+            SET_CHILD(cn, 0, GET_CHILD(prev, NUM_KEYS(prev)));
+        NUM_KEYS(prev)--;
+        NUM_KEYS(cn)++;
     } else {
-        int child_index = index/2;
-        bt_node_id child_id;
-        bt_node *cn;
-        bool found;
-        if(!(index%2)){
-            // remove key from child
-            child_id = CHILDREN(node)[child_index];
-            cn = LOAD(child_id);
-            found = remove_key(tree, cn, key, value_out, height-1);
+        if(child_index<NUM_KEYS(node)){
+            next_id = GET_CHILD(node, child_index+1);
+            next = LOAD(next_id);
+            latch_node(tree, next);
+        }
+
+        // else take from right if possible
+        if(next && NUM_KEYS(next)>MIN_KEYS(next)){
+            COUNT(tree.tree.alloc, borrows, 1);
+            unshare_child(tree, node, child_index+1, &next_id, &next);
+            DIRTY(next);
+            memcpy(PAIR(cn, NUM_KEYS(cn)), PAIR(node, child_index), 
+                   (tree.key_size+tree.value_size));
+            memcpy(PAIR(node, child_index), PAIR(next, 0), (tree.key_size+tree.value_size));
+            memmove(PAIRS(next), PAIR(next, 1), NUM_KEYS(next)*(tree.key_size+tree.value_size));
+            if(height-1){
+                SET_CHILD(cn, NUM_KEYS(cn)+1, GET_CHILD(next, 0));
+                for(int i = 0; i < NUM_KEYS(next); i++)
+                    SET_CHILD(next, i, GET_CHILD(next, i+1));
+            }
+            NUM_KEYS(next)--;
+            NUM_KEYS(cn)++;
         } else {
-            // node contains key directly
-            if(value_out)
-                memmove(value_out, VALUE(PAIR(node, index/2)), tree.value_size);
-            if(child_index<NUM_KEYS(node)){
-                // the smallest key in the right subtree works as seperator
-                child_index++;
-                child_id = CHILDREN(node)[child_index];
-                cn = LOAD(child_id);
-                find_smallest(tree, cn, height-1, PAIR(node, index/2));
-                remove_key(tree, cn, PAIR(node, index/2), NULL, height-1);
-                found = true;
+            // If none available in siblings, merge
+            COUNT(tree.tree.alloc, merges, 1);
+            EVENT(tree.tree.alloc, BT_EVENT_MERGE, height-1);
+            
+            // Make sure it works both when child is leftmost and rightmost
+            bt_node *left, *right;
+            int left_index;
+            if(child_index == 0){
+                left = cn;
+                right = next;
+                left_index = 0;
             } else {
-                // the biggest key in the left subtree works as seperator
-                child_id = CHILDREN(node)[child_index];
-                cn = LOAD(child_id);
-                find_biggest(tree, cn, height-1, PAIR(node, index/2));
-                remove_key(tree, cn, PAIR(node, index/2), NULL, height-1);
-                found = true;
+                unshare_child(tree, node, child_index-1, &prev_id, &prev);
+                left = prev;
+                right = cn;
+                left_index = child_index - 1;
             }
-        }
-        // rebalance if child below min number of keys
-        if(NUM_KEYS(cn)<MIN_KEYS(cn)){
-            // check immediate siblings for available key
-            // take from left if possible
-            bt_node_id prev_id = CHILDREN(node)[child_index-1];
-            bt_node *prev = LOAD(prev_id);
-            if(child_index>0 && NUM_KEYS(prev)>MIN_KEYS(prev)){
-                memmove(PAIR(cn, 1), PAIRS(cn), NUM_KEYS(cn)*(tree.key_size+tree.value_size));
-                if(height-1)
-                    for(int i = NUM_KEYS(cn)+1; i --> 0;)
-                        CHILDREN(cn)[i+1] = CHILDREN(cn)[i];
-                memcpy(PAIR(cn, 0), PAIR(node, child_index-1), (tree.key_size+tree.value_size));
-                memcpy(PAIR(node, child_index-1), PAIR(prev, NUM_KEYS(prev)-1),
-                        (tree.key_size+tree.value_size));
-                if(height-1)
-                    CHILDREN(cn)[0] = CHILDREN(prev)[NUM_KEYS(prev)];
-                NUM_KEYS(prev)--;
-                NUM_KEYS(cn)++;
+            
+            // Merge right into left
+            DIRTY(left);
+            memcpy(PAIR(left, NUM_KEYS(left)), PAIR(node, left_index),
+                   (tree.key_size+tree.value_size));
+            memmove(PAIR(node, left_index), PAIR(node, left_index+1),
+                    (NUM_KEYS(node)-left_index)*(tree.key_size+tree.value_size));
+            for(int i = left_index+1; i < NUM_KEYS(node); i++)
+                SET_CHILD(node, i, GET_CHILD(node, i+1));
+            memmove(PAIR(left, NUM_KEYS(left)+1), PAIRS(right),
+                    NUM_KEYS(right)*(tree.key_size+tree.value_size));
+            if(height-1)
+                for(int i = NUM_KEYS(right)+1; i --> 0;) 
+                    SET_CHILD(left, i+NUM_KEYS(left)+1, GET_CHILD(right, i));
+            NUM_KEYS(left) += 1 + NUM_KEYS(right);
+            NUM_KEYS(node)--;
+            
+            // Free right
+            if(child_index){
+                latch_pop(tree);
+                UNLOAD(cn);
+                RETIRE(child_id);
+                kept = false;
             } else {
-                bt_node_id next_id = CHILDREN(node)[child_index+1];
-                bt_node *next = LOAD(next_id);
-
-                // else take from right if possible
-                if(child_index<NUM_KEYS(node) && NUM_KEYS(next)>MIN_KEYS(next)){
-                    memcpy(PAIR(cn, NUM_KEYS(cn)), PAIR(node, child_index), 
-                           (tree.key_size+tree.value_size));
-                    memcpy(PAIR(node, child_index), PAIR(next, 0), (tree.key_size+tree.value_size));
-                    memmove(PAIRS(next), PAIR(next, 1), NUM_KEYS(next)*(tree.key_size+tree.value_size));
-                    if(height-1){
-                        CHILDREN(cn)[NUM_KEYS(cn)+1] = CHILDREN(next)[0];
-                        for(int i = 0; i < NUM_KEYS(next); i++)
-                            CHILDREN(next)[i] = CHILDREN(next)[i+1];
-                    }
-                    NUM_KEYS(next)--;
-                    NUM_KEYS(cn)++;
-                    UNLOAD(next);
-                } else {
-                    // If none available in siblings, merge
-                    
-                    // Make sure it works both when child is leftmost and rightmost
-                    bt_node *left, *right;
-                    int left_index;
-                    if(child_index == 0){
-                        left = cn;
-                        right = next;
-                        left_index = 0;
-                    } else {
-                        left = prev;
-                        right = cn;
-                        left_index = child_index - 1;
-                    }
-                    
-                    // Merge right into left
-                    memcpy(PAIR(left, NUM_KEYS(left)), PAIR(node, left_index),
-                           (tree.key_size+tree.value_size));
-                    memmove(PAIR(node, left_index), PAIR(node, left_index+1),
-                            (NUM_KEYS(node)-left_index)*(tree.key_size+tree.value_size));
-                    for(int i = left_index+1; i < NUM_KEYS(node); i++)
-                        CHILDREN(node)[i] = CHILDREN(node)[i+1];
-                    memmove(PAIR(left, NUM_KEYS(left)+1), PAIRS(right),
-                            NUM_KEYS(right)*(tree.key_size+tree.value_size));
-                    if(height-1)
-                        for(int i = NUM_KEYS(right)+1; i --> 0;) 
-                            CHILDREN(left)[i+NUM_KEYS(left)+1] = CHILDREN(right)[i];
-                    NUM_KEYS(left) += 1 + NUM_KEYS(right);
-                    NUM_KEYS(node)--;
-                    
-                    // Free right, mark as to not trigger an unload after free
-                    if(child_index){
-                        UNLOAD(cn);
-                        FREE(child_id);
-                        child_id = 0;
-                    } else {
-                        UNLOAD(next);
-                        FREE(next_id);
-                        next_id = 0;
-                    }
-                }
-                // only unload if not already freed
-                if(next_id)
-                    UNLOAD(next);
+                // The right sibling might be shared
+                uint32_t birth = *node_birth(tree.tree.alloc, next);
+                unlatch_node(tree, next);
+                UNLOAD(next);
+                DROP(next_id, birth);
+                next_id = 0;
             }
-            UNLOAD(prev);
         }
         // only unload if not already freed
-        if(child_id)
+        if(next_id){
+            unlatch_node(tree, next);
+            UNLOAD(next);
+        }
+    }
+    if(prev_id){
+        unlatch_node(tree, prev);
+        UNLOAD(prev);
+    }
+    return kept;
+}
+
+// Remove key from the subtree of node (of the given height, loaded and latched
+// by the caller), writing its value to value_out. Descends remembering the
+// path, then works back up rebalancing the nodes that fell below their
+// minimum number of keys. Returns false if the key wasn't found.
+static bool remove_key(tree_param tree, bt_node *node, const void *key, void *value_out, int height){
+    tree_path path;
+    path[height] = (path_step){node, 0, 0};
+    // In B-trees, a key found in an interior node is replaced by the smallest
+    // key of the subtree to its right, which is removed from its leaf instead
+    uint8_t *replaced = NULL;
+    bool found = false;
+    for(int h = height; ; h--){
+        tree = at_height(tree, h);
+        int index = replaced ? 0 : search_keys(tree, node, key);
+        if(!h){
+            if(replaced){
+                memcpy(replaced, PAIRS(node), tree.key_size+tree.value_size);
+                index = 1;
+            } else if(!(index%2))
+                break;
+            else if(value_out)
+                memcpy(value_out, VALUE(PAIR(node, index/2)), tree.value_size);
+            DIRTY(node);
+            memmove(PAIR(node, index/2), PAIR(node, index/2+1),
+                    (NUM_KEYS(node)-1-index/2)*(tree.key_size+tree.value_size));
+            // The parent will check if it is below its minimum number of keys
+            NUM_KEYS(node)--;
+            found = true;
+            break;
+        }
+        int child_index = (index+1)/2;
+        if(!replaced && found_pair(tree, index, h)){
+            // node contains key directly
+            DIRTY(node);
+            if(value_out)
+                memcpy(value_out, VALUE(PAIR(node, index/2)), tree.value_size);
+            replaced = PAIR(node, index/2);
+        }
+        path[h].child = child_index;
+        bt_node_id child_id;
+        node = load_child_unshared(tree, node, child_index, &child_id);
+        // Concurrent trees are B+ trees, so keys are only found in leaves
+        latch_push(tree, node);
+        // If the child has keys to spare, it won't be rebalanced
+        // and the nodes above stay as they are
+        if(NUM_KEYS(node) > MIN_KEYS(node))
+            latch_release_above(tree);
+        path[h-1] = (path_step){node, child_id, 0};
+    }
+    for(int h = 1; h <= height; h++){
+        tree = at_height(tree, h);
+        bt_node *cn = path[h-1].node;
+        bool underflow = parent_latched(tree) && NUM_KEYS(cn)<MIN_KEYS(cn);
+        bool kept = true;
+        if(underflow && tree.bplus && h==1)
+            kept = rebalance_linked_leaf(at_height(tree, 0), path[h].node,
+                    CHILDREN(path[h].node), PAIRS(path[h].node), path[h].child,
+                    path[h-1].id, cn);
+        else if(underflow)
+            kept = rebalance_child(tree, path[h].node, path[h].child,
+                                   path[h-1].id, cn, h);
+        // Unless already freed
+        if(kept){
+            latch_pop(tree);
             UNLOAD(cn);
-        return found;
+        }
     }
+    return found;
 }
 
 bool btree_remove(btree b_tree, const void *key, void *value_out){
+    uint64_t start = latency_start(b_tree.alloc);
     btree_data *tree_data = LOAD_TREE(b_tree);
-    tree_param tree = (tree_param){b_tree, tree_data->key_size, tree_data->value_size};
+    check_writable(tree_data);
+    latch_path path;
+    tree_param tree = latch_root(get_tree_param(b_tree, tree_data), &path, tree_data);
+    bool found = false;
+    // Nodes shared with snapshots would be copied for nothing
+    if(tree_data->height>=0 && tree.shared_generation
+            && !search(tree, ROOT(tree_data), key, tree_data->height, NULL)){
+        UNLOAD_TREE(b_tree, tree_data);
+        latency_end(b_tree.alloc, BT_OP_REMOVE, start);
+        return false;
+    }
     if(tree_data->height>=0){
         bt_node *root = ROOT(tree_data);
-        bool found;
         // Root may have fewer than min_keys keys.
         // If it has zero keys, it contains only the id of the actual root
         // In that case we have to remove_key() from that instead
         // as a sibling is required for merging.
         if(NUM_KEYS(root)==0){
-            bt_node_id proxied_root_id = CHILDREN(root)[0];
-            bt_node *proxied_root = LOAD(proxied_root_id);
+            tree = at_height(tree, tree_data->height);
+            bt_node_id proxied_root_id;
+            bt_node *proxied_root = load_child_unshared(tree, root, 0, &proxied_root_id);
+            latch_push(tree, proxied_root);
+            // The tree root stays as it is unless the actual root
+            // could end up fitting into it
+            if(NUM_KEYS(proxied_root) > MIN_KEYS(proxied_root)
+                    && NUM_KEYS(proxied_root)-1 > MAX_KEYS(root))
+                latch_release_above(tree);
             found = remove_key(tree, proxied_root, key, value_out, tree_data->height-1);
             
             // If the actual root now fits into the tree root again,
             // its data can be moved there
-            if(NUM_KEYS(proxied_root)==MAX_KEYS(root)){
-                NUM_KEYS(root) = MAX_KEYS(root);
+            tree = at_height(tree, tree_data->height-1);
+            if(root_latched(tree) && NUM_KEYS(proxied_root)<=MAX_KEYS(root)){
+                DIRTY(tree_data);
+                NUM_KEYS(root) = NUM_KEYS(proxied_root);
                 memmove(PAIRS(root), PAIRS(proxied_root), NUM_KEYS(root)*(tree.key_size+tree.value_size));
                 if(tree_data->height > 1)
                     for(int i=NUM_KEYS(root)+1; i --> 0;)
-                        CHILDREN(root)[i] = CHILDREN(proxied_root)[i];
+                        SET_CHILD(root, i, GET_CHILD(proxied_root, i));
+                latch_pop(tree);
                 UNLOAD(proxied_root);
-                FREE(proxied_root_id);
+                RETIRE(proxied_root_id);
                 tree_data->height--;
             } else {
+                latch_pop(tree);
                 UNLOAD(proxied_root);
             }
         } else {
@@ -641,16 +3070,75 @@ bool btree_remove(btree b_tree, const void *key, void *value_out){
         }
         
         // Check if tree is empty
-        if((NUM_KEYS(root)==0 && tree_data->height==0) || NUM_KEYS(root)==-1){
+        if(root_latched(tree) && ((NUM_KEYS(root)==0 && tree_data->height==0)
+                    || NUM_KEYS(root)==-1)){
+            DIRTY(tree_data);
             tree_data->height = -1;
         }
+    }
+    unlatch_root(tree, tree_data);
+    UNLOAD_TREE(b_tree, tree_data);
+    latency_end(b_tree.alloc, BT_OP_REMOVE, start);
+    return found;
+}
 
-        UNLOAD_TREE(b_tree, tree_data);
-        return found;
+
+
+// Adds the nodes of the subtree of node (at the given level, counted from the
+// root) to out, summing the fill factors of all but the root in *fill_sum
+static void stats_node(tree_param tree, const bt_node *node, int height, int level,
+        struct bt_stats *out, double *fill_sum){
+    tree = at_height(tree, height);
+    if(level < BT_STATS_LEVELS)
+        out->nodes[level]++;
+    out->total_nodes++;
+    if(!height || !tree.bplus)
+        out->pairs += NUM_KEYS(node);
+    out->bytes_used += 2*sizeof(int16_t) + NUM_KEYS(node)*(tree.key_size+tree.value_size);
+    if(height)
+        out->bytes_used += (NUM_KEYS(node)+1)*tree.id_size;
+    else if(tree.bplus && level)
+        out->bytes_used += 2*tree.id_size;
+    if(level){
+        double fill = (double)NUM_KEYS(node)/MAX_KEYS(node);
+        *fill_sum += fill;
+        if(fill < out->min_fill)
+            out->min_fill = fill;
+    }
+    if(height)
+        for(int i = 0; i <= NUM_KEYS(node); i++){
+            bt_node *child = LOAD(GET_CHILD(node, i));
+            stats_node(tree, child, height-1, level+1, out, fill_sum);
+            UNLOAD(child);
+        }
+}
+
+void btree_stats(btree b_tree, struct bt_stats *out){
+    btree_data *tree_data = LOAD_TREE(b_tree);
+    tree_param tree = get_tree_param(b_tree, tree_data);
+    bt_node *root = ROOT(tree_data);
+    memset(out, 0, sizeof(*out));
+    scan_begin(tree, tree_data);
+    out->height = tree_data->height;
+    out->min_fill = 1;
+    double fill_sum = 0;
+    if(tree_data->height >= 0){
+        stats_node(tree, root, tree_data->height, 0, out, &fill_sum);
     } else {
-        UNLOAD_TREE(b_tree, tree_data);
-        return false;
+        out->nodes[0] = out->total_nodes = 1;
+        out->bytes_used = 2*sizeof(int16_t);
     }
+    // The metadata (and userdata) in front of the root
+    out->bytes_used += tree_data->root_offset;
+    if(out->total_nodes > 1)
+        out->avg_fill = fill_sum/(out->total_nodes-1);
+    else if(tree_data->height >= 0)
+        out->avg_fill = out->min_fill = (double)NUM_KEYS(root)/MAX_KEYS(root);
+    else
+        out->avg_fill = out->min_fill = 0;
+    out->bytes_wasted = out->total_nodes*tree.tree.alloc->node_size - out->bytes_used;
+    scan_end(tree, tree_data);
+    UNLOAD_TREE(b_tree, tree_data);
 }
 
 
@@ -660,10 +3148,11 @@ bool btree_remove(btree b_tree, const void *key, void *value_out){
 // startc is a graph line connection character (unicode), lines_above and _below
 // are bitmask for whether to draw vertical lines at the given height
 static void debug_print(tree_param tree, FILE *stream, bt_node* node, bt_printer_t printer, void *param, int height, int max_height, char *startc, uint32_t lines_above, uint32_t lines_below){
+    tree = at_height(tree, height);
     for(int i = 0; i < NUM_KEYS(node)+1; i++){
         // Print child
         if(height){
-            bt_node *child = LOAD(CHILDREN(node)[i]);
+            bt_node *child = LOAD(GET_CHILD(node, i));
             uint32_t lines_row = i<(NUM_KEYS(node)+1)/2?lines_above:lines_below;
             debug_print(tree, stream, child, printer, param, height-1, max_height,
                     i==0 ?              "╭"
@@ -700,13 +3189,14 @@ static void debug_print(tree_param tree, FILE *stream, bt_node* node, bt_printer
             }
             // Print key & value
             if(printer){
-                printer(stream, PAIR(node, i), PAIR(node, i)+tree.key_size, param);
+                printer(stream, PAIR(node, i),
+                        tree.bplus && height ? NULL : VALUE(PAIR(node, i)), param);
             }else{
                 for(int j = 0; j < tree.key_size; j++)
                     fprintf(stream, "%02x", *(PAIR(node, i)+j));
-                if(tree.key_size){
+                if(tree.value_size){
                     fputs(" → ", stream);
-                    for(int j = 0; j < tree.key_size; j++)
+                    for(int j = 0; j < tree.value_size; j++)
                         fprintf(stream, "%02x", *(PAIR(node, i)+tree.key_size+j));
                 }
             }
@@ -717,11 +3207,13 @@ static void debug_print(tree_param tree, FILE *stream, bt_node* node, bt_printer
 
 void btree_debug_print(FILE *stream, btree b_tree, bt_printer_t print, void *param){
     btree_data *tree_data = LOAD_TREE(b_tree);
-    tree_param tree = (tree_param){b_tree, tree_data->key_size, tree_data->value_size};
+    tree_param tree = get_tree_param(b_tree, tree_data);
+    scan_begin(tree, tree_data);
     if(tree_data->height >= 0){
         bt_node *root = ROOT(tree_data);
         if(NUM_KEYS(root)==0){
-            bt_node *proxied_root = LOAD(CHILDREN(root)[0]);
+            tree = at_height(tree, tree_data->height);
+            bt_node *proxied_root = LOAD(GET_CHILD(root, 0));
             debug_print(tree, stream, proxied_root, print, param,
                     tree_data->height-1, tree_data->height-1, "", 0, 0);
             UNLOAD(proxied_root);
@@ -732,5 +3224,6 @@ void btree_debug_print(FILE *stream, btree b_tree, bt_printer_t print, void *par
     }  else {
         puts("(empty)");
     }
+    scan_end(tree, tree_data);
     UNLOAD_TREE(b_tree, tree_data);
 }
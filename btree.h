@@ -20,21 +20,183 @@ typedef void (*bt_error_callback)(bt_alloc_ptr, int error);
 
 
 
-// Creates a new allocator that keeps each entire trees in RAM,
-// can be freed with free().
-// TODO: recommend default node_size (requires benchmark)
-bt_alloc_ptr btree_new_ram_alloc(uint16_t node_size, bt_error_callback);
+// Optional settings for RAM allocators. Passing NULL or zeroed fields
+// selects the defaults.
+struct bt_ram_options {
+    // Back the nodes with huge pages, which saves TLB misses on large trees.
+    // Reserved huge pages (MAP_HUGETLB) are used if available, otherwise
+    // transparent huge pages are requested.
+    bool huge_pages;
+    // Hand out node ids that are indexes into a single region instead of
+    // pointers. They fit in 32 bits, so trees store their children in 4 bytes
+    // (see BT_IDS32) and interior nodes have a higher fanout. Address space
+    // for max_size bytes (default 64 GiB, at most 2^32 nodes) is reserved
+    // up front, allocations beyond that fail.
+    bool compact_ids;
+    uint64_t max_size;
+};
+
+// Creates a new allocator that keeps each entire trees in RAM.
+// Nodes are carved out of large regions allocated with mmap, without a
+// header per node, and are aligned to node_size if it is a power of two.
+// It can be used by any number of threads at once: freed nodes are kept in
+// a cache per thread for reuse, the regions are only returned to the
+// system by btree_free_ram_alloc().
+// A node_size of 4096 is a good default (see `make bench`): lookups get
+// only a little faster with larger nodes, while inserting and removing
+// (which move half a node on average) get slower, and smaller ones make
+// the tree higher. Prefer larger nodes only for large pairs.
+bt_alloc_ptr btree_new_ram_alloc(uint16_t node_size, const struct bt_ram_options*,
+        bt_error_callback);
+
+// Frees the allocator and returns all of its memory to the system.
+// Trees using it should be deleted first.
+void btree_free_ram_alloc(bt_alloc_ptr);
+
+// Optional settings for file allocators. Passing NULL or zeroed fields
+// selects the defaults.
+struct bt_file_options {
+    // Nodes are mapped on demand and kept mapped in a cache of this many
+    // nodes (default 1024). Loaded nodes are pinned and won't be evicted;
+    // if all are pinned, nodes are mapped individually.
+    uint32_t cache_nodes;
+    // If nonzero, map the whole file at once instead, so that loading a node
+    // is as cheap as with a RAM allocator. Address space for up to map_size
+    // bytes is reserved (not memory), nodes beyond that use the cache.
+    uint64_t map_size;
+    // Limit the file to 2^32 nodes (16 TiB with 4 KiB nodes), so that node
+    // ids fit in 32 bits and trees store their children in 4 bytes instead
+    // of 6 (see BT_IDS32). Growing the file beyond that fails with EFBIG.
+    bool compact_ids;
+    // File descriptor of a write-ahead log, 0 for none. Changes then only
+    // reach the file through btree_file_alloc_commit(), which appends the
+    // changed nodes to the log and syncs just the log. Loading the allocator
+    // replays the log, so after a crash the trees are as of the last commit.
+    // This requires the whole file to be mapped (map_size, 64 GiB if not
+    // given), the file can't grow beyond that.
+    int wal_fd;
+    // If nonzero, a background thread writes back the changed nodes (see
+    // btree_file_alloc_flush(), with a log it commits) whenever more than
+    // max_dirty bytes of them piled up, so that syncing has little left to do.
+    uint64_t max_dirty;
+    // Instead of mapping nodes, read them into a fixed pool of cache_nodes
+    // frames with pread() and write changed ones back with pwrite() when
+    // their frame is reused or on flushing, so that memory use stays the
+    // same however large the file gets. Loads wait while every frame is
+    // loaded, so there have to be more frames than all threads keep loaded
+    // at once (each operation a few more than the tree's height twice, each
+    // cursor its path). Scans have the kernel read the nodes they load next
+    // ahead. Can't be combined with map_size or wal_fd.
+    bool buffered;
+    // With buffered, O_DIRECT is set on the file descriptor (and cleared
+    // again when closing), so that nodes bypass the page cache
+    bool direct_io;
+    // With buffered, scans don't have the kernel read the nodes they load
+    // next ahead (which B+ tree scans then move along the leaf links)
+    bool no_prefetch;
+};
 
 // Creates a new allocator that keeps trees in a file.
 // Trees (or other data) already present there will be overriden.
+// Like the RAM allocator, it caches free nodes per thread. These are only
+// written back to the file when a range is allocated or it is closed.
 // A small amount of data, e.g a bt_node_id, can be stored alongside the allocator,
 // and a pointer to it will be stored in the location userdata points to.
 // If creation fails, NULL is returned and errno is set.
-bt_alloc_ptr btree_new_file_alloc(int fd, void **userdata, int userdata_size, bt_error_callback);
+bt_alloc_ptr btree_new_file_alloc(int fd, void **userdata, int userdata_size,
+        const struct bt_file_options*, bt_error_callback);
 
 // Loads the allocator created with btree_new_file_alloc() from file.
-// If creation fails, NULL is returned and errno is set.
-bt_alloc_ptr btree_load_file_alloc(int fd, void **userdata, bt_error_callback);
+// If creation fails, NULL is returned and errno is set, to EINVAL if the
+// file wasn't created by this version of the allocator (or not at all).
+bt_alloc_ptr btree_load_file_alloc(int fd, void **userdata,
+        const struct bt_file_options*, bt_error_callback);
+
+// Unmaps the file (a buffered allocator writes back its changed nodes) and
+// frees the allocator, all nodes have to be unloaded.
+// The file descriptor is left open.
+void btree_close_file_alloc(bt_alloc_ptr);
+
+// Makes all changes to the trees of a file allocator durable. With a
+// write-ahead log, concurrent callers are committed together with a single
+// sync of the log, and new operations wait while the changed nodes are
+// collected. The calling thread may not have nodes loaded (no cursors or
+// loaded userdata), and changes made through pointers from traversals or
+// cursors are not logged unless the node is changed otherwise as well.
+// Without a log, this is btree_file_alloc_flush() without async.
+void btree_file_alloc_commit(bt_alloc_ptr);
+
+// Writes the nodes changed since the last flush back to the file, ordered
+// by id and coalesced into ranges, so that this costs in proportion to the
+// changes rather than to the file. Unless async, waits until all changes
+// are durable; else the writeback is only started. Changes are tracked when
+// trees mark nodes as changed, like for the log: changes made through
+// pointers from traversals or cursors are only covered without async.
+// With a log, the changes are committed (see btree_file_alloc_commit()).
+void btree_file_alloc_flush(bt_alloc_ptr, bool async);
+
+// Allocates count nodes with consecutive ids from a file allocator,
+// returns the first id (or 0 on failure). Useful e.g. for storing data
+// larger than a node alongside the trees.
+bt_node_id btree_file_alloc_new_range(bt_alloc_ptr, uint64_t count);
+
+// Frees count nodes with consecutive ids starting at start.
+// These don't need to have been allocated in one go.
+void btree_file_alloc_free_range(bt_alloc_ptr, bt_node_id start, uint64_t count);
+
+// Retrieves how often a node load was served from the node cache of a file
+// allocator and how often the node had to be mapped (or read).
+void btree_file_alloc_cache_stats(bt_alloc_ptr, uint64_t *hits, uint64_t *misses);
+
+// Operations with a latency histogram in struct bt_alloc_stats
+// (btree_contains() counts as BT_OP_GET)
+enum bt_operation { BT_OP_GET, BT_OP_INSERT, BT_OP_REMOVE, BT_OP_TRAVERSE, BT_OPERATIONS };
+
+// Latency histograms have logarithmic buckets:
+// bucket i counts latencies in [2^(i-1), 2^i) nanoseconds
+#define BT_LATENCY_BUCKETS 48
+
+// Events reported to the callback in struct bt_alloc_stats, with arg being
+enum bt_event {
+    BT_EVENT_SPLIT,       // the height of the node that split (0 for leaves)
+    BT_EVENT_MERGE,       // the height of the merged nodes
+    BT_EVENT_FILE_GROWTH, // the new size of the file in bytes
+    BT_EVENT_FLUSH,       // the bytes of changed nodes a flush or commit of a
+                          // file allocator wrote back (on the flushing thread)
+};
+typedef void (*bt_event_callback)(bt_alloc_ptr, enum bt_event, uint64_t arg, void *param);
+
+// Counters of the work trees do with an allocator
+struct bt_alloc_stats {
+    // Calls of the allocator's functions
+    uint64_t loads, unloads, news, frees;
+    // Nodes split on insertion; nodes merged and keys taken from a
+    // sibling on removal; full leaves that shifted pairs into a sibling
+    // on insertion instead of splitting
+    uint64_t splits, merges, borrows, shifts;
+    // Calls of the comparison function. Trees with built-in key types
+    // (see btree_compare_u64()) don't call it, their searches count
+    // the keys looked at instead.
+    uint64_t compares;
+    // None of the statistics are synchronized, so with concurrent trees
+    // (BT_CONCURRENT) they are only approximate.
+
+    // Set to record latency histograms (costs reading the clock twice per
+    // operation). Traversals include the time spent in the callback.
+    bool record_latency;
+    uint64_t latency[BT_OPERATIONS][BT_LATENCY_BUCKETS];
+    // Latency of loading a node of a file allocator, including the page
+    // fault on its first access
+    uint64_t load_latency[BT_LATENCY_BUCKETS];
+
+    // Optional callback, called synchronously when an event happens
+    bt_event_callback event_callback;
+    void *event_param;
+};
+
+// Starts adding the counters of all trees of the allocator to stats (which
+// isn't reset), NULL stops it. Nothing is counted by default.
+void btree_alloc_stats(bt_alloc_ptr, struct bt_alloc_stats *stats);
 
 // To load an existing btree, simply initialize the following structure
 // with the correct values. If you created the tree with compare==NULL,
@@ -50,9 +212,49 @@ struct btree {
 
 
 
-// The following functions are multithreading safe only if no simultaneous
-// operations are performed on btrees created with the same allocator
-
+// The following functions are multithreading safe as long as no two threads
+// use the same tree at once, except for trees created with BT_CONCURRENT.
+// Allocators can be shared between threads.
+
+
+// Comparison functions for keys that are unsigned integers of 4/8 bytes in
+// native byte order. If a tree uses one of these or memcmp, it is recognized
+// and lookups use a specialized search instead of calling it for each key.
+int btree_compare_u32(const void*, const void*, size_t);
+int btree_compare_u64(const void*, const void*, size_t);
+
+// Options for btree_create(), can be combined with |
+enum bt_flags {
+    // Store values only in the leaves (B+ tree). Interior nodes then contain
+    // just keys and children, so they have a higher fanout and the tree is
+    // less high, especially with large values. Leaves are linked to their
+    // siblings, so traversals don't need to go back up to the parents.
+    BT_BPLUS = 1,
+    // Allow any number of threads to use the tree at once (implies BT_BPLUS).
+    // Insertions and removals latch only the nodes on their path, lookups
+    // don't latch at all: they check that the nodes they read weren't
+    // changed meanwhile and start over otherwise. Nodes removed from the
+    // tree are only freed once no lookup can be reading them anymore.
+    // Traversals, cursors, btree_get_many(), btree_get_floor(),
+    // btree_get_min(), btree_stats() and btree_debug_print() wait for running
+    // insertions/removals and keep new ones out until they are done, so
+    // long scans stall all writers. A thread modifying the tree while it
+    // holds a cursor to it (or from a traversal callback) would wait for
+    // itself, it exits with an error instead.
+    BT_CONCURRENT = 2,
+    // Store the children of nodes as 4 or 6 byte ids instead of 8, which
+    // raises the fanout of interior nodes. The ids of the allocator have to
+    // fit. If neither is given, the narrowest one that fits is used: 4 bytes
+    // for allocators with compact_ids, 6 bytes for file allocators.
+    BT_IDS32 = 4,
+    BT_IDS48 = 8,
+    // Split full leaves in two halves on insertion. By default, a full leaf
+    // first shifts pairs into a neighbour with room, and is split together
+    // with a full neighbour into three leaves otherwise. That keeps leaves
+    // over two thirds full (almost completely with ascending keys) instead
+    // of half full, at the cost of moving more pairs on insertion.
+    BT_SPLIT_HALVES = 16,
+};
 
 // Creates a new b-tree from the given allocator.
 // userdata_size specifies the size of custom data (if any) stored along
@@ -60,8 +262,9 @@ struct btree {
 // This is useful primarily for btrees stored in a file.
 // You can specify the function for comparing keys, which is useful if you want
 // to be able to traverse the tree in a specific order. If NULL, memcmp is used.
+// flags is a combination of enum bt_flags (or 0) and stored with the tree.
 btree btree_create(bt_alloc_ptr, uint8_t key_size, uint8_t value_size, 
-        bt_key_comp, uint16_t userdata_size);
+        bt_key_comp, uint16_t userdata_size, int flags);
 
 // Gets a pointer to the userdata stored alongside the tree.
 // This doesn't have a guaranteed alignment.
@@ -74,6 +277,23 @@ void btree_unload_userdata(btree, void *userdata);
 // returns true if key was already present.
 bool btree_insert(btree, const void *key, const void *value);
 
+// Inserts n keys and corresponding values (stored consecutively in the arrays
+// keys and values). The pairs are sorted first and inserted in a single pass
+// through the tree, which is faster than individual insertions.
+// Of duplicate keys the last one's value is stored.
+// Returns the number of keys that were already present.
+size_t btree_insert_batch(btree, const void *keys, const void *values, size_t n);
+
+// Creates a new b-tree like btree_create() and fills it with the pairs
+// returned by next(), which stores the next key&value in *key and *value
+// and returns false once there are none left. The keys have to be strictly
+// ascending. This is much faster than inserting the pairs one by one.
+// The nodes are filled to the fraction fill of their capacity (at least half),
+// use 1 or 0 for completely filled nodes if few insertions will follow.
+btree btree_bulk_load(bt_alloc_ptr, uint8_t key_size, uint8_t value_size,
+        bt_key_comp, uint16_t userdata_size, int flags, float fill,
+        bool (*next)(void *key, void *value, void *param), void *param);
+
 // Checks whether the btree is empty
 bool btree_is_empty(btree);
 
@@ -84,12 +304,67 @@ bool btree_contains(btree, const void *key);
 // Returns whether the key was found.
 bool btree_get(btree, const void *key, void *value_out);
 
+// Looks up n keys (stored consecutively in keys) at once, storing the value of
+// the i-th key in values_out[i] and whether it was found in found_out[i]
+// (values_out and found_out may be NULL). This is faster than calling
+// btree_get() for each key, as the lookups are interleaved so that waiting
+// for memory overlaps. Returns the number of keys found.
+size_t btree_get_many(btree, const void *keys, size_t n, void *values_out, bool *found_out);
+
+// Finds the smallest key in the tree and stores it in *key_out and its value
+// in *value_out (either may be NULL). Returns false if the tree is empty.
+bool btree_get_min(btree, void *key_out, void *value_out);
+
+// Finds the biggest key less than or equal to key and stores it in *key_out
+// and its value in *value_out (either may be NULL).
+// Returns false if there is no such key.
+bool btree_get_floor(btree, const void *key, void *key_out, void *value_out);
+
+// Like btree_get_floor(), but finds the smallest key greater than or equal to key
+bool btree_get_ceil(btree, const void *key, void *key_out, void *value_out);
+
 // Traverses tree, calling callback() with a pointer to each key&value and params.
 // If callback return true, end traversal early and return true, else return false.
 bool btree_traverse(btree, 
         bool (*callback)(const void *key, void *value, void *param),
         void* params, bool reverse);
 
+// Like btree_traverse(), but only for keys from from (inclusive) up to to
+// (exclusive). Either bound may be NULL to leave it open.
+// Uses a cursor, so only the pairs inside the range are visited.
+bool btree_traverse_range(btree, const void *from, const void *to,
+        bool (*callback)(const void *key, void *value, void *param),
+        void* params, bool reverse);
+
+// A cursor points to a pair of a tree and can be moved to the next or previous
+// pair in O(1) amortized. While it is open, the nodes from the root to the
+// current pair are kept loaded. The tree must not be modified meanwhile.
+typedef struct bt_cursor bt_cursor;
+
+// Opens a cursor, which doesn't point to any pair yet.
+// Returns NULL if out of memory.
+bt_cursor *btree_cursor_open(btree);
+
+// Moves the cursor to the smallest key greater than or equal to key.
+// Returns false if there is none.
+bool btree_cursor_seek(bt_cursor*, const void *key);
+
+// Moves the cursor to the smallest/biggest key, returns false if the tree is empty.
+bool btree_cursor_first(bt_cursor*);
+bool btree_cursor_last(bt_cursor*);
+
+// Moves the cursor to the next/previous key.
+// Returns false if there is none, the cursor then doesn't point to any pair.
+bool btree_cursor_next(bt_cursor*);
+bool btree_cursor_prev(bt_cursor*);
+
+// Gets pointers to the key and value the cursor points to (either may be NULL),
+// valid until the cursor is moved. Returns false if it doesn't point to a pair.
+bool btree_cursor_get(bt_cursor*, const void **key, void **value);
+
+// Closes the cursor
+void btree_cursor_close(bt_cursor*);
+
 // Remove the key from the tree, store the corresponding value (if value_out!=NULL).
 // Return true if the tree did contain the key, else false.
 bool btree_remove(btree, const void *key, void *value_out);
@@ -97,9 +372,61 @@ bool btree_remove(btree, const void *key, void *value_out);
 // Deletes a tree
 void btree_delete(btree);
 
+// Moves the nodes of the tree into consecutive ids, level by level from the
+// root down and each level in key order, so that the leaves lie next to each
+// other in key order and scans read the file front to back. Then the free
+// space at the end is given back: file allocators commit (see
+// btree_file_alloc_commit()) and truncate the file, or punch a hole into it
+// if it can't be truncated. If the tree doesn't fit into free space in front
+// of it, it is moved to the end of the file first (growing it temporarily)
+// and from there into the space it left.
+// Only allocators with new_range support this, for others it does nothing.
+// No other thread may use the tree meanwhile, and it can't have snapshots.
+void btree_compact(btree);
+
+// Takes a snapshot of the tree: a read-only tree with its current contents,
+// which stays as it is while the tree changes. Both share their nodes; as long
+// as a snapshot uses a node, insertions and removals copy it (and the nodes
+// on the path to it) instead of changing it in place. So a snapshot can be
+// read by other threads while the tree is changed, only taking and releasing
+// snapshots count as changes to the tree. Values must not be changed through
+// pointers from traversals or cursors while there are snapshots.
+// B+ trees (BT_BPLUS, BT_CONCURRENT) can't have snapshots, as their leaves
+// are linked to each other.
+btree btree_snapshot(btree);
+
+// Frees the snapshot and the nodes only it still used. The snapshots of a
+// tree have to be released before deleting the tree.
+void btree_release_snapshot(btree snapshot);
+
+// Maximum number of levels reported by btree_stats()
+#define BT_STATS_LEVELS 64
+
+// Shape of a tree, see btree_stats()
+struct bt_stats {
+    // Height of the tree, -1 if empty, 0 if the root is a leaf
+    int height;
+    // Number of nodes on each level, from the root (which is stored in the
+    // node with the tree's metadata) to the leaves
+    uint64_t nodes[BT_STATS_LEVELS];
+    uint64_t total_nodes;
+    uint64_t pairs;
+    // Number of keys relative to the maximum for the nodes other than the root
+    // (for just the root, if it is the only node)
+    double avg_fill, min_fill;
+    // Bytes of the nodes containing data (including headers, children
+    // and the metadata) and unused bytes
+    uint64_t bytes_used, bytes_wasted;
+};
+
+// Walks the whole tree to collect statistics on its shape into out,
+// e.g. to decide whether it would benefit from being rebuilt
+void btree_stats(btree, struct bt_stats *out);
+
 // Prints out a textual representation of the btree (intended for a monospace font)
 // to stream. Expects utf-8 locale and VT1000. A function to print keys/values can
 // be specified; if it is NULL, both are printed in hex format;
+// For the keys of interior nodes of B+ trees, value is NULL.
 typedef void (*bt_printer_t)(FILE*, const void *key, const void *value, void *param);
 void btree_debug_print(FILE *stream, btree, bt_printer_t, void *param);
 
@@ -124,6 +451,24 @@ struct bt_alloc {
 
     // Size of a node in bytes
     uint16_t node_size;
+    // Counters, NULL unless enabled with btree_alloc_stats()
+    struct bt_alloc_stats *stats;
+    // Bytes all ids of this allocator fit in, 0 meaning sizeof(bt_node_id)
+    uint8_t id_size;
+    // Optional, called after a tree changed a loaded node (node may point
+    // anywhere into it), so that the allocator can track what to write.
+    // Changes through pointers handed out by traversals and cursors are
+    // not reported.
+    void (*dirty)(btree, void *node);
+    // Optional, allocates count nodes with consecutive ids and returns the
+    // first (0 on failure), btree_compact() moves trees into them
+    bt_node_id (*new_range)(void *this, uint64_t count);
+    // Optional, called by btree_compact() after moving a tree, so that the
+    // allocator can give back the free space at its end
+    void (*trim)(void *this);
+    // Optional, scans (traversals and cursors) announce the nodes they are
+    // about to load in order, so that reading them can start in the background
+    void (*prefetch)(btree, const bt_node_id *nodes, int count);
 };
 
 #endif
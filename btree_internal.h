@@ -0,0 +1,111 @@
+#ifndef B_TREE_INTERNAL_HEADER
+#define B_TREE_INTERNAL_HEADER
+
+// Helpers shared by the trees and the allocators, not part of the API
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "btree.h"
+
+static inline uint64_t now_ns(void){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000000000llu + t.tv_nsec;
+}
+
+// Count a latency of ns nanoseconds in a histogram of BT_LATENCY_BUCKETS
+static inline void record_latency(uint64_t *histogram, uint64_t ns){
+    int bucket = ns ? 64-__builtin_clzll(ns) : 0;
+    histogram[bucket < BT_LATENCY_BUCKETS ? bucket : BT_LATENCY_BUCKETS-1]++;
+}
+
+// Free the nodes of concurrent trees of the allocator that are still
+// retired, before it is closed or freed. No lookups may be running on its
+// trees anymore.
+void btree_reclaim_retired(bt_alloc_ptr alloc);
+
+// Ids of free nodes. So that threads allocating nodes at once don't contend
+// for the free space of an allocator, each thread takes from and frees into
+// its own cache, which is refilled from the allocator and flushed to it in
+// batches. Caches are assigned to threads in the order they first use one,
+// threads only share them if there are more than CACHE_STRIPES.
+#define CACHE_STRIPES 64
+// Ids moved between a cache and the allocator at once
+#define CACHE_BATCH 32
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t count;
+    bt_node_id ids[2*CACHE_BATCH];
+} id_cache;
+
+// Stores up to CACHE_BATCH free ids of the allocator in ids, the last one is
+// handed out first. Returns how many, 0 on failure (reported already).
+typedef uint32_t (*cache_refill)(void *alloc, bt_node_id *ids);
+// Hands count ids back to the allocator
+typedef void (*cache_release)(void *alloc, const bt_node_id *ids, uint32_t count);
+
+static inline unsigned thread_stripe(void){
+    static unsigned thread_count;
+    // Index of the cache of this thread + 1, 0 until assigned
+    static _Thread_local unsigned stripe;
+    if(!stripe)
+        stripe = __atomic_fetch_add(&thread_count, 1, __ATOMIC_RELAXED)%CACHE_STRIPES + 1;
+    return stripe-1;
+}
+
+static inline void init_caches(id_cache caches[CACHE_STRIPES]){
+    for(int i = 0; i < CACHE_STRIPES; i++){
+        pthread_mutex_init(&caches[i].lock, NULL);
+        caches[i].count = 0;
+    }
+}
+
+static inline void destroy_caches(id_cache caches[CACHE_STRIPES]){
+    for(int i = 0; i < CACHE_STRIPES; i++)
+        pthread_mutex_destroy(&caches[i].lock);
+}
+
+// Take an id from the cache of the thread, refilling it if empty.
+// Returns 0 if refilling failed.
+static inline bt_node_id cache_take(id_cache caches[CACHE_STRIPES], void *alloc,
+        cache_refill refill){
+    id_cache *cache = caches + thread_stripe();
+    pthread_mutex_lock(&cache->lock);
+    if(!cache->count)
+        cache->count = refill(alloc, cache->ids);
+    bt_node_id id = cache->count ? cache->ids[--cache->count] : 0;
+    pthread_mutex_unlock(&cache->lock);
+    return id;
+}
+
+// Keep the id in the cache of the thread, releasing the older half if full
+static inline void cache_put(id_cache caches[CACHE_STRIPES], void *alloc,
+        bt_node_id id, cache_release release){
+    id_cache *cache = caches + thread_stripe();
+    pthread_mutex_lock(&cache->lock);
+    if(cache->count == 2*CACHE_BATCH){
+        release(alloc, cache->ids, CACHE_BATCH);
+        memmove(cache->ids, cache->ids+CACHE_BATCH, CACHE_BATCH*sizeof(bt_node_id));
+        cache->count -= CACHE_BATCH;
+    }
+    cache->ids[cache->count++] = id;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Hand all cached ids back to the allocator
+static inline void flush_caches(id_cache caches[CACHE_STRIPES], void *alloc,
+        cache_release release){
+    for(int i = 0; i < CACHE_STRIPES; i++){
+        id_cache *cache = caches+i;
+        pthread_mutex_lock(&cache->lock);
+        if(cache->count)
+            release(alloc, cache->ids, cache->count);
+        cache->count = 0;
+        pthread_mutex_unlock(&cache->lock);
+    }
+}
+
+#endif
@@ -1,3 +1,5 @@
+// For sync_file_range() and fallocate()
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -5,17 +7,39 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #include "btree.h"
+#include "btree_internal.h"
 
 // How much file space in nodes to allocate at once
 #define ALLOC_NODES_STEP 32
 // Maximum depth of the free blocks tree. This should be much more than enough.
 #define MAX_FREE_DEPTH 26
+// Number of nodes kept mapped if bt_file_options doesn't specify it
+#define DEFAULT_CACHE_NODES 1024
+// Identifies files of the allocator, ends with the version of their format.
+// Has to change with the layout of nodes, the header or the free space trees.
+#define FILE_MAGIC 0x32302d4545525442llu // "BTREE-02"
+// Node ids are stored in 6 bytes by trees (BT_IDS48), 4 with compact ids
+#define MAX_NODES ((bt_node_id)1<<48)
+#define MAX_COMPACT_NODES ((bt_node_id)1<<32)
+// Address space reserved for the whole file mapping with a write-ahead log
+// if bt_file_options doesn't specify it
+#define DEFAULT_WAL_MAP_SIZE (64ull<<30)
+// Once the log grows beyond this, the file is synced and the log emptied
+#define WAL_CHECKPOINT_SIZE (64ull<<20)
+#define WAL_MAGIC 0x4c41572d45455254llu // "TREE-WAL"
+// Changed frames of consecutive nodes written back at once at most
+#define WRITE_BATCH 64
 
 
 // 
-// Free space will be stored in a btree with root node id 0
-// and value size 0
+// Free space will be stored in a btree with root node id 0 as extents:
+// the key is the first free node, the value the number of free nodes
+// following it. Neighbouring extents are merged when freeing.
+// A second tree indexes the extents by length, to find the best fit for
+// a range in logarithmic time.
 // Problem: How to allocate/deallocate nodes for that tree?
 // If we use the same tree for this (buffering the requested/freed pages
 // because we can't manipulate the tree while another operation is afoot),
@@ -34,20 +58,173 @@ typedef struct {
     uint8_t available_nodes_lenght;
 } helper_alloc;
 
+// Mapping nodes is expensive (mmap, page faults, munmap, TLB shootdowns),
+// so mapped nodes are kept in a cache of fixed size.
+// With bt_file_options.buffered, nodes are read into the frames instead and
+// changed ones written back before a frame is reused.
+// The cache is a contiguous reserved address range divided into frames of
+// node_size bytes; a node is mapped into a frame with MAP_FIXED, which
+// also replaces whatever node previously occupied that frame.
+// This way the frame of a pointer passed to unload() is a simple division.
+// Frames are pinned while loaded and evicted via the CLOCK algorithm.
+typedef struct {
+    // Node mapped into this frame, only valid if mapped is set
+    bt_node_id node;
+    // Number of times the frame is currently loaded
+    uint32_t pins;
+    // Set on every access, cleared by the clock hand
+    bool referenced;
+    bool mapped;
+    // The node was changed and is in the list of changed nodes
+    bool dirty;
+    // The node is being read into the frame (bt_file_options.buffered)
+    bool loading;
+} cache_frame;
+
+typedef struct {
+    // Start of the reserved address range
+    char *memory;
+    cache_frame *frames;
+    uint32_t frame_count;
+    uint32_t clock_hand;
+    // Open addressing hash table (linear probing) from node id to frame,
+    // entries are frame index + 1, 0 marks an empty slot
+    uint32_t *table;
+    uint32_t table_mask;
+    uint64_t hits;
+    uint64_t misses;
+} node_cache;
+
+// Stored as the userdata of the free nodes tree (in node 0), followed by the
+// userdata of the allocator
+typedef struct {
+    // FILE_MAGIC, checked when loading the allocator
+    uint64_t magic;
+    // Highest node id allocated so far + 1
+    bt_node_id used_end;
+    // Root of the tree of free extents by length
+    bt_node_id by_length_root;
+} file_header;
+
+// Nodes changed since the last flush or commit, as a list of their ids.
+// So that each is listed once, nodes in the whole file mapping are flagged
+// by a bit per node, those in the cache by their frame. As frames are
+// reused, nodes mapped through the cache may be listed more than once.
+// Nodes mapped on their own (all frames pinned) aren't tracked,
+// only syncing the whole file writes them back.
+typedef struct {
+    uint64_t *bits;
+    pthread_mutex_t lock;
+    bt_node_id *ids;
+    size_t count, capacity;
+    // Too many nodes to list were changed (more than the file has),
+    // the next flush covers the whole file
+    bool overflow;
+    // Signalled when more than bt_file_options.max_dirty bytes changed
+    pthread_cond_t piled_up;
+} dirty_nodes;
+
+// Write-ahead log (bt_file_options.wal_fd). The file is mapped privately,
+// so changed nodes only reach it when committed: a commit copies them into
+// a batch while no operation is in progress, appends that to the log and
+// syncs it, and only then writes the nodes to the file (without syncing).
+// Syncing the file is deferred to checkpoints, after which the log starts
+// over. Loading the allocator replays the complete batches in the log.
+typedef struct {
+    uint64_t magic;
+    uint64_t node_size;
+    // Sequence number of the first batch, they are numbered consecutively
+    // so that leftovers of an earlier log aren't replayed
+    uint64_t sequence;
+} wal_header;
+
+// Followed by count node ids, then the nodes
+typedef struct {
+    uint64_t magic;
+    uint64_t sequence;
+    uint64_t count;
+    uint64_t checksum;
+} wal_batch;
+
+typedef struct {
+    int fd;
+    // End of the log and sequence number of the next batch
+    uint64_t size;
+    uint64_t sequence;
+    // Nodes written by the last batch, their private copies are dropped at
+    // the next commit unless changed again
+    bt_node_id *written;
+    size_t written_count, written_capacity;
+    // The batch being written
+    uint8_t *buffer;
+    size_t buffer_capacity;
+    // Group commit: a thread committing while a commit is running waits for
+    // it, then the next commit covers all threads that waited meanwhile.
+    pthread_mutex_t lock;
+    pthread_cond_t committed;
+    uint64_t started, finished;
+    bool committing;
+    // Threads with nodes loaded, which are in an operation. New operations
+    // wait while quiescing, so that a commit sees no half done changes.
+    uint64_t active;
+    bool quiescing;
+    pthread_cond_t drained, resumed;
+    // Number of nodes loaded by the thread
+    pthread_key_t loaded;
+} wal_state;
+
 typedef struct {
     struct bt_alloc base;
     int file_descriptor;
+    // Guards the free nodes tree and the end of the used file space
+    // (header, file_size, map_nodes growing)
+    pthread_mutex_t lock;
+    // Guards the node cache
+    pthread_mutex_t cache_lock;
+    // Signalled when a frame is read or unloaded (bt_file_options.buffered)
+    pthread_cond_t frame_ready;
+    bool buffered;
+    // O_DIRECT was set on the file descriptor, to be cleared when closing
+    bool direct_io;
+    // Free node ids of each thread, refilled from the free nodes tree
+    // (or the end of the file) and flushed to it
+    id_cache free_caches[CACHE_STRIPES];
+    // Mapped nodes
+    node_cache cache;
+    // Optionally the whole file is mapped at once (bt_file_options.map_size).
+    // Address space for map_size bytes is reserved up front and the mapped
+    // part grows geometrically inside the reservation, so it never moves and
+    // loaded pointers stay valid. Nodes past the reservation use the cache.
+    char *file_map;
+    bt_node_id map_reserved_nodes;
+    // Nodes [0, map_nodes) are mapped, read without the lock
+    bt_node_id map_nodes;
     // File size in nodes
     bt_node_id file_size;
-    // Tree containing free blocks (todo: ranges instead of single blocks)
+    // Node ids have to stay below this
+    bt_node_id max_nodes;
+    // Tree containing extents of free blocks
     btree free_tree;
+    // The same extents keyed by (length, start), without values
+    btree by_length;
     // Allocator of said tree
     helper_alloc free_tree_alloc;
     // User-provided error callback (may be NULL)
     bt_error_callback error_callback;
-    // Pointer to userdata of root node, stores
-    // the highest node id allocated so far + 1
-    bt_node_id *root_userdata;
+    // Userdata of the free nodes tree, NULL if loading failed before it
+    file_header *header;
+    // Nodes changed since the last flush or commit
+    dirty_nodes dirty;
+    // Serializes flushes, the ids being written back are kept in flushing
+    pthread_mutex_t flush_lock;
+    bt_node_id *flushing;
+    size_t flushing_capacity;
+    // Background flusher (bt_file_options.max_dirty), stopped when closing
+    uint64_t max_dirty;
+    pthread_t flusher;
+    bool flusher_running, stop_flusher;
+    // NULL without a write-ahead log
+    wal_state *wal;
 } file_alloc;
 
 #define MAIN_ALLOC_PTR(h_alloc) (file_alloc*)((char*)h_alloc + \
@@ -55,9 +232,18 @@ typedef struct {
 
 
 
+static bool grow_map(file_alloc*);
+
+static bt_node_id take_file_end(file_alloc*, bt_node_id count);
+
+static void mark_dirty(file_alloc*, void *node);
+
 static bt_node_id helper_new_node(void *this){
     helper_alloc *alloc = (helper_alloc*)this;
-    return alloc->available_nodes[--alloc->available_nodes_lenght];
+    if(alloc->available_nodes_lenght)
+        return alloc->available_nodes[--alloc->available_nodes_lenght];
+    // The free nodes tree can't take from itself while it is being modified
+    return take_file_end(MAIN_ALLOC_PTR(alloc), 1);
 }
 
 
@@ -75,57 +261,238 @@ static void helper_unload(btree tree, void *node){
 }
 
 
-static void free_node(void *this, bt_node_id node);
-
 static void helper_free_node(void *this, bt_node_id node){
     helper_alloc *alloc = (helper_alloc*)this;
     alloc->freed_nodes[alloc->freed_nodes_lenght++] = node;
 }
 
+static void helper_dirty(btree tree, void *node){
+    mark_dirty(MAIN_ALLOC_PTR(tree.alloc), node);
+}
 
 
-static bool callback_get_first_node(const void *key, void *value, void *param){
-    *(bt_node_id*)param = *(bt_node_id*)key;
-    return true;
-}
 
-static bt_node_id new(void *this){
-    file_alloc *a = (file_alloc*)this;
-   
-    if(btree_is_empty(a->free_tree)){
-        (*(bt_node_id*)a->root_userdata)++;
-        if(*(bt_node_id*)a->root_userdata > a->file_size){
-            a->file_size += ALLOC_NODES_STEP;
-            if((errno = posix_fallocate(a->file_descriptor, 0,
-                        a->base.node_size * a->file_size))){
-                if(a->error_callback){
-                    a->error_callback(this, errno);
-                    return 0;
-                } else {
-                    fputs("Error: Failed to grow file", stderr);
-                    exit(1);
-                }
+// Take count nodes from the end of the used file space, growing the file
+static bt_node_id take_file_end(file_alloc *a, bt_node_id count){
+    bt_node_id start = a->header->used_end;
+    if(count > a->max_nodes - start){
+        errno = EFBIG;
+        if(a->error_callback){
+            a->error_callback((bt_alloc_ptr)a, errno);
+            return 0;
+        }
+        fputs("Error: Too many nodes for the ids of the allocator\n", stderr);
+        exit(1);
+    }
+    a->header->used_end += count;
+    if(a->header->used_end > a->file_size){
+        bt_node_id old_size = a->file_size, size = old_size;
+        while(size < a->header->used_end)
+            size += ALLOC_NODES_STEP;
+        // Read without the lock when tracking changed nodes
+        __atomic_store_n(&a->file_size, size, __ATOMIC_RELAXED);
+        if((errno = posix_fallocate(a->file_descriptor, 0,
+                    a->base.node_size * a->file_size))
+                // With a log, nodes can't be written outside the private mapping
+                || (!grow_map(a) && a->wal)){
+            __atomic_store_n(&a->file_size, old_size, __ATOMIC_RELAXED);
+            a->header->used_end -= count;
+            if(a->error_callback){
+                a->error_callback((bt_alloc_ptr)a, errno);
+                return 0;
+            } else {
+                fputs("Error: Failed to grow file", stderr);
+                exit(1);
             }
         }
-        return *(bt_node_id*)a->root_userdata-1;
+        if(a->base.stats && a->base.stats->event_callback)
+            a->base.stats->event_callback((bt_alloc_ptr)a, BT_EVENT_FILE_GROWTH,
+                    a->base.node_size * a->file_size, a->base.stats->event_param);
+    }
+    if(a->wal)
+        mark_dirty(a, a->header);
+    return start;
+}
+
+static void add_free_extent(file_alloc *a, bt_node_id start, bt_node_id count);
+
+// The free nodes tree may have released nodes while being modified,
+// these can only be added to it afterwards
+static void release_freed(file_alloc *a){
+    helper_alloc *helper = &a->free_tree_alloc;
+    while(helper->freed_nodes_lenght){
+        bt_node_id node = helper->freed_nodes[--helper->freed_nodes_lenght];
+        if(helper->available_nodes_lenght<MAX_FREE_DEPTH)
+            helper->available_nodes[helper->available_nodes_lenght++] = node;
+        else
+            add_free_extent(a, node, 1);
+    }
+}
+
+// Orders the keys of by_length: (length, start) pairs
+static int compare_length_start(const void *a, const void *b, size_t size){
+    bt_node_id x[2], y[2];
+    memcpy(x, a, sizeof(x));
+    memcpy(y, b, sizeof(y));
+    if(x[0] != y[0])
+        return x[0] < y[0] ? -1 : 1;
+    return (x[1] > y[1]) - (x[1] < y[1]);
+}
+
+// Change the length of the extent at start in both trees, from length
+// (0 if it is new) to new_length (0 to remove it)
+static void resize_extent(file_alloc *a, bt_node_id start, bt_node_id length,
+        bt_node_id new_length){
+    if(length)
+        btree_remove(a->by_length, (bt_node_id[2]){length, start}, NULL);
+    if(new_length){
+        // Inserting an existing key only replaces the length
+        btree_insert(a->free_tree, &start, &new_length);
+        // The key doubles as the (empty) value
+        bt_node_id key[2] = {new_length, start};
+        btree_insert(a->by_length, key, key);
+    } else
+        btree_remove(a->free_tree, &start, NULL);
+}
+
+// Store count nodes starting at start as free, merging with adjacent extents
+static void add_free_extent(file_alloc *a, bt_node_id start, bt_node_id count){
+    bt_node_id prev_start, prev_count, next_count;
+    bt_node_id end = start+count;
+    bool merge_prev = btree_get_floor(a->free_tree, &start, &prev_start, &prev_count)
+                      && prev_start+prev_count == start;
+    bool merge_next = btree_get(a->free_tree, &end, &next_count);
+    if(merge_next){
+        resize_extent(a, end, next_count, 0);
+        count += next_count;
+    }
+    if(merge_prev)
+        resize_extent(a, prev_start, prev_count, prev_count+count);
+    else
+        resize_extent(a, start, 0, count);
+    release_freed(a);
+}
+
+// Find the smallest extent of at least count nodes, the first of them if
+// several are as small
+static bool find_best_fit(file_alloc *a, bt_node_id count,
+        bt_node_id *start, bt_node_id *length){
+    bt_node_id found[2];
+    if(!btree_get_ceil(a->by_length, (bt_node_id[2]){count, 0}, found, NULL))
+        return false;
+    *length = found[0];
+    *start = found[1];
+    return true;
+}
+
+struct extent_search {
+    bt_node_id count;
+    bt_node_id start;
+    bt_node_id length;
+};
+
+static bool callback_find_extent(const void *key, void *value, void *param){
+    struct extent_search *search = param;
+    memcpy(&search->length, value, sizeof(bt_node_id));
+    if(search->length < search->count)
+        return false;
+    memcpy(&search->start, key, sizeof(bt_node_id));
+    return true;
+}
+
+// Remove the last count nodes of the extent from the free nodes tree
+static bt_node_id take_from_extent(file_alloc *a, bt_node_id start,
+        bt_node_id length, bt_node_id count){
+    // Taking from the end keeps the start, so free_tree isn't rebalanced
+    resize_extent(a, start, length, length-count);
+    release_freed(a);
+    return start+length-count;
+}
+
+// Refill an empty cache with the last nodes of the first free extent
+// or, if there is none, from the end of the file (see cache_refill)
+static uint32_t refill_free_cache(void *this, bt_node_id *ids){
+    file_alloc *a = this;
+    bt_node_id start, length, count = CACHE_BATCH;
+    pthread_mutex_lock(&a->lock);
+    if(btree_get_min(a->free_tree, &start, &length)){
+        if(count > length)
+            count = length;
+        start = take_from_extent(a, start, length, count);
     } else {
-        bt_node_id new_node;
-        btree_traverse(a->free_tree, callback_get_first_node, &new_node, false);
-        btree_remove(a->free_tree, &new_node, NULL);
-        // After a remove, the free_tree may have shrunk
-        for(int i = a->free_tree_alloc.freed_nodes_lenght; i --> 0;)
-            btree_insert(a->free_tree, a->free_tree_alloc.freed_nodes+i, NULL);
-        a->free_tree_alloc.freed_nodes_lenght = 0;
-        return new_node;
+        start = take_file_end(a, count);
     }
+    pthread_mutex_unlock(&a->lock);
+    if(!start)
+        return 0;
+    // Nodes are taken from the end, so that they are handed out in order
+    for(bt_node_id i = 0; i < count; i++)
+        ids[i] = start+count-1-i;
+    return count;
 }
 
+static void free_ids(void *this, const bt_node_id *ids, uint32_t count);
 
+// Hand all cached ids back to the free nodes tree
+static void flush_free_caches(file_alloc *a){
+    flush_caches(a->free_caches, a, free_ids);
+}
 
-static void *load_from_alloc(file_alloc *alloc, bt_node_id node){
-    //TODO: somewhat expensive because of page faults → cache this
-    void *mem = mmap(NULL, alloc->base.node_size, PROT_READ|PROT_WRITE, MAP_SHARED,
-            ((file_alloc*)alloc)->file_descriptor, node*alloc->base.node_size);
+static bt_node_id new(void *this){
+    file_alloc *a = (file_alloc*)this;
+    // On failure, the error callback has been called already
+    return cache_take(a->free_caches, a, refill_free_cache);
+}
+
+bt_node_id btree_file_alloc_new_range(bt_alloc_ptr alloc, uint64_t count){
+    file_alloc *a = (file_alloc*)alloc;
+    // Cached ids might complete a range
+    flush_free_caches(a);
+    pthread_mutex_lock(&a->lock);
+    bt_node_id start, length;
+    if(find_best_fit(a, count, &start, &length))
+        start = take_from_extent(a, start, length, count);
+    else
+        start = take_file_end(a, count);
+    pthread_mutex_unlock(&a->lock);
+    return start;
+}
+
+// Add the nodes buffered for the free nodes tree to it, where they can
+// complete extents. Requires the lock.
+static void return_available(file_alloc *a){
+    helper_alloc *helper = &a->free_tree_alloc;
+    while(helper->available_nodes_lenght)
+        add_free_extent(a, helper->available_nodes[--helper->available_nodes_lenght], 1);
+}
+
+// Like btree_file_alloc_new_range(), but takes the start of the first fit,
+// so that btree_compact() moves trees as far to the front as possible.
+// Finding that walks the extents in order, which is linear in their number
+// (unlike the best fit), but it only happens once or twice per compaction.
+static bt_node_id new_range(void *this, uint64_t count){
+    file_alloc *a = this;
+    flush_free_caches(a);
+    pthread_mutex_lock(&a->lock);
+    return_available(a);
+    struct extent_search search = {count};
+    bt_node_id start;
+    if(btree_traverse(a->free_tree, callback_find_extent, &search, false)){
+        start = take_from_extent(a, search.start, search.length, search.length);
+        if(search.length > count)
+            add_free_extent(a, start+count, search.length-count);
+    } else
+        start = take_file_end(a, count);
+    pthread_mutex_unlock(&a->lock);
+    return start;
+}
+
+
+
+static void *map_node(file_alloc *alloc, void *addr, bt_node_id node){
+    void *mem = mmap(addr, alloc->base.node_size, PROT_READ|PROT_WRITE,
+            (alloc->wal ? MAP_PRIVATE : MAP_SHARED)|(addr?MAP_FIXED:0), alloc->file_descriptor,
+            node*alloc->base.node_size);
     if(mem == MAP_FAILED){
         if(alloc->error_callback){
             alloc->error_callback((bt_alloc_ptr)alloc, errno);
@@ -138,37 +505,1029 @@ static void *load_from_alloc(file_alloc *alloc, bt_node_id node){
     return mem;
 }
 
+static uint32_t cache_slot(node_cache *cache, bt_node_id node){
+    // Fibonacci hashing, node ids are mostly sequential
+    return (node * 11400714819323198485llu >> 32) & cache->table_mask;
+}
+
+static void cache_remove(node_cache *cache, uint32_t frame){
+    uint32_t slot = cache_slot(cache, cache->frames[frame].node);
+    while(cache->table[slot] != frame+1)
+        slot = (slot+1) & cache->table_mask;
+    // Backward shift deletion, so that no tombstones are required
+    for(uint32_t next = (slot+1) & cache->table_mask;
+            cache->table[next]; next = (next+1) & cache->table_mask){
+        uint32_t home = cache_slot(cache, cache->frames[cache->table[next]-1].node);
+        // Move the entry if its home slot isn't between slot and next (cyclic)
+        if(((next-home) & cache->table_mask) >= ((next-slot) & cache->table_mask)){
+            cache->table[slot] = cache->table[next];
+            slot = next;
+        }
+    }
+    cache->table[slot] = 0;
+}
+
+// Find a frame that may be reused, returns frame_count if all are pinned
+static uint32_t cache_victim(node_cache *cache){
+    // After two full rotations all referenced bits have been cleared
+    for(uint32_t i = 2*cache->frame_count; i --> 0;){
+        uint32_t frame = cache->clock_hand;
+        cache_frame *f = cache->frames + frame;
+        cache->clock_hand = (cache->clock_hand+1) % cache->frame_count;
+        if(f->pins)
+            continue;
+        if(f->referenced)
+            f->referenced = false;
+        else
+            return frame;
+    }
+    return cache->frame_count;
+}
+
+// Frame holding the node, frame_count if it isn't cached
+static uint32_t cache_find(node_cache *cache, bt_node_id node){
+    for(uint32_t slot = cache_slot(cache, node); cache->table[slot];
+            slot = (slot+1) & cache->table_mask)
+        if(cache->frames[cache->table[slot]-1].node == node)
+            return cache->table[slot]-1;
+    return cache->frame_count;
+}
+
+// Take the frame into use for node, after removing its previous node
+static void cache_reuse(node_cache *cache, uint32_t frame, bt_node_id node){
+    cache_frame *f = cache->frames + frame;
+    if(f->mapped)
+        cache_remove(cache, frame);
+    uint32_t slot = cache_slot(cache, node);
+    while(cache->table[slot])
+        slot = (slot+1) & cache->table_mask;
+    cache->table[slot] = frame+1;
+    *f = (cache_frame){.node = node, .pins = 1, .referenced = true, .mapped = true};
+}
+
+// Requires the cache lock unless the node is in the whole file mapping
+static void *map_from_alloc(file_alloc *alloc, bt_node_id node){
+    if(node < __atomic_load_n(&alloc->map_nodes, __ATOMIC_ACQUIRE))
+        return alloc->file_map + node*alloc->base.node_size;
+
+    node_cache *cache = &alloc->cache;
+    uint32_t frame = cache_find(cache, node);
+    if(frame < cache->frame_count){
+        cache_frame *f = cache->frames + frame;
+        cache->hits++;
+        f->pins++;
+        f->referenced = true;
+        return cache->memory + frame*alloc->base.node_size;
+    }
+
+    cache->misses++;
+    frame = cache_victim(cache);
+    // Every frame is in use, fall back to mapping the node on its own
+    if(frame == cache->frame_count)
+        return map_node(alloc, NULL, node);
+
+    char *mem = cache->memory + frame*alloc->base.node_size;
+    // MAP_FIXED atomically replaces the previous mapping of the frame
+    if(!map_node(alloc, mem, node)){
+        if(cache->frames[frame].mapped)
+            cache_remove(cache, frame);
+        cache->frames[frame].mapped = false;
+        return NULL;
+    }
+    cache_reuse(cache, frame, node);
+    return mem;
+}
+
+static void report_error(file_alloc *alloc, const char *message);
+static bool write_all(int fd, const uint8_t *data, size_t size, off_t offset);
+static bool read_all(int fd, void *data, size_t size, off_t offset);
+
+// Load the node into a frame (bt_file_options.buffered). It is read without
+// the cache lock, others loading it meanwhile wait for that. Changes to the
+// node previously in the frame are written back first, holding the lock so
+// that it isn't read back before.
+static void *read_into_frame(file_alloc *alloc, bt_node_id node){
+    node_cache *cache = &alloc->cache;
+    size_t node_size = alloc->base.node_size;
+    pthread_mutex_lock(&alloc->cache_lock);
+    uint32_t frame;
+    for(;;){
+        frame = cache_find(cache, node);
+        if(frame < cache->frame_count){
+            cache_frame *f = cache->frames + frame;
+            f->pins++;
+            f->referenced = true;
+            while(f->loading)
+                pthread_cond_wait(&alloc->frame_ready, &alloc->cache_lock);
+            if(f->mapped){
+                cache->hits++;
+                pthread_mutex_unlock(&alloc->cache_lock);
+                return cache->memory + frame*node_size;
+            }
+            // Reading it failed, try again
+            f->pins--;
+            pthread_cond_broadcast(&alloc->frame_ready);
+            continue;
+        }
+        frame = cache_victim(cache);
+        if(frame < cache->frame_count)
+            break;
+        // Every frame is in use, wait for one to be unloaded
+        pthread_cond_wait(&alloc->frame_ready, &alloc->cache_lock);
+    }
+
+    cache->misses++;
+    cache_frame *f = cache->frames + frame;
+    char *mem = cache->memory + frame*node_size;
+    if(f->mapped && f->dirty
+            && !write_all(alloc->file_descriptor, (uint8_t*)mem, node_size, f->node*node_size)){
+        pthread_mutex_unlock(&alloc->cache_lock);
+        report_error(alloc, "Failed to write back node");
+        return NULL;
+    }
+    cache_reuse(cache, frame, node);
+    f->loading = true;
+    pthread_mutex_unlock(&alloc->cache_lock);
+
+    bool read = read_all(alloc->file_descriptor, mem, node_size, node*node_size);
+    pthread_mutex_lock(&alloc->cache_lock);
+    f->loading = false;
+    if(!read){
+        cache_remove(cache, frame);
+        f->mapped = false;
+        f->pins--;
+    }
+    pthread_cond_broadcast(&alloc->frame_ready);
+    pthread_mutex_unlock(&alloc->cache_lock);
+    if(!read){
+        report_error(alloc, "Failed to read node");
+        return NULL;
+    }
+    return mem;
+}
+
+// Loads the node, recording the latency if enabled. Mapping a node only
+// takes effect on its first access, so it is touched before the time is taken.
+static void *lock_and_map(file_alloc *alloc, bt_node_id node){
+    if(alloc->buffered)
+        return read_into_frame(alloc, node);
+    if(node < __atomic_load_n(&alloc->map_nodes, __ATOMIC_ACQUIRE))
+        return map_from_alloc(alloc, node);
+    pthread_mutex_lock(&alloc->cache_lock);
+    void *mem = map_from_alloc(alloc, node);
+    pthread_mutex_unlock(&alloc->cache_lock);
+    return mem;
+}
+
+static void *load_from_alloc(file_alloc *alloc, bt_node_id node){
+    struct bt_alloc_stats *stats = alloc->base.stats;
+    if(!stats || !stats->record_latency)
+        return lock_and_map(alloc, node);
+    uint64_t start = now_ns();
+    void *mem = lock_and_map(alloc, node);
+    if(mem)
+        (void)*(volatile char*)mem;
+    record_latency(stats->load_latency, now_ns()-start);
+    return mem;
+}
+
+static void wal_enter(wal_state*);
+static void wal_leave(wal_state*);
+
 static void *load(btree tree, bt_node_id node){
-    return load_from_alloc((file_alloc*)tree.alloc, node);
+    file_alloc *alloc = (file_alloc*)tree.alloc;
+    if(alloc->wal)
+        wal_enter(alloc->wal);
+    return load_from_alloc(alloc, node);
 }
 
 static void unload_from_alloc(file_alloc *alloc, void *node){
-    munmap(node, alloc->base.node_size);
+    // Whole file mapping stays as is
+    bt_node_id map_nodes = __atomic_load_n(&alloc->map_nodes, __ATOMIC_ACQUIRE);
+    if((char*)node >= alloc->file_map
+            && (char*)node < alloc->file_map + map_nodes*alloc->base.node_size)
+        return;
+
+    node_cache *cache = &alloc->cache;
+    size_t offset = (char*)node - cache->memory;
+    if((char*)node >= cache->memory
+            && offset < (size_t)cache->frame_count*alloc->base.node_size){
+        // Stays mapped until the frame gets reused
+        pthread_mutex_lock(&alloc->cache_lock);
+        // Loads may be waiting for a frame
+        if(!--cache->frames[offset/alloc->base.node_size].pins && alloc->buffered)
+            pthread_cond_broadcast(&alloc->frame_ready);
+        pthread_mutex_unlock(&alloc->cache_lock);
+    } else
+        munmap(node, alloc->base.node_size);
 }
 
 static void unload(btree tree, void *node){
-    unload_from_alloc((file_alloc*)tree.alloc, node);
+    file_alloc *alloc = (file_alloc*)tree.alloc;
+    unload_from_alloc(alloc, node);
+    if(alloc->wal)
+        wal_leave(alloc->wal);
 }
 
+static void dirty(btree tree, void *node){
+    mark_dirty((file_alloc*)tree.alloc, node);
+}
+
+// Have the kernel read the nodes into the page cache, runs of consecutive
+// ones (in either direction) at once, so that reading them into frames
+// (bt_file_options.buffered) doesn't have to wait for the disk
+static void prefetch(btree tree, const bt_node_id *nodes, int count){
+    file_alloc *alloc = (file_alloc*)tree.alloc;
+    uint64_t node_size = alloc->base.node_size;
+    for(int i = 0; i < count;){
+        bt_node_id start = nodes[i], end = start+1;
+        for(i++; i < count; i++){
+            if(nodes[i] == end)
+                end++;
+            else if(nodes[i] == start-1)
+                start--;
+            else
+                break;
+        }
+        posix_fadvise(alloc->file_descriptor, start*node_size, (end-start)*node_size,
+                      POSIX_FADV_WILLNEED);
+    }
+}
+
+// Hand ids over to the free nodes tree, after refilling the buffer of nodes
+// for the tree itself
+static void free_ids(void *this, const bt_node_id *ids, uint32_t count){
+    file_alloc *alloc = this;
+    pthread_mutex_lock(&alloc->lock);
+    for(uint32_t i = 0; i < count; i++){
+        if(alloc->free_tree_alloc.available_nodes_lenght<MAX_FREE_DEPTH){
+            alloc->free_tree_alloc.available_nodes[alloc->free_tree_alloc.available_nodes_lenght++] = ids[i];
+        } else {
+            add_free_extent(alloc, ids[i], 1);
+        }
+    }
+    pthread_mutex_unlock(&alloc->lock);
+}
+
+// Keep the id in the cache of the thread, flushing the older half if full
 static void free_node(void *this, bt_node_id node){
     file_alloc *alloc = (file_alloc*)this;
-    if(alloc->free_tree_alloc.available_nodes_lenght<MAX_FREE_DEPTH){
-        alloc->free_tree_alloc.available_nodes[alloc->free_tree_alloc.available_nodes_lenght++] = node;
-    } else {
-        btree_insert(alloc->free_tree, &node, NULL);
+    cache_put(alloc->free_caches, alloc, node, free_ids);
+}
+
+void btree_file_alloc_free_range(bt_alloc_ptr alloc, bt_node_id start, uint64_t count){
+    if(!count)
+        return;
+    pthread_mutex_lock(&((file_alloc*)alloc)->lock);
+    add_free_extent((file_alloc*)alloc, start, count);
+    pthread_mutex_unlock(&((file_alloc*)alloc)->lock);
+}
+
+
+
+// Report a failure of the write-ahead log or of reading/writing nodes
+static void report_error(file_alloc *alloc, const char *message){
+    if(alloc->error_callback){
+        alloc->error_callback((bt_alloc_ptr)alloc, errno);
+        return;
+    }
+    fprintf(stderr, "Error: %s\n", message);
+    exit(1);
+}
+
+static bool append_id(bt_node_id **ids, size_t *count, size_t *capacity, bt_node_id id){
+    if(*count == *capacity){
+        size_t new_capacity = *capacity ? 2**capacity : 256;
+        bt_node_id *new_ids = realloc(*ids, new_capacity*sizeof(bt_node_id));
+        if(!new_ids)
+            return false;
+        *ids = new_ids;
+        *capacity = new_capacity;
+    }
+    (*ids)[(*count)++] = id;
+    return true;
+}
+
+// Record that a loaded node was changed, node may point anywhere into it
+static void mark_dirty(file_alloc *alloc, void *node){
+    dirty_nodes *dirty = &alloc->dirty;
+    size_t node_size = alloc->base.node_size;
+    bt_node_id map_nodes = __atomic_load_n(&alloc->map_nodes, __ATOMIC_ACQUIRE);
+    node_cache *cache = &alloc->cache;
+    size_t offset = (char*)node - cache->memory;
+    bt_node_id id;
+    if((char*)node >= alloc->file_map
+            && (char*)node < alloc->file_map + map_nodes*node_size){
+        id = ((char*)node - alloc->file_map) / node_size;
+        uint64_t bit = 1llu << id%64, *word = dirty->bits + id/64;
+        if(__atomic_load_n(word, __ATOMIC_RELAXED) & bit
+                || __atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit)
+            return;
+    } else if((char*)node >= cache->memory
+            && offset < (size_t)cache->frame_count*node_size){
+        // The frame is pinned, so it holds the node
+        pthread_mutex_lock(&alloc->cache_lock);
+        cache_frame *f = cache->frames + offset/node_size;
+        bool listed = f->dirty;
+        f->dirty = true;
+        id = f->node;
+        pthread_mutex_unlock(&alloc->cache_lock);
+        if(listed)
+            return;
+    } else
+        return;
+
+    pthread_mutex_lock(&dirty->lock);
+    bool added = true;
+    // Nodes in the cache may be listed repeatedly, which mustn't go on forever
+    if(dirty->count >= __atomic_load_n(&alloc->file_size, __ATOMIC_RELAXED) && !alloc->wal)
+        dirty->overflow = true;
+    else
+        added = append_id(&dirty->ids, &dirty->count, &dirty->capacity, id);
+    if(alloc->max_dirty && dirty->count*node_size > alloc->max_dirty)
+        pthread_cond_signal(&dirty->piled_up);
+    pthread_mutex_unlock(&dirty->lock);
+    if(!added)
+        report_error(alloc, "Failed to track changed node, not enough RAM");
+}
+
+static int compare_ids(const void *a, const void *b){
+    bt_node_id x = *(const bt_node_id*)a, y = *(const bt_node_id*)b;
+    return (x > y) - (x < y);
+}
+
+// Take the list of changed nodes over into alloc->flushing (sorted),
+// so that changes from now on are listed anew. Returns the number of ids,
+// SIZE_MAX if the whole file has to be written back.
+// Requires the flush lock.
+static size_t take_dirty(file_alloc *alloc){
+    dirty_nodes *dirty = &alloc->dirty;
+    pthread_mutex_lock(&dirty->lock);
+    bt_node_id *ids = dirty->ids;
+    size_t count = dirty->count, capacity = dirty->capacity;
+    bool overflow = dirty->overflow;
+    dirty->ids = alloc->flushing;
+    dirty->capacity = alloc->flushing_capacity;
+    dirty->count = 0;
+    dirty->overflow = false;
+    pthread_mutex_unlock(&dirty->lock);
+    alloc->flushing = ids;
+    alloc->flushing_capacity = capacity;
+
+    for(size_t i = 0; i < count && dirty->bits; i++){
+        bt_node_id id = ids[i];
+        if(id < alloc->map_reserved_nodes)
+            __atomic_fetch_and(dirty->bits + id/64, ~(1llu << id%64), __ATOMIC_RELAXED);
+    }
+    pthread_mutex_lock(&alloc->cache_lock);
+    for(uint32_t i = 0; i < alloc->cache.frame_count; i++)
+        alloc->cache.frames[i].dirty = false;
+    pthread_mutex_unlock(&alloc->cache_lock);
+    if(overflow)
+        return SIZE_MAX;
+    qsort(ids, count, sizeof(bt_node_id), compare_ids);
+    return count;
+}
+
+// Like take_dirty(), but lists the changed frames (bt_file_options.buffered),
+// since they hold all changes that weren't written back yet.
+// alloc->flushing has room for every frame. Requires the flush lock.
+static size_t take_frames(file_alloc *alloc){
+    dirty_nodes *dirty = &alloc->dirty;
+    pthread_mutex_lock(&dirty->lock);
+    dirty->count = 0;
+    dirty->overflow = false;
+    pthread_mutex_unlock(&dirty->lock);
+    size_t count = 0;
+    pthread_mutex_lock(&alloc->cache_lock);
+    for(uint32_t i = 0; i < alloc->cache.frame_count; i++)
+        if(alloc->cache.frames[i].dirty)
+            alloc->flushing[count++] = alloc->cache.frames[i].node;
+    pthread_mutex_unlock(&alloc->cache_lock);
+    qsort(alloc->flushing, count, sizeof(bt_node_id), compare_ids);
+    return count;
+}
+
+static bool write_vector(int fd, struct iovec *iov, int count, off_t offset){
+    while(count){
+        ssize_t written = pwritev(fd, iov, count, offset);
+        if(written < 0){
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        offset += written;
+        for(; count && written >= iov->iov_len; iov++, count--)
+            written -= iov->iov_len;
+        if(count){
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+// Write the changed frames of the nodes [start, end) back, those of
+// consecutive nodes at once (bt_file_options.buffered). Loaded frames may be
+// changed further, so they stay marked. Returns false on failure.
+static bool write_frames(file_alloc *alloc, bt_node_id start, bt_node_id end){
+    node_cache *cache = &alloc->cache;
+    size_t node_size = alloc->base.node_size;
+    struct iovec iov[WRITE_BATCH];
+    int count = 0;
+    bt_node_id first = start;
+    bool success = true;
+    pthread_mutex_lock(&alloc->cache_lock);
+    for(bt_node_id node = start; node <= end && success; node++){
+        // Frames may have been reused since they were listed
+        uint32_t frame = node < end ? cache_find(cache, node) : cache->frame_count;
+        bool changed = frame < cache->frame_count && cache->frames[frame].dirty;
+        if(changed){
+            if(!count)
+                first = node;
+            iov[count++] = (struct iovec){cache->memory + frame*node_size, node_size};
+            if(!cache->frames[frame].pins)
+                cache->frames[frame].dirty = false;
+        }
+        if(count && (!changed || count == WRITE_BATCH)){
+            success = write_vector(alloc->file_descriptor, iov, count, first*node_size);
+            count = 0;
+        }
     }
+    pthread_mutex_unlock(&alloc->cache_lock);
+    return success;
 }
 
+// Start writing back count bytes at offset, returns false on failure
+static bool start_writeback(file_alloc *alloc, uint64_t offset, uint64_t count){
+#ifdef SYNC_FILE_RANGE_WRITE
+    return !sync_file_range(alloc->file_descriptor, offset, count, SYNC_FILE_RANGE_WRITE);
+#else
+    // Left to the kernel, or the sync of a flush that waits
+    return true;
+#endif
+}
+
+// Write back the changed nodes, in order and coalesced into ranges of
+// consecutive ids. Changes made meanwhile may or may not be included.
+static void flush_dirty(file_alloc *alloc, bool async){
+    uint64_t node_size = alloc->base.node_size, flushed = 0;
+    pthread_mutex_lock(&alloc->flush_lock);
+    // The userdata of the allocator is changed without notice
+    mark_dirty(alloc, alloc->header);
+    size_t count = alloc->buffered ? take_frames(alloc) : take_dirty(alloc);
+    bool success = true;
+    if(count == SIZE_MAX){
+        // 0 bytes means up to the end of the file
+        success = start_writeback(alloc, 0, 0);
+        flushed = __atomic_load_n(&alloc->file_size, __ATOMIC_RELAXED)*node_size;
+        count = 0;
+    }
+    for(size_t i = 0; i < count && success;){
+        bt_node_id start = alloc->flushing[i], end = start+1;
+        // Nodes in the cache may be listed repeatedly
+        while(++i < count && alloc->flushing[i] <= end)
+            end = alloc->flushing[i]+1;
+        success = (!alloc->buffered || write_frames(alloc, start, end))
+                  && start_writeback(alloc, start*node_size, (end-start)*node_size);
+        flushed += (end-start)*node_size;
+    }
+    // The sync waits for the writeback started above, and covers changes
+    // that weren't tracked as well
+    if(success && !async)
+        success = !fdatasync(alloc->file_descriptor);
+    pthread_mutex_unlock(&alloc->flush_lock);
+    if(!success){
+        report_error(alloc, "Failed to write back changed nodes");
+        return;
+    }
+    struct bt_alloc_stats *stats = alloc->base.stats;
+    if(stats && stats->event_callback)
+        stats->event_callback((bt_alloc_ptr)alloc, BT_EVENT_FLUSH, flushed,
+                              stats->event_param);
+}
+
+void btree_file_alloc_flush(bt_alloc_ptr alloc_ptr, bool async){
+    file_alloc *alloc = (file_alloc*)alloc_ptr;
+    if(alloc->wal)
+        btree_file_alloc_commit(alloc_ptr);
+    else
+        flush_dirty(alloc, async);
+}
+
+// Background flusher, writes back the changed nodes whenever more than
+// max_dirty bytes of them piled up
+static void *flusher(void *param){
+    file_alloc *alloc = param;
+    dirty_nodes *dirty = &alloc->dirty;
+    pthread_mutex_lock(&dirty->lock);
+    while(!alloc->stop_flusher){
+        if(dirty->count*alloc->base.node_size <= alloc->max_dirty && !dirty->overflow){
+            pthread_cond_wait(&dirty->piled_up, &dirty->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&dirty->lock);
+        btree_file_alloc_flush((bt_alloc_ptr)alloc, true);
+        pthread_mutex_lock(&dirty->lock);
+    }
+    pthread_mutex_unlock(&dirty->lock);
+    return NULL;
+}
+
+static void stop_flusher(file_alloc *alloc){
+    if(!alloc->flusher_running)
+        return;
+    pthread_mutex_lock(&alloc->dirty.lock);
+    alloc->stop_flusher = true;
+    pthread_cond_signal(&alloc->dirty.piled_up);
+    pthread_mutex_unlock(&alloc->dirty.lock);
+    pthread_join(alloc->flusher, NULL);
+    alloc->flusher_running = false;
+}
+
+// The first node a thread loads starts an operation,
+// which waits for a commit collecting changes
+static void wal_enter(wal_state *wal){
+    uintptr_t loaded = (uintptr_t)pthread_getspecific(wal->loaded);
+    if(!loaded){
+        pthread_mutex_lock(&wal->lock);
+        while(wal->quiescing)
+            pthread_cond_wait(&wal->resumed, &wal->lock);
+        wal->active++;
+        pthread_mutex_unlock(&wal->lock);
+    }
+    pthread_setspecific(wal->loaded, (void*)(loaded+1));
+}
+
+static void wal_leave(wal_state *wal){
+    uintptr_t loaded = (uintptr_t)pthread_getspecific(wal->loaded) - 1;
+    pthread_setspecific(wal->loaded, (void*)loaded);
+    if(loaded)
+        return;
+    pthread_mutex_lock(&wal->lock);
+    if(!--wal->active && wal->quiescing)
+        pthread_cond_signal(&wal->drained);
+    pthread_mutex_unlock(&wal->lock);
+}
+
+static uint64_t wal_checksum(const uint8_t *data, size_t size){
+    uint64_t hash = 14695981039346656037llu;
+    for(size_t i = 0; i+8 <= size; i += 8){
+        uint64_t word;
+        memcpy(&word, data+i, 8);
+        hash = (hash ^ word) * 1099511628211llu;
+    }
+    return hash;
+}
+
+// Copy the changed nodes into a batch, no operation may be in progress.
+// Returns the size of the batch (0 if nothing changed), or -1 on failure.
+static ssize_t wal_collect(file_alloc *alloc){
+    wal_state *wal = alloc->wal;
+    size_t node_size = alloc->base.node_size;
+    pthread_mutex_lock(&alloc->lock);
+    // Nodes of the last batch are in the file by now: unless changed again,
+    // their private copies can make way for the pages of the file
+    for(size_t i = 0; i < wal->written_count; i++){
+        bt_node_id id = wal->written[i];
+        if(!(alloc->dirty.bits[id/64] & 1llu << id%64))
+            madvise(alloc->file_map + id*node_size, node_size, MADV_DONTNEED);
+    }
+    wal->written_count = 0;
+    // The userdata of the allocator is changed without notice
+    mark_dirty(alloc, alloc->header);
+
+    dirty_nodes *dirty = &alloc->dirty;
+    size_t count = dirty->count;
+    size_t size = sizeof(wal_batch) + count*(sizeof(bt_node_id)+node_size);
+    if(size > wal->buffer_capacity){
+        uint8_t *buffer = realloc(wal->buffer, size);
+        if(!buffer){
+            pthread_mutex_unlock(&alloc->lock);
+            return -1;
+        }
+        wal->buffer = buffer;
+        wal->buffer_capacity = size;
+    }
+    // Ordered, so that the file is written front to back
+    qsort(dirty->ids, count, sizeof(bt_node_id), compare_ids);
+    uint8_t *ids = wal->buffer + sizeof(wal_batch);
+    uint8_t *nodes = ids + count*sizeof(bt_node_id);
+    memcpy(ids, dirty->ids, count*sizeof(bt_node_id));
+    for(size_t i = 0; i < count; i++){
+        bt_node_id id = dirty->ids[i];
+        memcpy(nodes + i*node_size, alloc->file_map + id*node_size, node_size);
+        dirty->bits[id/64] &= ~(1llu << id%64);
+    }
+    wal_batch batch = {WAL_MAGIC, wal->sequence, count,
+                       wal_checksum(ids, size-sizeof(wal_batch))};
+    memcpy(wal->buffer, &batch, sizeof(wal_batch));
+
+    // The ids become those of the written nodes
+    bt_node_id *written = wal->written;
+    size_t written_capacity = wal->written_capacity;
+    wal->written = dirty->ids;
+    wal->written_count = count;
+    wal->written_capacity = dirty->capacity;
+    dirty->ids = written;
+    dirty->count = 0;
+    dirty->capacity = written_capacity;
+    pthread_mutex_unlock(&alloc->lock);
+    return size;
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t size, off_t offset){
+    while(size){
+        ssize_t written = pwrite(fd, data, size, offset);
+        if(written < 0){
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void *data, size_t size, off_t offset){
+    while(size){
+        ssize_t done = pread(fd, data, size, offset);
+        if(done <= 0){
+            if(done < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        data = (uint8_t*)data + done;
+        size -= done;
+        offset += done;
+    }
+    return true;
+}
+
+// Write the nodes of a batch to the file
+static bool write_batch_nodes(int fd, const uint8_t *batch, size_t node_size){
+    wal_batch header;
+    memcpy(&header, batch, sizeof(wal_batch));
+    const uint8_t *ids = batch + sizeof(wal_batch);
+    const uint8_t *nodes = ids + header.count*sizeof(bt_node_id);
+    for(uint64_t i = 0; i < header.count; i++){
+        bt_node_id id;
+        memcpy(&id, ids + i*sizeof(bt_node_id), sizeof(bt_node_id));
+        if(!write_all(fd, nodes + i*node_size, node_size, id*node_size))
+            return false;
+    }
+    return true;
+}
+
+// Start the log over with batches numbered from sequence
+static bool wal_reset(int wal_fd, size_t node_size, uint64_t sequence){
+    wal_header header = {WAL_MAGIC, node_size, sequence};
+    return !ftruncate(wal_fd, 0)
+           && write_all(wal_fd, (uint8_t*)&header, sizeof(wal_header), 0)
+           && !fdatasync(wal_fd);
+}
+
+// Make the file durable, so that the log can start over
+static bool wal_checkpoint(file_alloc *alloc){
+    wal_state *wal = alloc->wal;
+    if(fdatasync(alloc->file_descriptor)
+            || !wal_reset(wal->fd, alloc->base.node_size, wal->sequence))
+        return false;
+    wal->size = sizeof(wal_header);
+    return true;
+}
+
+// Write the next batch, only ever done by one thread at a time
+static void wal_commit(file_alloc *alloc){
+    wal_state *wal = alloc->wal;
+    pthread_mutex_lock(&wal->lock);
+    wal->quiescing = true;
+    while(wal->active)
+        pthread_cond_wait(&wal->drained, &wal->lock);
+    pthread_mutex_unlock(&wal->lock);
+
+    ssize_t size = wal_collect(alloc);
+
+    pthread_mutex_lock(&wal->lock);
+    wal->quiescing = false;
+    pthread_cond_broadcast(&wal->resumed);
+    pthread_mutex_unlock(&wal->lock);
+
+    if(size < 0){
+        report_error(alloc, "Failed to collect changed nodes, not enough RAM");
+        return;
+    }
+    if(!size)
+        return;
+    // Operations continue meanwhile, the batch is a copy
+    if(!write_all(wal->fd, wal->buffer, size, wal->size) || fdatasync(wal->fd)){
+        // The private copies are all that is left of the nodes
+        wal->written_count = 0;
+        report_error(alloc, "Failed to write log");
+        return;
+    }
+    wal->size += size;
+    wal->sequence++;
+    if(!write_batch_nodes(alloc->file_descriptor, wal->buffer, alloc->base.node_size)){
+        wal->written_count = 0;
+        report_error(alloc, "Failed to write file");
+        return;
+    }
+    struct bt_alloc_stats *stats = alloc->base.stats;
+    if(stats && stats->event_callback)
+        stats->event_callback((bt_alloc_ptr)alloc, BT_EVENT_FLUSH,
+                              wal->written_count*alloc->base.node_size, stats->event_param);
+    if(wal->size > WAL_CHECKPOINT_SIZE && !wal_checkpoint(alloc))
+        report_error(alloc, "Failed to checkpoint log");
+}
+
+void btree_file_alloc_commit(bt_alloc_ptr alloc_ptr){
+    file_alloc *alloc = (file_alloc*)alloc_ptr;
+    wal_state *wal = alloc->wal;
+    if(!wal){
+        flush_dirty(alloc, false);
+        return;
+    }
+    pthread_mutex_lock(&wal->lock);
+    // A running commit might have collected the changes before they were made
+    uint64_t target = wal->started+1;
+    while(wal->finished < target){
+        if(wal->committing){
+            pthread_cond_wait(&wal->committed, &wal->lock);
+            continue;
+        }
+        wal->committing = true;
+        wal->started++;
+        pthread_mutex_unlock(&wal->lock);
+        wal_commit(alloc);
+        pthread_mutex_lock(&wal->lock);
+        wal->finished = wal->started;
+        wal->committing = false;
+        pthread_cond_broadcast(&wal->committed);
+    }
+    pthread_mutex_unlock(&wal->lock);
+}
+
+// Cut count bytes at offset off the end of the file or, if it can't be
+// truncated, punch them out. Returns whether the file got shorter.
+static bool shrink_file(file_alloc *alloc, uint64_t offset, uint64_t count){
+    if(!ftruncate(alloc->file_descriptor, offset))
+        return true;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if(!fallocate(alloc->file_descriptor, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                  offset, count))
+        return false;
+#endif
+    report_error(alloc, "Failed to shrink file");
+    return false;
+}
+
+// Give the free nodes at the end of the used space back to the file system
+// (see btree_compact())
+static void trim(void *this){
+    file_alloc *alloc = this;
+    // Cached ids and the nodes buffered for the free nodes tree might be at
+    // the end as well
+    flush_free_caches(alloc);
+    pthread_mutex_lock(&alloc->lock);
+    return_available(alloc);
+    bt_node_id start, length;
+    while(btree_get_floor(alloc->free_tree, &alloc->header->used_end, &start, &length)
+            && start+length == alloc->header->used_end){
+        take_from_extent(alloc, start, length, length);
+        alloc->header->used_end = start;
+    }
+    pthread_mutex_unlock(&alloc->lock);
+
+    // The trees have to be durable without the nodes before they are cut off
+    btree_file_alloc_commit((bt_alloc_ptr)alloc);
+    // Nodes taken from the end meanwhile are kept
+    pthread_mutex_lock(&alloc->lock);
+    uint64_t node_size = alloc->base.node_size;
+    bt_node_id size = alloc->header->used_end;
+    if(size < alloc->file_size
+            && shrink_file(alloc, size*node_size, (alloc->file_size-size)*node_size))
+        // Read without the lock when tracking changed nodes
+        __atomic_store_n(&alloc->file_size, size, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&alloc->lock);
+}
+
+// Apply the complete batches of the log to the file and start it over.
+// Returns false and sets errno on failure.
+static bool wal_replay(int fd, int wal_fd, size_t node_size){
+    wal_header header;
+    if(!read_all(wal_fd, &header, sizeof(wal_header), 0) || header.magic != WAL_MAGIC)
+        // Empty log
+        return wal_reset(wal_fd, node_size, 1);
+    if(header.node_size != node_size){
+        errno = EINVAL;
+        return false;
+    }
+    uint64_t sequence = header.sequence;
+    off_t offset = sizeof(wal_header);
+    uint8_t *buffer = NULL;
+    bool replayed = false;
+    for(;;){
+        wal_batch batch;
+        if(!read_all(wal_fd, &batch, sizeof(wal_batch), offset)
+                || batch.magic != WAL_MAGIC || batch.sequence != sequence
+                || batch.count > (SIZE_MAX-sizeof(wal_batch))/(sizeof(bt_node_id)+node_size))
+            break;
+        size_t size = sizeof(wal_batch) + batch.count*(sizeof(bt_node_id)+node_size);
+        uint8_t *larger = realloc(buffer, size);
+        if(!larger){
+            free(buffer);
+            return false;
+        }
+        buffer = larger;
+        // A torn batch was never committed
+        if(!read_all(wal_fd, buffer, size, offset)
+                || wal_checksum(buffer+sizeof(wal_batch), size-sizeof(wal_batch)) != batch.checksum)
+            break;
+        if(!write_batch_nodes(fd, buffer, node_size)){
+            free(buffer);
+            return false;
+        }
+        replayed = true;
+        sequence++;
+        offset += size;
+    }
+    free(buffer);
+    return (!replayed || !fdatasync(fd)) && wal_reset(wal_fd, node_size, sequence);
+}
 
+// Set up the write-ahead log once the file is mapped.
+// Returns false and sets errno on failure.
+static bool wal_init(file_alloc *alloc, int wal_fd){
+    wal_state *wal = calloc(1, sizeof(wal_state));
+    if(!wal)
+        return false;
+    if((errno = pthread_key_create(&wal->loaded, NULL))){
+        free(wal);
+        return false;
+    }
+    wal->fd = wal_fd;
+    wal->size = lseek(wal_fd, 0, SEEK_END);
+    wal_header header;
+    read_all(wal_fd, &header, sizeof(wal_header), 0);
+    wal->sequence = header.sequence;
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->committed, NULL);
+    pthread_cond_init(&wal->drained, NULL);
+    pthread_cond_init(&wal->resumed, NULL);
+    alloc->wal = wal;
+    // Nodes can only be changed in the mapping
+    if(alloc->max_nodes > alloc->map_reserved_nodes)
+        alloc->max_nodes = alloc->map_reserved_nodes;
+    return true;
+}
+
+static void wal_free(wal_state *wal){
+    pthread_key_delete(wal->loaded);
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->committed);
+    pthread_cond_destroy(&wal->drained);
+    pthread_cond_destroy(&wal->resumed);
+    free(wal->written);
+    free(wal->buffer);
+    free(wal);
+}
+
+
+
+// Reserve address space and bookkeeping for the node cache,
+// buffered frames are memory instead
+static bool init_cache(node_cache *cache, uint32_t frame_count, uint16_t node_size,
+        bool buffered){
+    cache->frame_count = frame_count;
+    uint32_t table_size = 1;
+    while(table_size < 2*frame_count)
+        table_size *= 2;
+    cache->table_mask = table_size-1;
+    cache->memory = mmap(NULL, (size_t)frame_count*node_size,
+            buffered ? PROT_READ|PROT_WRITE : PROT_NONE,
+            MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    cache->frames = calloc(frame_count, sizeof(cache_frame));
+    cache->table = calloc(table_size, sizeof(uint32_t));
+    if(cache->memory == MAP_FAILED || !cache->frames || !cache->table){
+        if(cache->memory != MAP_FAILED)
+            munmap(cache->memory, (size_t)frame_count*node_size);
+        free(cache->frames);
+        free(cache->table);
+        *cache = (node_cache){0};
+        return false;
+    }
+    return true;
+}
+
+// Extend the whole file mapping (if any) to cover the entire file
+static bool grow_map(file_alloc *alloc){
+    if(!alloc->file_map || alloc->map_nodes >= alloc->file_size
+            || alloc->map_nodes == alloc->map_reserved_nodes)
+        return true;
+    // Grow geometrically, mapping past the end of the file is fine
+    // as long as these nodes aren't accessed
+    bt_node_id nodes = 2*alloc->map_nodes;
+    if(nodes < alloc->file_size)
+        nodes = alloc->file_size;
+    if(nodes > alloc->map_reserved_nodes)
+        nodes = alloc->map_reserved_nodes;
+    // Only the new part is mapped, replacing the reservation,
+    // so that already mapped nodes are untouched
+    size_t node_size = alloc->base.node_size;
+    void *mem = mmap(alloc->file_map + alloc->map_nodes*node_size,
+            (nodes-alloc->map_nodes)*node_size, PROT_READ|PROT_WRITE,
+            // With a log, changes must not reach the file before being committed
+            (alloc->wal ? MAP_PRIVATE : MAP_SHARED)|MAP_FIXED,
+            alloc->file_descriptor, alloc->map_nodes*node_size);
+    // On failure nodes will just be loaded through the cache
+    if(mem == MAP_FAILED)
+        return false;
+    __atomic_store_n(&alloc->map_nodes, nodes, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Reserve address space for mapping the whole file
+static bool init_map(file_alloc *alloc, uint64_t map_size){
+    alloc->map_reserved_nodes = map_size / alloc->base.node_size;
+    alloc->dirty.bits = calloc((alloc->map_reserved_nodes+63)/64, sizeof(uint64_t));
+    if(!alloc->dirty.bits)
+        return false;
+    alloc->file_map = mmap(NULL, alloc->map_reserved_nodes*alloc->base.node_size,
+            PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if(alloc->file_map == MAP_FAILED){
+        alloc->file_map = NULL;
+        return false;
+    }
+    return true;
+}
+
+void btree_file_alloc_cache_stats(bt_alloc_ptr alloc, uint64_t *hits, uint64_t *misses){
+    node_cache *cache = &((file_alloc*)alloc)->cache;
+    pthread_mutex_lock(&((file_alloc*)alloc)->cache_lock);
+    if(hits)
+        *hits = cache->hits;
+    if(misses)
+        *misses = cache->misses;
+    pthread_mutex_unlock(&((file_alloc*)alloc)->cache_lock);
+}
+
+// Release what get_alloc_base() set up, also if it failed half way
+static void free_alloc_base(file_alloc *alloc){
+    if(alloc->wal)
+        wal_free(alloc->wal);
+    destroy_caches(alloc->free_caches);
+    pthread_mutex_destroy(&alloc->lock);
+    pthread_mutex_destroy(&alloc->cache_lock);
+    pthread_cond_destroy(&alloc->frame_ready);
+    pthread_mutex_destroy(&alloc->dirty.lock);
+    pthread_cond_destroy(&alloc->dirty.piled_up);
+    pthread_mutex_destroy(&alloc->flush_lock);
+    free(alloc->dirty.bits);
+    free(alloc->dirty.ids);
+    free(alloc->flushing);
+    size_t node_size = alloc->base.node_size;
+    // Replaces the nodes mapped into the frames as well
+    if(alloc->cache.memory)
+        munmap(alloc->cache.memory, (size_t)alloc->cache.frame_count*node_size);
+    if(alloc->file_map)
+        munmap(alloc->file_map, alloc->map_reserved_nodes*node_size);
+    free(alloc->cache.frames);
+    free(alloc->cache.table);
+    if(alloc->direct_io)
+        fcntl(alloc->file_descriptor, F_SETFL,
+              fcntl(alloc->file_descriptor, F_GETFL) & ~O_DIRECT);
+    free(alloc);
+}
+
+// Free the allocator being created (if any) and report error like
+// report_error(), but to a callback that can't be passed the allocator
+static file_alloc *fail_alloc_base(file_alloc *alloc, int error,
+        bt_error_callback error_callback, const char *message){
+    if(alloc)
+        free_alloc_base(alloc);
+    errno = error;
+    if(error_callback){
+        error_callback(NULL, error);
+        return NULL;
+    }
+    fprintf(stderr, "Error: %s\n", message);
+    exit(1);
+}
 
 // Initialize a new file_alloc as far as both creation and loading from file require
-static file_alloc *get_alloc_base(int fd, bt_error_callback error_callback){
+static file_alloc *get_alloc_base(int fd, const struct bt_file_options *options,
+        bool existing, bt_error_callback error_callback){
     // The size of each allocation. A page is usually 4kb in size.
     // Maybe instead make this a compile option?
     int node_size = getpagesize();
 
     // Construct struct describing the allocator
     file_alloc *alloc = calloc(1, sizeof(file_alloc));
+    if(!alloc)
+        return fail_alloc_base(NULL, ENOMEM, error_callback, "Failed to allocate allocator");
     alloc->base = (struct bt_alloc){
         new,
         load,
@@ -177,22 +1536,63 @@ static file_alloc *get_alloc_base(int fd, bt_error_callback error_callback){
 
         node_size
     };
+    alloc->base.dirty = dirty;
+    alloc->base.new_range = new_range;
+    alloc->base.trim = trim;
+    bool compact = options && options->compact_ids;
+    alloc->base.id_size = compact ? sizeof(uint32_t) : 6;
+    alloc->max_nodes = compact ? MAX_COMPACT_NODES : MAX_NODES;
     alloc->file_descriptor = fd;
+    pthread_mutex_init(&alloc->lock, NULL);
+    pthread_mutex_init(&alloc->cache_lock, NULL);
+    pthread_cond_init(&alloc->frame_ready, NULL);
+    pthread_mutex_init(&alloc->dirty.lock, NULL);
+    pthread_cond_init(&alloc->dirty.piled_up, NULL);
+    pthread_mutex_init(&alloc->flush_lock, NULL);
+    alloc->max_dirty = options ? options->max_dirty : 0;
+    init_caches(alloc->free_caches);
+
+    alloc->buffered = options && options->buffered;
+    if(alloc->buffered && (options->map_size || options->wal_fd))
+        return fail_alloc_base(alloc, EINVAL, error_callback,
+                               "A buffered file allocator can't map the file or have a log");
+    if(alloc->buffered && options->direct_io){
+        int flags = fcntl(fd, F_GETFL);
+        if(flags == -1 || (!(flags & O_DIRECT) && fcntl(fd, F_SETFL, flags|O_DIRECT)))
+            return fail_alloc_base(alloc, errno, error_callback, "Failed to enable direct I/O");
+        alloc->direct_io = !(flags & O_DIRECT);
+    }
+    // Mapped nodes are left to the kernel, which reads around the node on a
+    // page fault anyway; having the nodes read before keeps it from doing so,
+    // which made cold scans slower. Direct I/O bypasses the page cache.
+    // Without the hook, B+ tree scans follow the links between the leaves.
+    if(alloc->buffered && !options->direct_io && !options->no_prefetch)
+        alloc->base.prefetch = prefetch;
+
+    // Bring the file to the state of the last commit before looking at it
+    int wal_fd = options ? options->wal_fd : 0;
+    if(wal_fd && !(existing ? wal_replay(fd, wal_fd, node_size)
+                            : wal_reset(wal_fd, node_size, 1)))
+        return fail_alloc_base(alloc, errno, error_callback, "Failed to replay log");
 
     // Store the file size, else every allocation (when the free nodes tree is empty)
     // would require calling fstat
     struct stat filestat;
-    if(fstat(fd, &filestat)){
-        if(error_callback){
-            error_callback(NULL, errno);
-            return NULL;
-        } else {
-            fputs("Error: Failed to stat file", stderr);
-            exit(1);
-        }
-    }
+    if(fstat(fd, &filestat))
+        return fail_alloc_base(alloc, errno, error_callback, "Failed to stat file");
     alloc->file_size = filestat.st_size / node_size;
 
+    uint32_t cache_nodes = options && options->cache_nodes ?
+                           options->cache_nodes : DEFAULT_CACHE_NODES;
+    // Buffered frames are written back from the list of flushing ids
+    if(alloc->buffered){
+        alloc->flushing = malloc(cache_nodes*sizeof(bt_node_id));
+        alloc->flushing_capacity = cache_nodes;
+    }
+    if(!init_cache(&alloc->cache, cache_nodes, node_size, alloc->buffered)
+            || (alloc->buffered && !alloc->flushing))
+        return fail_alloc_base(alloc, ENOMEM, error_callback, "Failed to allocate node cache");
+
     // Construct allocator for the free nodes tree,
     alloc->free_tree_alloc.base = (struct bt_alloc){
         helper_new_node,
@@ -202,6 +1602,15 @@ static file_alloc *get_alloc_base(int fd, bt_error_callback error_callback){
 
         alloc->base.node_size
     };
+    alloc->free_tree_alloc.base.dirty = helper_dirty;
+
+    // A log needs all nodes to be in the whole file mapping
+    uint64_t map_size = options ? options->map_size : 0;
+    if(wal_fd && !map_size)
+        map_size = DEFAULT_WAL_MAP_SIZE;
+    if(map_size && !(init_map(alloc, map_size)
+                     && (!wal_fd || wal_init(alloc, wal_fd)) && grow_map(alloc)))
+        return fail_alloc_base(alloc, errno, error_callback, "Failed to map file");
     alloc->free_tree_alloc.freed_nodes_lenght = 0;
 
     alloc->error_callback = error_callback;
@@ -209,62 +1618,145 @@ static file_alloc *get_alloc_base(int fd, bt_error_callback error_callback){
     return alloc;
 }
 
+// Start the background flusher if requested, once the allocator is complete.
+// On failure the allocator is closed, returns false and sets errno.
+static bool start_flusher(file_alloc *alloc){
+    if(!alloc->max_dirty
+            || !(errno = pthread_create(&alloc->flusher, NULL, flusher, alloc))){
+        alloc->flusher_running = alloc->max_dirty;
+        return true;
+    }
+    int error = errno;
+    btree_close_file_alloc((bt_alloc_ptr)alloc);
+    errno = error;
+    return false;
+}
 
-bt_alloc_ptr btree_new_file_alloc(int fd, void** userdata, int userdata_size, bt_error_callback error_callback){
+bt_alloc_ptr btree_new_file_alloc(int fd, void** userdata, int userdata_size,
+        const struct bt_file_options *options, bt_error_callback error_callback){
     // Basic init shared with btree_load_file_alloc
-    file_alloc *alloc = get_alloc_base(fd, error_callback);
+    file_alloc *alloc = get_alloc_base(fd, options, false, error_callback);
+    if(!alloc)
+        return NULL;
     
     // Make sure the file has minimum enough size for the root
     if(!alloc->file_size) {
         alloc->file_size = 2;
         if((errno = posix_fallocate(fd, 0,
                     alloc->base.node_size * alloc->file_size)))
-        {
-            if(error_callback){
-                error_callback(NULL, errno);
-                return NULL;
-            } else {
-                fputs("Error: Failed to allocate file\n", stderr);
-                exit(1);
-            }
-        }
+            return (bt_alloc_ptr)fail_alloc_base(alloc, errno, error_callback,
+                                                 "Failed to allocate file");
+        grow_map(alloc);
     }
 
-    // The free nodes tree will not have any values associated with the keys.
-    // Also store userdata and max_allocated in the root node.
-    alloc->free_tree = btree_create((bt_alloc_ptr)&alloc->free_tree_alloc,
-                            sizeof(bt_node_id), 0, NULL,
-                            userdata_size + sizeof(bt_node_id));
-
     // The root will be set to node 0
     alloc->free_tree_alloc.available_nodes[0] = 0;
     alloc->free_tree_alloc.available_nodes_lenght = 1;
 
-    alloc->root_userdata = btree_load_userdata(alloc->free_tree);
+    // The free nodes tree maps the start of each extent to its length.
+    // Keys are compared numerically, so that neighbouring extents are
+    // neighbours in the tree.
+    // Also store userdata and max_allocated in the root node.
+    alloc->free_tree = btree_create((bt_alloc_ptr)&alloc->free_tree_alloc,
+                            sizeof(bt_node_id), sizeof(bt_node_id), btree_compare_u64,
+                            userdata_size + sizeof(file_header), 0);
+
+    alloc->header = btree_load_userdata(alloc->free_tree);
+    alloc->header->magic = FILE_MAGIC;
     // The first node is taken by the free nodes tree root
-    *(bt_node_id*)alloc->root_userdata = 1;
-    // Real userdate comes after max_allocated
+    alloc->header->used_end = 1;
+    // Its nodes come from the same allocator, the root from the end of the file
+    alloc->by_length = btree_create((bt_alloc_ptr)&alloc->free_tree_alloc,
+                            2*sizeof(bt_node_id), 0, compare_length_start, 0, 0);
+    alloc->header->by_length_root = alloc->by_length.root;
+    // Real userdate comes after the header
     if(userdata)
-        *userdata = (char*)btree_load_userdata(alloc->free_tree)+sizeof(bt_node_id);
+        *userdata = (char*)alloc->header+sizeof(file_header);
 
+    if(!start_flusher(alloc)){
+        if(error_callback){
+            error_callback(NULL, errno);
+            return NULL;
+        }
+        fputs("Error: Failed to start flusher thread\n", stderr);
+        exit(1);
+    }
     return (bt_alloc_ptr)alloc;
 }
 
 
 
-bt_alloc_ptr btree_load_file_alloc(int fd, void **userdata, bt_error_callback error_callback){
-    file_alloc *alloc = get_alloc_base(fd, error_callback);
+void btree_close_file_alloc(bt_alloc_ptr alloc_ptr){
+    file_alloc *alloc = (file_alloc*)alloc_ptr;
+    stop_flusher(alloc);
+    // Cached free nodes would be lost otherwise
+    btree_reclaim_retired(alloc_ptr);
+    flush_free_caches(alloc);
+    // Changes only the frames hold as well
+    if(alloc->buffered)
+        flush_dirty(alloc, true);
+    if(alloc->header)
+        btree_unload_userdata(alloc->free_tree, (char*)alloc->header);
+    if(alloc->wal){
+        btree_file_alloc_commit(alloc_ptr);
+        if(!wal_checkpoint(alloc))
+            report_error(alloc, "Failed to checkpoint log");
+    }
+    free_alloc_base(alloc);
+}
+
+bt_alloc_ptr btree_load_file_alloc(int fd, void **userdata,
+        const struct bt_file_options *options, bt_error_callback error_callback){
+    file_alloc *alloc = get_alloc_base(fd, options, true, error_callback);
+    if(!alloc)
+        return NULL;
 
     alloc->free_tree = (btree){
         .alloc = (bt_alloc_ptr)&alloc->free_tree_alloc,
         .root = 0,
-        .compare = memcmp
+        .compare = btree_compare_u64
     };
 
-    alloc->root_userdata = btree_load_userdata(alloc->free_tree);
+    // New files have at least the free nodes tree root and the node after it
+    if(alloc->file_size >= 2)
+        alloc->header = btree_load_userdata(alloc->free_tree);
+    if(!alloc->header || alloc->header->magic != FILE_MAGIC){
+        btree_close_file_alloc((bt_alloc_ptr)alloc);
+        errno = EINVAL;
+        if(error_callback){
+            error_callback(NULL, errno);
+            return NULL;
+        }
+        fputs("Error: File wasn't created by this version of the file allocator\n", stderr);
+        exit(1);
+    }
+    // Ids already handed out may not fit with compact ids
+    if(alloc->header->used_end > alloc->max_nodes){
+        btree_close_file_alloc((bt_alloc_ptr)alloc);
+        errno = EFBIG;
+        if(error_callback){
+            error_callback(NULL, errno);
+            return NULL;
+        }
+        fputs("Error: File has too many nodes for compact ids\n", stderr);
+        exit(1);
+    }
+    alloc->by_length = (btree){
+        .alloc = (bt_alloc_ptr)&alloc->free_tree_alloc,
+        .root = alloc->header->by_length_root,
+        .compare = compare_length_start
+    };
     // TODO: worry about max_allocated allignment
     if(userdata)
-        *userdata = (uint8_t*)alloc->root_userdata + sizeof(bt_node_id);
+        *userdata = (uint8_t*)alloc->header + sizeof(file_header);
 
+    if(!start_flusher(alloc)){
+        if(error_callback){
+            error_callback(NULL, errno);
+            return NULL;
+        }
+        fputs("Error: Failed to start flusher thread\n", stderr);
+        exit(1);
+    }
     return (bt_alloc_ptr)alloc;
 }
@@ -1,27 +1,173 @@
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "btree.h"
+#include "btree_internal.h"
+
+// Nodes are carved out of regions allocated with mmap, so they need
+// no malloc header and are aligned to node_size (if a power of two).
+// Regions are never returned before the allocator is freed; instead freed
+// nodes are kept for reuse.
+// Each thread takes from and frees into its own cache (see id_cache), which
+// exchanges nodes in batches with a shared pool. The pool gets new nodes
+// from the current region.
+// Size and alignment of the regions, that of a huge page
+#define REGION_SIZE (2ul<<20)
+// Address space reserved for compact ids if bt_ram_options doesn't specify it
+#define DEFAULT_MAX_SIZE (64ull<<30)
+
+// Free nodes, each storing a pointer to the next one at its start
+typedef struct {
+    pthread_mutex_t lock;
+    void *first;
+} node_list;
 
 struct bt_ram_alloc {
     struct bt_alloc base;
     bt_error_callback error_callback;
+    bool huge_pages;
+    // With compact ids, the reserved address space the ids are indexes into
+    // (id 0 is left unused). Regions are committed one after another.
+    uint8_t *start;
+    uint64_t reserved;
+    // Part of the current region that wasn't carved into nodes yet
+    pthread_mutex_t lock;
+    uint8_t *next, *end;
+    // Regions mapped without compact ids, to unmap them when freed
+    void **regions;
+    size_t region_count, region_capacity;
+    node_list pool;
+    id_cache caches[CACHE_STRIPES];
 };
 
-// Allcate space
-static bt_node_id new(void *this){
-    // Replacing this with mmap(MAP_32BIT) would allow bt_nodes_id
-    // to be 32 bit instead of 64
-    void *node = malloc(((bt_alloc_ptr)this)->node_size);
-    if(node==NULL){
-        bt_error_callback callback = ((struct bt_ram_alloc*)this)->error_callback;
+// Map size bytes aligned to REGION_SIZE, returns NULL on failure
+static void *map_aligned(size_t size, int prot, int flags){
+    uint8_t *mapped = mmap(NULL, size+REGION_SIZE, prot, flags, -1, 0);
+    if(mapped == MAP_FAILED)
+        return NULL;
+    size_t offset = (REGION_SIZE - (uintptr_t)mapped%REGION_SIZE) % REGION_SIZE;
+    if(offset)
+        munmap(mapped, offset);
+    munmap(mapped+offset+size, REGION_SIZE-offset);
+    return mapped+offset;
+}
+
+// Make a new region available to carve nodes from.
+// Returns false and sets errno on failure.
+static bool new_region(struct bt_ram_alloc *alloc){
+    uint8_t *region;
+    if(alloc->start){
+        // Commit the next part of the reservation, the nodes continue
+        // where the previous region ended
+        region = alloc->end;
+        if(region+REGION_SIZE > alloc->start+alloc->reserved){
+            errno = ENOMEM;
+            return false;
+        }
+        if(mprotect(region, REGION_SIZE, PROT_READ|PROT_WRITE))
+            return false;
+    } else {
+        if(alloc->region_count == alloc->region_capacity){
+            size_t capacity = alloc->region_capacity ? 2*alloc->region_capacity : 16;
+            void **regions = realloc(alloc->regions, capacity*sizeof(void*));
+            if(!regions)
+                return false;
+            alloc->regions = regions;
+            alloc->region_capacity = capacity;
+        }
+        region = NULL;
+#ifdef MAP_HUGETLB
+        // Only succeeds if enough huge pages are reserved
+        if(alloc->huge_pages){
+            region = mmap(NULL, REGION_SIZE, PROT_READ|PROT_WRITE,
+                          MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+            if(region == MAP_FAILED)
+                region = NULL;
+        }
+#endif
+        if(!region)
+            region = map_aligned(REGION_SIZE, PROT_READ|PROT_WRITE,
+                                 MAP_PRIVATE|MAP_ANONYMOUS);
+        if(!region)
+            return false;
+        alloc->regions[alloc->region_count++] = region;
+        alloc->next = region;
+    }
+#ifdef MADV_HUGEPAGE
+    if(alloc->huge_pages)
+        madvise(region, REGION_SIZE, MADV_HUGEPAGE);
+#endif
+    alloc->end = region+REGION_SIZE;
+    return true;
+}
+
+static bt_node_id to_id(struct bt_ram_alloc *alloc, void *node){
+    if(alloc->start)
+        return ((uint8_t*)node-alloc->start)/alloc->base.node_size;
+    return (bt_node_id)node;
+}
+
+static void *from_id(struct bt_ram_alloc *alloc, bt_node_id id){
+    return alloc->start ? alloc->start + id*alloc->base.node_size : (void*)id;
+}
+
+// Refill an empty cache from the pool or, if it is empty, with nodes carved
+// out of the current region (or a new one), see cache_refill
+static uint32_t refill_cache(void *this, bt_node_id *ids){
+    struct bt_ram_alloc *alloc = this;
+    uint32_t count = 0;
+    pthread_mutex_lock(&alloc->pool.lock);
+    for(; count < CACHE_BATCH && alloc->pool.first; count++){
+        ids[count] = to_id(alloc, alloc->pool.first);
+        alloc->pool.first = *(void**)alloc->pool.first;
+    }
+    pthread_mutex_unlock(&alloc->pool.lock);
+    if(count)
+        return count;
+
+    uint16_t node_size = alloc->base.node_size;
+    pthread_mutex_lock(&alloc->lock);
+    if(alloc->next+node_size > alloc->end && !new_region(alloc)){
+        pthread_mutex_unlock(&alloc->lock);
+        bt_error_callback callback = alloc->error_callback;
         if(callback)
             callback(this, errno);
         else {
             fputs("Error: Failed to allocate btree node, not enough RAM\n", stderr);
             exit(1);
         }
+        return 0;
     }
-    return (bt_node_id)node;
+    uint8_t *first = alloc->next;
+    count = (alloc->end-first)/node_size;
+    if(count > CACHE_BATCH)
+        count = CACHE_BATCH;
+    alloc->next = first+count*node_size;
+    pthread_mutex_unlock(&alloc->lock);
+    // Nodes are taken from the end, so that they are handed out in order
+    for(uint32_t i = 0; i < count; i++)
+        ids[i] = to_id(alloc, first+(count-1-i)*node_size);
+    return count;
+}
+
+// Hand ids over to the pool (see cache_release)
+static void release_to_pool(void *this, const bt_node_id *ids, uint32_t count){
+    struct bt_ram_alloc *alloc = this;
+    pthread_mutex_lock(&alloc->pool.lock);
+    for(uint32_t i = 0; i < count; i++){
+        void *node = from_id(alloc, ids[i]);
+        *(void**)node = alloc->pool.first;
+        alloc->pool.first = node;
+    }
+    pthread_mutex_unlock(&alloc->pool.lock);
+}
+
+// Allcate space
+static bt_node_id new(void *this){
+    struct bt_ram_alloc *alloc = this;
+    // On failure, the error callback has been called already
+    return cache_take(alloc->caches, alloc, refill_cache);
 }
 
 // Nothing to do beside cast, already in RAM
@@ -29,26 +175,79 @@ static void *load(btree tree, bt_node_id node){
     return (void*) node;
 }
 
+// Compact ids are indexes into the reserved address space
+static void *load_compact(btree tree, bt_node_id node){
+    struct bt_ram_alloc *alloc = (struct bt_ram_alloc*)tree.alloc;
+    return alloc->start + node*alloc->base.node_size;
+}
+
 // Nothing to do, node will stay in RAM
 static void unload(btree tree, void *node){}
 
-// Deallocate node
-static void free_node(void *this, bt_node_id node){
-    free((void*)node);
+// Keep the node for reuse, passing a batch on to the pool if the cache is full
+static void free_node(void *this, bt_node_id node_id){
+    struct bt_ram_alloc *alloc = this;
+    cache_put(alloc->caches, alloc, node_id, release_to_pool);
 }
 
-
-
-bt_alloc_ptr btree_new_ram_alloc(uint16_t node_size, bt_error_callback error_callback){
-    struct bt_ram_alloc *alloc = malloc(sizeof(struct bt_ram_alloc));
+bt_alloc_ptr btree_new_ram_alloc(uint16_t node_size, const struct bt_ram_options *options,
+        bt_error_callback error_callback){
+    struct bt_ram_alloc *alloc = calloc(1, sizeof(struct bt_ram_alloc));
+    if(alloc && options && options->compact_ids){
+        uint64_t max_size = options->max_size ? options->max_size : DEFAULT_MAX_SIZE;
+        // Ids have to stay below 2^32
+        if(max_size/node_size > UINT32_MAX)
+            max_size = (uint64_t)UINT32_MAX*node_size;
+        alloc->reserved = max_size < REGION_SIZE ? REGION_SIZE
+                                                 : max_size/REGION_SIZE*REGION_SIZE;
+        alloc->start = map_aligned(alloc->reserved, PROT_NONE,
+                                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE);
+        if(!alloc->start){
+            free(alloc);
+            alloc = NULL;
+        }
+    }
+    if(!alloc){
+        if(error_callback){
+            error_callback(NULL, errno);
+            return NULL;
+        }
+        fputs("Error: Failed to allocate btree allocator, not enough RAM\n", stderr);
+        exit(1);
+    }
     alloc->base = (struct bt_alloc){
         new,
-        load,
+        alloc->start ? load_compact : load,
         unload,
         free_node,
 
         node_size
     };
+    if(alloc->start){
+        alloc->base.id_size = sizeof(uint32_t);
+        alloc->next = alloc->end = alloc->start;
+        // Skip the node with id 0
+        alloc->next += node_size;
+    }
     alloc->error_callback = error_callback;
+    alloc->huge_pages = options && options->huge_pages;
+    pthread_mutex_init(&alloc->lock, NULL);
+    pthread_mutex_init(&alloc->pool.lock, NULL);
+    init_caches(alloc->caches);
     return (bt_alloc_ptr)alloc;
 }
+
+void btree_free_ram_alloc(bt_alloc_ptr alloc_ptr){
+    struct bt_ram_alloc *alloc = (struct bt_ram_alloc*)alloc_ptr;
+    // Their nodes are unmapped, but they mustn't be freed later
+    btree_reclaim_retired(alloc_ptr);
+    if(alloc->start)
+        munmap(alloc->start, alloc->reserved);
+    for(size_t i = 0; i < alloc->region_count; i++)
+        munmap(alloc->regions[i], REGION_SIZE);
+    free(alloc->regions);
+    pthread_mutex_destroy(&alloc->lock);
+    pthread_mutex_destroy(&alloc->pool.lock);
+    destroy_caches(alloc->caches);
+    free(alloc);
+}
@@ -1,10 +1,17 @@
+// For O_DIRECT
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "btree.h"
 
@@ -66,7 +73,7 @@ void test_random(bt_alloc_ptr alloc, int attempts, int len, float del_chance){
 
         // TODO: test userdata storage
         btree tree = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
-                        compare_uint32, 0);
+                        compare_uint32, 0, 0);
 
         // Create random tree
         uint32_t *keys = calloc(sizeof(uint32_t), len);
@@ -136,9 +143,9 @@ void create_tree(){
         exit(1);
     }
 
-    bt_alloc_ptr alloc = btree_new_file_alloc(file, NULL, 0, NULL);
+    bt_alloc_ptr alloc = btree_new_file_alloc(file, NULL, 0, NULL, NULL);
 //    bt_alloc_ptr alloc = btree_new_ram_alloc(100);
-    btree tree = btree_create(alloc, 4, 4, memcmp, 0);
+    btree tree = btree_create(alloc, 4, 4, memcmp, 0, 0);
     int num = 3500;
     btree_debug_print(stdout, tree, NULL, NULL);
     for(int i = 1; i < num; i++){
@@ -156,7 +163,7 @@ void remove_tree(){
         exit(1);
     }
 
-    bt_alloc_ptr alloc = btree_load_file_alloc(file, NULL, NULL);
+    bt_alloc_ptr alloc = btree_load_file_alloc(file, NULL, NULL, NULL);
     btree tree = {alloc, 1, memcmp};
 
     int num = 3500;
@@ -176,6 +183,1567 @@ void remove_tree(){
     close(file);
 }
 
+// Insert, look up and remove keys in a file backed tree, using a node cache
+// small enough to force evictions and/or mapping (part of) the file at once
+struct event_counts {
+    uint64_t events[BT_EVENT_FLUSH+1];
+    uint64_t file_size;
+    uint64_t last_flush;
+};
+
+void count_event(bt_alloc_ptr alloc, enum bt_event event, uint64_t arg, void *param){
+    struct event_counts *counts = param;
+    // Flushes may be reported by the background flusher
+    __atomic_fetch_add(counts->events+event, 1, __ATOMIC_RELAXED);
+    if(event == BT_EVENT_FILE_GROWTH)
+        counts->file_size = arg;
+    if(event == BT_EVENT_FLUSH)
+        __atomic_store_n(&counts->last_flush, arg, __ATOMIC_RELAXED);
+}
+
+uint64_t histogram_sum(const uint64_t *histogram){
+    uint64_t sum = 0;
+    for(int i = 0; i < BT_LATENCY_BUCKETS; i++)
+        sum += histogram[i];
+    return sum;
+}
+
+void test_file_alloc(uint32_t cache_nodes, uint64_t map_size, int len, int flags){
+    char path[] = "/tmp/btree_test_XXXXXX";
+    int file = mkstemp(path);
+    if(file==-1){
+        perror("Couldn't create file");
+        exit(1);
+    }
+    unlink(path);
+
+    struct bt_file_options options = {
+        .cache_nodes = cache_nodes,
+        .map_size = map_size,
+        .compact_ids = flags & BT_IDS32
+    };
+    bt_alloc_ptr alloc = btree_new_file_alloc(file, NULL, 0, &options, NULL);
+    struct event_counts counts = {{0}};
+    struct bt_alloc_stats stats = {
+        .record_latency = true,
+        .event_callback = count_event,
+        .event_param = &counts
+    };
+    btree_alloc_stats(alloc, &stats);
+    btree tree = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                    compare_uint32, 0, flags);
+    for(uint32_t i = 1; i <= len; i++)
+        btree_insert(tree, &i, &i);
+    struct stat file_stat;
+    fstat(file, &file_stat);
+    if(!counts.events[BT_EVENT_FILE_GROWTH] || counts.file_size != file_stat.st_size
+            || histogram_sum(stats.load_latency) < stats.loads){
+        printf("TEST FAILED:\nFile grew %lu times to %lu bytes instead of %lu, "
+               "%lu of %lu loads were timed\n", counts.events[BT_EVENT_FILE_GROWTH],
+               counts.file_size, file_stat.st_size,
+               histogram_sum(stats.load_latency), stats.loads);
+        exit(1);
+    }
+    for(uint32_t i = 1; i <= len; i+=2){
+        uint32_t value;
+        if(!btree_remove(tree, &i, &value) || value!=i){
+            printf("TEST FAILED:\nCouldn't remove %x from file tree\n", i);
+            exit(1);
+        }
+    }
+    for(uint32_t i = 1; i <= len; i++)
+        if(btree_contains(tree, &i) != !(i%2)){
+            printf("TEST FAILED:\nFile tree %s %x\n",
+                    i%2 ? "still contains" : "lost", i);
+            exit(1);
+        }
+
+    uint64_t hits, misses;
+    btree_file_alloc_cache_stats(alloc, &hits, &misses);
+    if(!map_size && (!hits || !misses)){
+        printf("TEST FAILED:\nNode cache had %lu hits and %lu misses\n",
+                hits, misses);
+        exit(1);
+    }
+    btree_delete(tree);
+    btree_alloc_stats(alloc, NULL);
+    close(file);
+}
+
+int last_error;
+
+void record_error(bt_alloc_ptr alloc, int error){
+    last_error = error;
+}
+
+// Files that weren't created by the allocator, like empty ones, are rejected
+void test_file_format(void){
+    char path[] = "/tmp/btree_test_XXXXXX";
+    int file = mkstemp(path);
+    if(file==-1){
+        perror("Couldn't create file");
+        exit(1);
+    }
+    unlink(path);
+
+    struct bt_file_options buffered = {.cache_nodes = 8, .buffered = true};
+    for(int size = 0; size < 2; size++){
+        if(size && ftruncate(file, 4*getpagesize())){
+            perror("Couldn't grow file");
+            exit(1);
+        }
+        for(int i = 0; i < 2; i++){
+            last_error = 0;
+            bt_alloc_ptr alloc = btree_load_file_alloc(file, NULL, i ? &buffered : NULL,
+                                                       record_error);
+            if(alloc || last_error != EINVAL){
+                printf("TEST FAILED:\nLoading a %s file %s\n", size ? "zeroed" : "empty",
+                       alloc ? "succeeded" : "failed with another error");
+                exit(1);
+            }
+        }
+    }
+    // As are options a buffered allocator can't have
+    last_error = 0;
+    struct bt_file_options mapped = {.buffered = true, .map_size = 1<<20};
+    if(btree_new_file_alloc(file, NULL, 0, &mapped, record_error) || last_error != EINVAL){
+        printf("TEST FAILED:\nBuffered allocator mapped the file\n");
+        exit(1);
+    }
+    close(file);
+}
+
+// Freed nodes should be merged into extents that ranges can be allocated from
+void test_file_extents(int len){
+    char path[] = "/tmp/btree_test_XXXXXX";
+    int file = mkstemp(path);
+    if(file==-1){
+        perror("Couldn't create file");
+        exit(1);
+    }
+    unlink(path);
+
+    bt_alloc_ptr alloc = btree_new_file_alloc(file, NULL, 0, NULL, NULL);
+    btree tree = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                    compare_uint32, 0, 0);
+    for(uint32_t i = 1; i <= len; i++)
+        btree_insert(tree, &i, &i);
+    btree_delete(tree);
+
+    struct stat before, after;
+    fstat(file, &before);
+    bt_node_id range = btree_file_alloc_new_range(alloc, 100);
+    fstat(file, &after);
+    if(before.st_size != after.st_size){
+        printf("TEST FAILED:\nFreed nodes weren't merged into a range\n");
+        exit(1);
+    }
+    btree_file_alloc_free_range(alloc, range, 100);
+    if(btree_file_alloc_new_range(alloc, 100) != range){
+        printf("TEST FAILED:\nFreed range wasn't reused\n");
+        exit(1);
+    }
+    btree_close_file_alloc(alloc);
+
+    // Ranges come from the smallest extent they fit into
+    alloc = btree_new_file_alloc(file, NULL, 0, NULL, NULL);
+    bt_node_id sizes[3] = {50, 10, 30}, ranges[3];
+    for(int i = 0; i < 3; i++){
+        ranges[i] = btree_file_alloc_new_range(alloc, sizes[i]);
+        // Keeps the extents apart
+        btree_file_alloc_new_range(alloc, 1);
+    }
+    for(int i = 0; i < 3; i++)
+        btree_file_alloc_free_range(alloc, ranges[i], sizes[i]);
+    bt_node_id counts[3] = {8, 25, 40};
+    bt_node_id expected[3] = {ranges[1]+2, ranges[2]+5, ranges[0]+10};
+    for(int i = 0; i < 3; i++){
+        bt_node_id got = btree_file_alloc_new_range(alloc, counts[i]);
+        if(got != expected[i]){
+            printf("TEST FAILED:\n%lu nodes taken at %lu instead of %lu\n",
+                   counts[i], got, expected[i]);
+            exit(1);
+        }
+    }
+
+    // Randomly allocated and freed ranges never overlap, also after reopening
+    enum {MAX_ID = 1<<16, LIVE = 64};
+    uint8_t *used = calloc(MAX_ID, 1);
+    bt_node_id live_start[LIVE] = {0}, live_count[LIVE] = {0};
+    for(int i = 0; i < 20000; i++){
+        if(i == 10000){
+            btree_close_file_alloc(alloc);
+            alloc = btree_load_file_alloc(file, NULL, NULL, NULL);
+        }
+        int slot = rand()%LIVE;
+        if(live_count[slot]){
+            btree_file_alloc_free_range(alloc, live_start[slot], live_count[slot]);
+            memset(used+live_start[slot], 0, live_count[slot]);
+        }
+        bt_node_id count = rand()%64 + 1;
+        bt_node_id start = btree_file_alloc_new_range(alloc, count);
+        if(start+count > MAX_ID || memchr(used+start, 1, count)){
+            printf("TEST FAILED:\nRange of %lu nodes at %lu overlaps\n", count, start);
+            exit(1);
+        }
+        memset(used+start, 1, count);
+        live_start[slot] = start;
+        live_count[slot] = count;
+    }
+    free(used);
+    btree_close_file_alloc(alloc);
+    close(file);
+}
+
+bool bulk_next(void *key, void *value, void *param){
+    uint32_t *remaining = param;
+    if(!remaining[0])
+        return false;
+    remaining[0]--;
+    remaining[1] += 2;
+    memcpy(key, &remaining[1], sizeof(uint32_t));
+    memcpy(value, &remaining[1], sizeof(uint32_t));
+    return true;
+}
+
+// Bulk load trees of various sizes, then check that they behave like
+// trees built by insertions, down to removing every key again
+void test_bulk_load(bt_alloc_ptr alloc, int max_len, float fill, int flags){
+    for(int len = 0; len <= max_len; len += 1+len/8){
+        uint32_t state[2] = {len, 0};
+        btree tree = btree_bulk_load(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                        compare_uint32, 0, flags, fill, bulk_next, state);
+        order_helper order = {tree, 0};
+        btree_traverse(tree, order_callback, &order, false);
+        btree_traverse(tree, value_callback, &tree, false);
+        if(order.last_key != 2*len){
+            printf("TEST FAILED:\nBulk loaded tree of %d keys ends at %x\n",
+                    len, order.last_key);
+            exit(1);
+        }
+        // Odd keys go in between the loaded ones
+        for(uint32_t key = 1; key < 2*len; key += 4)
+            btree_insert(tree, &key, &key);
+        for(uint32_t key = 1; key <= 2*len; key++){
+            bool present = key%2==0 || key%4==1;
+            if(btree_remove(tree, &key, NULL) != present){
+                printf("TEST FAILED:\nBulk loaded tree of %d keys %s %x\n",
+                        len, present ? "lost" : "contains", key);
+                btree_debug_print(stdout, tree, NULL, NULL);
+                exit(1);
+            }
+        }
+        if(!btree_is_empty(tree)){
+            printf("TEST FAILED:\nBulk loaded tree of %d keys not empty\n", len);
+            exit(1);
+        }
+        btree_delete(tree);
+    }
+}
+
+// Insert random batches (with duplicates) and compare against single insertions
+void test_insert_batch(bt_alloc_ptr alloc, int batches, int batch_len, int flags){
+    btree tree = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                    compare_uint32, 0, flags);
+    btree reference = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                    compare_uint32, 0, 0);
+    uint32_t *keys = calloc(sizeof(uint32_t), batch_len);
+    for(int b = 0; b < batches; b++){
+        int len = rand()%batch_len + 1;
+        size_t expected = 0;
+        for(int i = 0; i < len; i++){
+            keys[i] = rand()%(batches*batch_len/2) + 1;
+            expected += btree_insert(reference, keys+i, keys+i);
+        }
+        size_t present = btree_insert_batch(tree, keys, keys, len);
+        if(present != expected){
+            printf("TEST FAILED:\nBatch reported %zu present keys instead of %zu\n",
+                    present, expected);
+            exit(1);
+        }
+    }
+    order_helper order = {tree, 0};
+    btree_traverse(tree, order_callback, &order, false);
+    btree_traverse(tree, value_callback, &tree, false);
+    for(uint32_t key = 1; key <= batches*batch_len/2; key++)
+        if(btree_contains(tree, &key) != btree_contains(reference, &key)){
+            printf("TEST FAILED:\nBatch inserted tree differs at %x\n", key);
+            exit(1);
+        }
+    btree_delete(tree);
+    btree_delete(reference);
+    free(keys);
+}
+
+// Compare btree_get_many() against btree_get() for present and absent keys
+void test_get_many(bt_alloc_ptr alloc, int len, int lookups, int flags){
+    btree tree = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                    compare_uint32, 0, flags);
+    for(int i = 0; i < len; i++){
+        uint32_t key = rand()%(2*len) + 1;
+        btree_insert(tree, &key, &key);
+    }
+    uint32_t *keys = calloc(sizeof(uint32_t), lookups);
+    uint32_t *values = calloc(sizeof(uint32_t), lookups);
+    bool *found = calloc(sizeof(bool), lookups);
+    for(int i = 0; i < lookups; i++)
+        keys[i] = rand()%(2*len) + 1;
+    size_t found_count = btree_get_many(tree, keys, lookups, values, found);
+    size_t expected = 0;
+    for(int i = 0; i < lookups; i++){
+        uint32_t value;
+        bool present = btree_get(tree, keys+i, &value);
+        expected += present;
+        if(found[i] != present || (present && values[i] != value)){
+            printf("TEST FAILED:\nbtree_get_many() disagrees on key %x\n", keys[i]);
+            exit(1);
+        }
+    }
+    if(found_count != expected){
+        printf("TEST FAILED:\nbtree_get_many() found %zu instead of %zu keys\n",
+                found_count, expected);
+        exit(1);
+    }
+    btree_delete(tree);
+    free(keys);
+    free(values);
+    free(found);
+}
+
+struct collect_helper {
+    uint32_t *keys;
+    int count;
+};
+
+bool collect_callback(const void *key, void *value, void *params){
+    struct collect_helper *data = params;
+    data->keys[data->count++] = *(uint32_t*)key;
+    return false;
+}
+
+// Walk a random tree with cursors and range traversals,
+// comparing against the sorted keys from a full traversal
+void test_cursor(bt_alloc_ptr alloc, int len, int seeks, int flags){
+    btree tree = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                    compare_uint32, 0, flags);
+    for(int i = 0; i < len; i++){
+        uint32_t key = rand()%(3*len) + 1;
+        btree_insert(tree, &key, &key);
+    }
+    struct collect_helper sorted = {calloc(sizeof(uint32_t), len), 0};
+    btree_traverse(tree, collect_callback, &sorted, false);
+
+    bt_cursor *cursor = btree_cursor_open(tree);
+    const void *key;
+    int count = 0;
+    for(bool valid = btree_cursor_first(cursor); valid; valid = btree_cursor_next(cursor)){
+        btree_cursor_get(cursor, &key, NULL);
+        if(count >= sorted.count || *(uint32_t*)key != sorted.keys[count]){
+            printf("TEST FAILED:\nCursor returned %x as key %d\n", *(uint32_t*)key, count);
+            exit(1);
+        }
+        count++;
+    }
+    for(bool valid = btree_cursor_last(cursor); valid; valid = btree_cursor_prev(cursor)){
+        btree_cursor_get(cursor, &key, NULL);
+        if(*(uint32_t*)key != sorted.keys[--count]){
+            printf("TEST FAILED:\nReverse cursor returned %x as key %d\n",
+                    *(uint32_t*)key, count);
+            exit(1);
+        }
+    }
+    if(count){
+        printf("TEST FAILED:\nCursor missed %d keys\n", count);
+        exit(1);
+    }
+
+    for(int s = 0; s < seeks; s++){
+        uint32_t from = rand()%(3*len+2), to = from + rand()%(len/4+1);
+        // Index of the first key >= from and of the first >= to
+        int position = 0, end = 0;
+        while(position < sorted.count && sorted.keys[position] < from)
+            position++;
+        while(end < sorted.count && sorted.keys[end] < to)
+            end++;
+        bool valid = btree_cursor_seek(cursor, &from);
+        if(valid != (position < sorted.count)){
+            printf("TEST FAILED:\nSeeking %x returned %d\n", from, valid);
+            exit(1);
+        }
+        // Random walk from there
+        for(int step = 0; valid && step < 20; step++){
+            btree_cursor_get(cursor, &key, NULL);
+            if(*(uint32_t*)key != sorted.keys[position]){
+                printf("TEST FAILED:\nCursor at %x instead of %x\n",
+                        *(uint32_t*)key, sorted.keys[position]);
+                exit(1);
+            }
+            if(rand()%2){
+                valid = btree_cursor_next(cursor);
+                position++;
+            } else {
+                valid = btree_cursor_prev(cursor);
+                position--;
+            }
+            if(valid != (position >= 0 && position < sorted.count)){
+                printf("TEST FAILED:\nCursor ended early at %d\n", position);
+                exit(1);
+            }
+        }
+
+        for(int reverse = 0; reverse < 2; reverse++){
+            struct collect_helper range = {calloc(sizeof(uint32_t), len), 0};
+            btree_traverse_range(tree, &from, &to, collect_callback, &range, reverse);
+            int first = 0;
+            while(first < sorted.count && sorted.keys[first] < from)
+                first++;
+            bool correct = range.count == end-first;
+            for(int i = 0; correct && i < range.count; i++)
+                correct = range.keys[i] == sorted.keys[reverse ? end-1-i : first+i];
+            if(!correct){
+                printf("TEST FAILED:\nRange [%x, %x) returned %d keys instead of %d\n",
+                        from, to, range.count, end-first);
+                exit(1);
+            }
+            free(range.keys);
+        }
+    }
+    btree_cursor_close(cursor);
+    btree_delete(tree);
+    free(sorted.keys);
+}
+
+// Forwards to a RAM allocator with compact ids, noting the nodes scans
+// announce and how many loads they didn't announce before
+#define PREFETCH_MAX_IDS (1<<20)
+struct prefetch_alloc {
+    struct bt_alloc base;
+    bt_alloc_ptr ram;
+    bool *announced;
+    uint64_t loads, unannounced;
+};
+
+bt_node_id prefetch_new(void *this){
+    bt_alloc_ptr ram = ((struct prefetch_alloc*)this)->ram;
+    bt_node_id node = ram->new(ram);
+    if(node >= PREFETCH_MAX_IDS){
+        printf("TEST FAILED:\nNode id %lx too large\n", node);
+        exit(1);
+    }
+    return node;
+}
+
+void *prefetch_load(btree tree, bt_node_id node){
+    struct prefetch_alloc *alloc = (struct prefetch_alloc*)tree.alloc;
+    alloc->loads++;
+    alloc->unannounced += !alloc->announced[node];
+    alloc->announced[node] = false;
+    return alloc->ram->load((btree){alloc->ram, tree.root, tree.compare}, node);
+}
+
+void prefetch_unload(btree tree, void *node){
+    struct prefetch_alloc *alloc = (struct prefetch_alloc*)tree.alloc;
+    alloc->ram->unload((btree){alloc->ram, tree.root, tree.compare}, node);
+}
+
+void prefetch_free(void *this, bt_node_id node){
+    bt_alloc_ptr ram = ((struct prefetch_alloc*)this)->ram;
+    ram->free(ram, node);
+}
+
+void prefetch_record(btree tree, const bt_node_id *nodes, int count){
+    struct prefetch_alloc *alloc = (struct prefetch_alloc*)tree.alloc;
+    for(int i = 0; i < count; i++)
+        alloc->announced[nodes[i]] = true;
+}
+
+// Scans have to announce the nodes before loading them, besides the tree
+// and those a seek passes, and full ones every node they announce
+void test_prefetch(int len, int flags){
+    struct prefetch_alloc alloc = {
+        .ram = btree_new_ram_alloc(256, &(struct bt_ram_options){.compact_ids = true}, NULL),
+        .announced = calloc(PREFETCH_MAX_IDS, sizeof(bool))
+    };
+    alloc.base = (struct bt_alloc){prefetch_new, prefetch_load, prefetch_unload,
+                                   prefetch_free, 256};
+    alloc.base.id_size = alloc.ram->id_size;
+    alloc.base.prefetch = prefetch_record;
+    btree tree = btree_create(&alloc.base, sizeof(uint32_t), sizeof(uint32_t),
+                    compare_uint32, 0, flags);
+    for(uint32_t i = 0; i < len; i++)
+        btree_insert(tree, &(uint32_t){i*2654435761u}, &(uint32_t){i*2654435761u});
+    struct bt_stats stats;
+    btree_stats(tree, &stats);
+
+    uint32_t *keys = malloc(len*sizeof(uint32_t));
+    uint32_t middle = 1u<<31;
+    for(int scan = 0; scan < 6; scan++){
+        alloc.loads = alloc.unannounced = 0;
+        struct collect_helper collected = {keys};
+        bool reverse = scan%2, full = scan < 4;
+        if(scan < 2)
+            btree_traverse(tree, collect_callback, &collected, reverse);
+        else
+            btree_traverse_range(tree, full ? NULL : &middle, NULL, collect_callback,
+                                 &collected, reverse);
+        bool wasted = false;
+        for(int i = 0; i < PREFETCH_MAX_IDS && full; i++)
+            wasted |= alloc.announced[i];
+        memset(alloc.announced, 0, PREFETCH_MAX_IDS*sizeof(bool));
+        if(alloc.unannounced > 1 + (full ? 0 : stats.height) || wasted
+                || alloc.loads < stats.total_nodes/2){
+            printf("TEST FAILED:\nScan %d loaded %lu nodes, %lu without announcing "
+                   "them%s\n", scan, alloc.loads, alloc.unannounced,
+                   wasted ? ", announced nodes it didn't load" : "");
+            exit(1);
+        }
+    }
+    free(keys);
+    btree_delete(tree);
+    btree_free_ram_alloc(alloc.ram);
+    free(alloc.announced);
+}
+
+// Randomly insert into and remove from a B+ tree, comparing lookups, floors,
+// ceilings and traversals against a regular tree (ceilings against a cursor too)
+void test_bplus(bt_alloc_ptr alloc, int rounds, int len){
+    btree tree = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                    compare_uint32, 0, BT_BPLUS);
+    btree reference = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                    compare_uint32, 0, 0);
+    for(int r = 0; r < rounds; r++){
+        // Alternate between growing and shrinking the trees
+        float del_chance = r%2 ? 0.8 : 0.2;
+        for(int i = 0; i < len; i++){
+            uint32_t key = rand()%(2*len) + 1;
+            bool delete = ((float)rand())/(float)RAND_MAX < del_chance;
+            bool present = delete ? btree_remove(tree, &key, NULL)
+                                  : btree_insert(tree, &key, &key);
+            bool expected = delete ? btree_remove(reference, &key, NULL)
+                                   : btree_insert(reference, &key, &key);
+            if(present != expected){
+                printf("TEST FAILED:\nB+ tree %s %x\n",
+                        present ? "contained" : "lacked", key);
+                exit(1);
+            }
+        }
+        for(uint32_t key = 0; key <= 2*len+1; key++){
+            uint32_t floor, expected_floor;
+            bool found = btree_get_floor(tree, &key, &floor, NULL);
+            bool expected = btree_get_floor(reference, &key, &expected_floor, NULL);
+            if(found != expected || (found && floor != expected_floor)){
+                printf("TEST FAILED:\nB+ tree floor of %x is %x\n", key, floor);
+                exit(1);
+            }
+        }
+        bt_cursor *cursor = btree_cursor_open(reference);
+        for(uint32_t key = 0; key <= 2*len+1; key++){
+            uint32_t ceil, expected_ceil;
+            const void *cursor_key;
+            bool sought = btree_cursor_seek(cursor, &key)
+                          && btree_cursor_get(cursor, &cursor_key, NULL);
+            for(int t = 0; t < 2; t++){
+                bool found = btree_get_ceil(t ? reference : tree, &key, &ceil, NULL);
+                if(sought)
+                    memcpy(&expected_ceil, cursor_key, sizeof(uint32_t));
+                if(found != sought || (found && ceil != expected_ceil)){
+                    printf("TEST FAILED:\n%s ceiling of %x is %x\n",
+                            t ? "B-tree" : "B+ tree", key, ceil);
+                    exit(1);
+                }
+            }
+        }
+        btree_cursor_close(cursor);
+        for(int reverse = 0; reverse < 2; reverse++){
+            struct collect_helper keys = {calloc(sizeof(uint32_t), 2*len), 0};
+            struct collect_helper expected = {calloc(sizeof(uint32_t), 2*len), 0};
+            btree_traverse(tree, collect_callback, &keys, reverse);
+            btree_traverse(reference, collect_callback, &expected, reverse);
+            if(keys.count != expected.count
+                    || memcmp(keys.keys, expected.keys, keys.count*sizeof(uint32_t))){
+                printf("TEST FAILED:\nB+ tree traversal returned %d keys instead of %d\n",
+                        keys.count, expected.count);
+                exit(1);
+            }
+            free(keys.keys);
+            free(expected.keys);
+        }
+        btree_traverse(tree, value_callback, &tree, false);
+    }
+    btree_delete(tree);
+    btree_delete(reference);
+}
+
+typedef struct {
+    bt_key_comp compare;
+    uint8_t key_size;
+    uint8_t last_key[8];
+    int count;
+} key_order_helper;
+
+bool key_order_callback(const void *key, void *value, void *params){
+    key_order_helper *order = params;
+    if(order->count++ && order->compare(order->last_key, key, order->key_size) >= 0){
+        printf("TEST FAILED:\nKeys of size %d out of order\n", order->key_size);
+        exit(1);
+    }
+    memcpy(order->last_key, key, order->key_size);
+    return false;
+}
+
+// Store x as key of the given size, so that memcmp() orders like the numbers
+void encode_key(uint8_t *key, uint32_t x, bt_key_comp compare, int key_size){
+    uint64_t wide = x;
+    if(compare == btree_compare_u32)
+        memcpy(key, &x, sizeof(x));
+    else if(compare == btree_compare_u64)
+        memcpy(key, &wide, sizeof(wide));
+    else
+        for(int i = key_size; i --> 0; x >>= 8)
+            key[i] = x;
+}
+
+// Trees with built-in key types use their own searches,
+// check them against the keys that should be present
+void test_key_types(bt_alloc_ptr alloc, int len){
+    struct {
+        bt_key_comp compare;
+        uint8_t key_size;
+    } types[] = {
+        {btree_compare_u32, 4}, {btree_compare_u64, 8},
+        {memcmp, 4}, {memcmp, 8}, {memcmp, 3}
+    };
+    bool *present = calloc(sizeof(bool), 2*len+1);
+    for(int t = 0; t < sizeof(types)/sizeof(types[0]); t++){
+        for(int flags = 0; flags <= BT_BPLUS; flags += BT_BPLUS){
+            bt_key_comp compare = types[t].compare;
+            uint8_t key_size = types[t].key_size;
+            btree tree = btree_create(alloc, key_size, sizeof(uint32_t),
+                            compare, 0, flags);
+            memset(present, 0, (2*len+1)*sizeof(bool));
+            uint8_t key[8];
+            for(int i = 0; i < 2*len; i++){
+                uint32_t x = rand()%(2*len) + 1;
+                encode_key(key, x, compare, key_size);
+                if(i%3 == 2){
+                    btree_remove(tree, key, NULL);
+                    present[x] = false;
+                } else {
+                    btree_insert(tree, key, &x);
+                    present[x] = true;
+                }
+            }
+            for(uint32_t x = 0; x <= 2*len; x++){
+                uint32_t value;
+                encode_key(key, x, compare, key_size);
+                bool found = btree_get(tree, key, &value);
+                if(found != present[x] || (found && value != x)){
+                    printf("TEST FAILED:\nTree with keys of size %d %s %x\n",
+                            key_size, found ? "contains" : "lacks", x);
+                    exit(1);
+                }
+            }
+            key_order_helper order = {compare, key_size};
+            btree_traverse(tree, key_order_callback, &order, false);
+            btree_delete(tree);
+        }
+    }
+    free(present);
+}
+
+// Checks the tree's shape and that the counters of the allocator add up
+void test_stats(bt_alloc_ptr alloc, int len, int flags){
+    struct event_counts counts = {{0}};
+    struct bt_alloc_stats counters = {
+        .record_latency = true,
+        .event_callback = count_event,
+        .event_param = &counts
+    };
+    btree_alloc_stats(alloc, &counters);
+    btree tree = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                    compare_uint32, 0, flags);
+    uint64_t pairs = 0;
+    for(int i = 0; i < len; i++){
+        uint32_t key = rand()%(2*len) + 1;
+        pairs += !btree_insert(tree, &key, &key);
+    }
+    struct bt_stats stats;
+    btree_stats(tree, &stats);
+    uint64_t level_sum = 0;
+    for(int i = 0; i <= stats.height; i++)
+        level_sum += stats.nodes[i];
+    if(stats.pairs != pairs || stats.nodes[0] != 1 || level_sum != stats.total_nodes
+            || stats.nodes[stats.height] <= stats.nodes[0]){
+        printf("TEST FAILED:\nbtree_stats() counted %lu pairs in %lu nodes "
+               "(%lu over the levels) instead of %lu pairs\n",
+               stats.pairs, stats.total_nodes, level_sum, pairs);
+        exit(1);
+    }
+    if(stats.min_fill <= 0 || stats.min_fill > stats.avg_fill || stats.avg_fill > 1
+            || stats.bytes_used+stats.bytes_wasted != stats.total_nodes*alloc->node_size
+            || stats.bytes_used > stats.total_nodes*alloc->node_size){
+        printf("TEST FAILED:\nbtree_stats() reported fill %f/%f, %lu bytes used "
+               "and %lu wasted\n", stats.min_fill, stats.avg_fill,
+               stats.bytes_used, stats.bytes_wasted);
+        exit(1);
+    }
+    if(counters.news-counters.frees != stats.total_nodes
+            || counters.loads != counters.unloads
+            || !counters.splits || !counters.compares
+            || counts.events[BT_EVENT_SPLIT] != counters.splits
+            || histogram_sum(counters.latency[BT_OP_INSERT]) != len){
+        printf("TEST FAILED:\nAllocator counted %lu new and %lu freed nodes, "
+               "%lu loads, %lu unloads, %lu splits\n", counters.news,
+               counters.frees, counters.loads, counters.unloads, counters.splits);
+        exit(1);
+    }
+    for(int i = 0; i < 2*len; i++){
+        uint32_t key = i+1;
+        btree_remove(tree, &key, NULL);
+    }
+    btree_stats(tree, &stats);
+    if(stats.height != -1 || stats.pairs || !counters.merges || !counters.borrows
+            || counts.events[BT_EVENT_MERGE] != counters.merges
+            || histogram_sum(counters.latency[BT_OP_REMOVE]) != 2*len){
+        printf("TEST FAILED:\nEmptied tree has height %d and %lu pairs, "
+               "%lu merges and %lu borrows were counted\n", stats.height,
+               stats.pairs, counters.merges, counters.borrows);
+        exit(1);
+    }
+    btree_delete(tree);
+    if(counters.news != counters.frees){
+        printf("TEST FAILED:\n%lu nodes were allocated but %lu freed\n",
+               counters.news, counters.frees);
+        exit(1);
+    }
+    btree_alloc_stats(alloc, NULL);
+}
+
+// Fills a tree sharing full leaves with their neighbours and one splitting
+// them in halves with the same keys, compares their contents and leaf counts
+void test_leaf_sharing(bt_alloc_ptr alloc, int len, int flags){
+    for(int random = 0; random < 2; random++){
+        btree shared = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                        compare_uint32, 0, flags);
+        btree halves = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                        compare_uint32, 0, flags|BT_SPLIT_HALVES);
+        for(uint32_t i = 0; i < len; i++){
+            // Multiplying by an odd number permutes the keys
+            uint32_t key = random ? i*2654435761u : i;
+            btree_insert(shared, &key, &key);
+            btree_insert(halves, &key, &key);
+        }
+        struct collect_helper keys = {calloc(sizeof(uint32_t), len), 0};
+        struct collect_helper expected = {calloc(sizeof(uint32_t), len), 0};
+        btree_traverse(shared, collect_callback, &keys, false);
+        btree_traverse(halves, collect_callback, &expected, false);
+        if(keys.count != len || expected.count != len
+                || memcmp(keys.keys, expected.keys, len*sizeof(uint32_t))){
+            printf("TEST FAILED:\nTree sharing leaves holds %d keys instead of %d\n",
+                    keys.count, len);
+            exit(1);
+        }
+        free(keys.keys);
+        free(expected.keys);
+        btree_traverse(shared, value_callback, &shared, false);
+
+        struct bt_stats shared_stats, halves_stats;
+        btree_stats(shared, &shared_stats);
+        btree_stats(halves, &halves_stats);
+        uint64_t shared_leaves = shared_stats.nodes[shared_stats.height];
+        uint64_t halves_leaves = halves_stats.nodes[halves_stats.height];
+        // Leaves end up at least two thirds instead of half full
+        if(shared_leaves*6 > halves_leaves*5){
+            printf("TEST FAILED:\nSharing %s keys took %lu leaves, "
+                   "splitting in halves %lu\n", random ? "random" : "sequential",
+                   shared_leaves, halves_leaves);
+            exit(1);
+        }
+        for(uint32_t i = 0; i < len; i++){
+            uint32_t key = random ? i*2654435761u : i;
+            if(!btree_remove(shared, &key, NULL)){
+                printf("TEST FAILED:\nTree sharing leaves lacked %x\n", key);
+                exit(1);
+            }
+        }
+        btree_delete(shared);
+        btree_delete(halves);
+    }
+}
+
+struct snapshot_scan {
+    bool (*expected)(uint32_t key, uint32_t *value);
+    uint32_t range;
+    // Keys below next have been checked
+    uint32_t next;
+    bool wrong;
+};
+
+bool snapshot_callback(const void *key, void *value, void *params){
+    struct snapshot_scan *scan = params;
+    uint32_t k = *(uint32_t*)key, expected;
+    for(; scan->next < k && scan->next < scan->range; scan->next++)
+        scan->wrong |= scan->expected(scan->next, &expected);
+    scan->wrong |= k < scan->next || !scan->expected(k, &expected)
+                   || *(uint32_t*)value != expected;
+    scan->next = k+1;
+    return false;
+}
+
+// Whether the tree contains exactly the expected pairs with keys below range
+bool check_version(btree tree, uint32_t range, bool (*expected)(uint32_t, uint32_t*)){
+    struct snapshot_scan scan = {expected, range};
+    btree_traverse(tree, snapshot_callback, &scan, false);
+    uint32_t value;
+    for(; scan.next < range; scan.next++)
+        scan.wrong |= expected(scan.next, &value);
+    return !scan.wrong;
+}
+
+static uint32_t version_len;
+
+bool first_version(uint32_t key, uint32_t *value){
+    *value = key;
+    return key < version_len;
+}
+
+// After removing even keys, inserting every third one with another value
+// and appending as many
+bool second_version(uint32_t key, uint32_t *value){
+    *value = key < version_len && !(key%3) ? key+1 : key;
+    return key < 2*version_len && (key >= version_len || key%2 || !(key%3));
+}
+
+struct snapshot_reader {
+    btree snapshot;
+    volatile bool done;
+    int scans;
+    bool failed;
+};
+
+// Scans the snapshot while the tree is changed
+void *snapshot_reader(void *param){
+    struct snapshot_reader *r = param;
+    while(!r->done && !r->failed){
+        r->failed = !check_version(r->snapshot, 2*version_len, first_version);
+        r->scans++;
+    }
+    return NULL;
+}
+
+// Snapshots keep their contents while the tree changes, and once all are
+// released every node is freed exactly once
+void test_snapshots(int len){
+    bt_alloc_ptr alloc = btree_new_ram_alloc(128, NULL, NULL);
+    struct bt_alloc_stats stats = {0};
+    btree_alloc_stats(alloc, &stats);
+    version_len = len;
+    btree tree = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                    btree_compare_u32, 0, 0);
+    for(uint32_t i = 0; i < len; i++)
+        btree_insert(tree, &i, &i);
+    btree first = btree_snapshot(tree);
+    struct snapshot_reader reader = {first};
+    pthread_t handle;
+    pthread_create(&handle, NULL, snapshot_reader, &reader);
+    for(uint32_t i = 0; i < len; i += 2)
+        btree_remove(tree, &i, NULL);
+    for(uint32_t i = 0; i < len; i += 3){
+        uint32_t value = i+1;
+        btree_insert(tree, &i, &value);
+    }
+    for(uint32_t i = len; i < 2*len; i++)
+        btree_insert(tree, &i, &i);
+    btree second = btree_snapshot(tree);
+    for(uint32_t i = 0; i < 2*len; i++)
+        btree_remove(tree, &i, NULL);
+    reader.done = true;
+    pthread_join(handle, NULL);
+
+    if(reader.failed || !check_version(first, 2*len, first_version)
+            || !check_version(second, 2*len, second_version) || !btree_is_empty(tree)){
+        printf("TEST FAILED:\nSnapshot changed along with the tree (after %d scans)\n",
+               reader.scans);
+        exit(1);
+    }
+    btree_release_snapshot(first);
+    if(!check_version(second, 2*len, second_version)){
+        printf("TEST FAILED:\nReleasing a snapshot changed another one\n");
+        exit(1);
+    }
+    btree_release_snapshot(second);
+    btree_delete(tree);
+    if(stats.news != stats.frees){
+        printf("TEST FAILED:\n%lu nodes were allocated for snapshots, but %lu freed\n",
+               stats.news, stats.frees);
+        exit(1);
+    }
+    btree_free_ram_alloc(alloc);
+}
+
+// Trees of a RAM allocator with compact ids store children in 4 bytes,
+// so their interior nodes have more children than with the same node size
+// and 8 byte ids
+void test_compact_ids(int len){
+    struct bt_ram_options options = {
+        .huge_pages = true,
+        .compact_ids = true,
+        .max_size = 1<<24
+    };
+    bt_alloc_ptr allocs[2] = {
+        btree_new_ram_alloc(128, &options, NULL),
+        btree_new_ram_alloc(128, NULL, NULL)
+    };
+    struct bt_stats stats[2];
+    for(int a = 0; a < 2; a++){
+        btree tree = btree_create(allocs[a], sizeof(uint32_t), sizeof(uint32_t),
+                        btree_compare_u32, 0, BT_BPLUS);
+        for(uint32_t key = 1; key <= len; key++)
+            btree_insert(tree, &key, &key);
+        for(uint32_t key = 1; key <= len; key++){
+            uint32_t value;
+            if(!btree_get(tree, &key, &value) || value != key){
+                printf("TEST FAILED:\nKey %u not found with%s compact ids\n",
+                       key, a ? "out" : "");
+                exit(1);
+            }
+        }
+        btree_stats(tree, &stats[a]);
+        btree_delete(tree);
+    }
+    uint64_t interior[2];
+    for(int a = 0; a < 2; a++)
+        interior[a] = stats[a].total_nodes - stats[a].nodes[stats[a].height];
+    if(stats[0].pairs != len || interior[0] >= interior[1]){
+        printf("TEST FAILED:\n%lu pairs with compact ids, %lu interior nodes "
+               "instead of less than %lu\n", stats[0].pairs, interior[0], interior[1]);
+        exit(1);
+    }
+    test_cursor(allocs[0], 3000, 300, 0);
+    test_cursor(allocs[0], 3000, 300, BT_BPLUS);
+    test_stats(allocs[0], 3000, 0);
+    btree_free_ram_alloc(allocs[0]);
+    btree_free_ram_alloc(allocs[1]);
+}
+
+// Allocator handing out the ids of a compact RAM allocator plus 2^40,
+// so that trees have to store all 6 bytes of their BT_IDS48 children
+#define HIGH_ID_OFFSET ((bt_node_id)1<<40)
+struct high_id_alloc {
+    struct bt_alloc base;
+    bt_alloc_ptr ram;
+};
+
+static bt_node_id high_id_new(void *this){
+    bt_alloc_ptr ram = ((struct high_id_alloc*)this)->ram;
+    return ram->new(ram) + HIGH_ID_OFFSET;
+}
+
+static void *high_id_load(btree tree, bt_node_id node){
+    tree.alloc = ((struct high_id_alloc*)tree.alloc)->ram;
+    return tree.alloc->load(tree, node - HIGH_ID_OFFSET);
+}
+
+static void high_id_unload(btree tree, void *node){}
+
+static void high_id_free(void *this, bt_node_id node){
+    bt_alloc_ptr ram = ((struct high_id_alloc*)this)->ram;
+    ram->free(ram, node - HIGH_ID_OFFSET);
+}
+
+void test_high_ids(void){
+    struct high_id_alloc alloc = {
+        {high_id_new, high_id_load, high_id_unload, high_id_free, 128},
+        btree_new_ram_alloc(128, &(struct bt_ram_options){.compact_ids = true}, NULL)
+    };
+    alloc.base.id_size = 6;
+    test_cursor(&alloc.base, 3000, 300, 0);
+    test_stats(&alloc.base, 3000, BT_BPLUS);
+    test_bplus(&alloc.base, 5, 2000);
+    btree_free_ram_alloc(alloc.ram);
+}
+
+struct concurrent_worker {
+    btree tree;
+    int thread;
+    int threads;
+    int range;
+    int ops;
+    // Whether each key of this thread is in the tree
+    bool *present;
+    const char *failure;
+};
+
+// Each thread inserts, removes and looks up its own keys (those with
+// key%threads == thread) and looks up any key, checking the results
+void *concurrent_worker(void *param){
+    struct concurrent_worker *w = param;
+    unsigned seed = w->thread+1;
+    for(int i = 0; i < w->ops && !w->failure; i++){
+        int r = rand_r(&seed);
+        int index = r % w->range;
+        uint32_t key = index*w->threads + w->thread, value = 0;
+        switch(r/w->range % 4){
+        case 0:
+            if(btree_insert(w->tree, &key, &key) != w->present[index])
+                w->failure = "btree_insert() disagrees on whether a key was present";
+            w->present[index] = true;
+            break;
+        case 1:
+            if(btree_remove(w->tree, &key, &value) != w->present[index]
+                    || (w->present[index] && value != key))
+                w->failure = "btree_remove() disagrees on a key";
+            w->present[index] = false;
+            break;
+        case 2:
+            if(btree_get(w->tree, &key, &value) != w->present[index]
+                    || (w->present[index] && value != key))
+                w->failure = "btree_get() disagrees on a key";
+            break;
+        case 3:
+            key = rand_r(&seed) % (w->range*w->threads);
+            if(btree_get(w->tree, &key, &value) && value != key)
+                w->failure = "btree_get() returned the value of another key";
+        }
+    }
+    return NULL;
+}
+
+struct concurrent_scanner {
+    btree tree;
+    volatile bool done;
+    int scans;
+    const char *failure;
+};
+
+bool scan_callback(const void *key, void *value, void *params){
+    uint32_t *last = params;
+    if(*(uint32_t*)key != *(uint32_t*)value || (last[1] && *(uint32_t*)key <= last[0]))
+        last[2] = true;
+    last[0] = *(uint32_t*)key;
+    last[1] = true;
+    return false;
+}
+
+// Traverses the tree while the workers modify it
+void *concurrent_scanner(void *param){
+    struct concurrent_scanner *s = param;
+    while(!s->done && !s->failure){
+        uint32_t last[3] = {0};
+        btree_traverse(s->tree, scan_callback, last, false);
+        if(last[2])
+            s->failure = "traversal returned keys out of order";
+        s->scans++;
+        sched_yield();
+    }
+    return NULL;
+}
+
+// Many threads using one tree at once, the allocator
+// is shared with another thread building a second tree
+void test_concurrent(bt_alloc_ptr alloc, int threads, int range, int ops){
+    btree tree = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                    btree_compare_u32, 0, BT_CONCURRENT);
+    pthread_t handles[threads+1];
+    struct concurrent_worker workers[threads];
+    struct concurrent_scanner scanner = {tree};
+    for(int t = 0; t < threads; t++){
+        workers[t] = (struct concurrent_worker){tree, t, threads, range, ops,
+                                                calloc(range, sizeof(bool))};
+        pthread_create(handles+t, NULL, concurrent_worker, workers+t);
+    }
+    pthread_create(handles+threads, NULL, concurrent_scanner, &scanner);
+    btree other = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                    btree_compare_u32, 0, 0);
+    for(uint32_t i = 0; i < ops; i++)
+        btree_insert(other, &i, &i);
+    for(uint32_t i = 0; i < ops; i++)
+        if(i%3)
+            btree_remove(other, &i, NULL);
+    for(int t = 0; t < threads; t++)
+        pthread_join(handles[t], NULL);
+    scanner.done = true;
+    pthread_join(handles[threads], NULL);
+    for(uint32_t i = 0; i < ops; i++)
+        if(btree_contains(other, &i) != !(i%3)){
+            printf("TEST FAILED:\nTree sharing the allocator with a concurrent tree "
+                   "%s key %x\n", i%3 ? "still contains" : "lost", i);
+            exit(1);
+        }
+    btree_delete(other);
+    if(scanner.failure){
+        printf("TEST FAILED:\nConcurrent tree: %s\n", scanner.failure);
+        exit(1);
+    }
+
+    uint64_t pairs = 0;
+    for(int t = 0; t < threads; t++){
+        if(workers[t].failure){
+            printf("TEST FAILED:\nConcurrent tree, thread %d: %s\n", t, workers[t].failure);
+            exit(1);
+        }
+        for(int i = 0; i < range; i++){
+            uint32_t key = i*threads + t;
+            pairs += workers[t].present[i];
+            if(btree_contains(tree, &key) != workers[t].present[i]){
+                printf("TEST FAILED:\nConcurrent tree %s key %x\n",
+                       workers[t].present[i] ? "lost" : "still contains", key);
+                exit(1);
+            }
+        }
+        free(workers[t].present);
+    }
+    struct bt_stats stats;
+    btree_stats(tree, &stats);
+    if(stats.pairs != pairs){
+        printf("TEST FAILED:\nConcurrent tree contains %lu pairs instead of %lu\n",
+               stats.pairs, pairs);
+        exit(1);
+    }
+    btree_delete(tree);
+}
+
+// A thread modifying a concurrent tree it holds a cursor to exits with an
+// error instead of waiting for itself, other trees can still be modified
+void test_concurrent_cursor_insert(bt_alloc_ptr alloc){
+    btree tree = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                    btree_compare_u32, 0, BT_CONCURRENT);
+    btree other = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                    btree_compare_u32, 0, BT_CONCURRENT);
+    for(uint32_t i = 0; i < 100; i++)
+        btree_insert(tree, &i, &i);
+    fflush(stdout);
+    pid_t child = fork();
+    if(!child){
+        freopen("/dev/null", "w", stderr);
+        bt_cursor *cursor = btree_cursor_open(tree);
+        btree_cursor_first(cursor);
+        uint32_t key = 1000;
+        btree_insert(other, &key, &key);
+        btree_insert(tree, &key, &key);
+        _exit(0);
+    }
+    int status;
+    waitpid(child, &status, 0);
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 1){
+        printf("TEST FAILED:\nInserting into a concurrent tree while holding "
+               "a cursor to it didn't fail\n");
+        exit(1);
+    }
+    bt_cursor *cursor = btree_cursor_open(tree);
+    btree_cursor_first(cursor);
+    btree_cursor_close(cursor);
+    uint32_t key = 1000;
+    btree_insert(tree, &key, &key);
+    btree_delete(other);
+    btree_delete(tree);
+}
+
+// Concurrent trees in a file, through the node cache and the whole file mapping
+void test_concurrent_file(uint32_t cache_nodes, uint64_t map_size, bool buffered){
+    char path[] = "/tmp/btree_test_XXXXXX";
+    int file = mkstemp(path);
+    if(file==-1){
+        perror("Couldn't create file");
+        exit(1);
+    }
+    unlink(path);
+    struct bt_file_options options = {
+        .cache_nodes = cache_nodes,
+        .map_size = map_size,
+        .buffered = buffered
+    };
+    bt_alloc_ptr alloc = btree_new_file_alloc(file, NULL, 0, &options, NULL);
+    test_concurrent(alloc, 4, 5000, 20000);
+    btree_close_file_alloc(alloc);
+    close(file);
+}
+
+// Closing the allocator of a concurrent tree frees the nodes its removals
+// retired, so that retiring nodes of another tree doesn't free them later
+void test_concurrent_close(void){
+    char path[] = "/tmp/btree_test_XXXXXX";
+    int file = mkstemp(path);
+    if(file==-1){
+        perror("Couldn't create file");
+        exit(1);
+    }
+    unlink(path);
+    bt_alloc_ptr closed = btree_new_file_alloc(file, NULL, 0,
+            &(struct bt_file_options){.cache_nodes = 16}, NULL);
+    bt_alloc_ptr ram = btree_new_ram_alloc(128, NULL, NULL);
+    btree trees[] = {
+        btree_create(closed, sizeof(uint32_t), sizeof(uint32_t),
+                     btree_compare_u32, 0, BT_CONCURRENT),
+        btree_create(ram, sizeof(uint32_t), sizeof(uint32_t),
+                     btree_compare_u32, 0, BT_CONCURRENT)
+    };
+    for(int t = 0; t < 2; t++)
+        for(uint32_t i = 0; i < 5000; i++)
+            btree_insert(trees[t], &i, &i);
+    // Leaves nodes of the first tree retired
+    for(uint32_t i = 0; i < 5000; i += 2)
+        btree_remove(trees[0], &i, NULL);
+    btree_close_file_alloc(closed);
+    for(uint32_t i = 0; i < 5000; i++)
+        btree_remove(trees[1], &i, NULL);
+    btree_delete(trees[1]);
+    btree_free_ram_alloc(ram);
+
+    closed = btree_load_file_alloc(file, NULL, NULL, NULL);
+    trees[0].alloc = closed;
+    for(uint32_t i = 0; i < 5000; i++)
+        if(btree_contains(trees[0], &i) != i%2){
+            printf("TEST FAILED:\nConcurrent tree of a closed allocator %s key %x\n",
+                   i%2 ? "lost" : "still contains", i);
+            exit(1);
+        }
+    btree_close_file_alloc(closed);
+    close(file);
+}
+
+struct wal_worker {
+    btree tree;
+    bt_alloc_ptr alloc;
+    int thread, threads, len;
+};
+
+// Inserts the keys of this thread, committing every now and then
+void *wal_worker(void *param){
+    struct wal_worker *w = param;
+    for(uint32_t i = 0; i < w->len; i++){
+        uint32_t key = i*w->threads + w->thread;
+        btree_insert(w->tree, &key, &key);
+        if(i%200 == 199)
+            btree_file_alloc_commit(w->alloc);
+    }
+    btree_file_alloc_commit(w->alloc);
+    return NULL;
+}
+
+// Commit, keep changing the trees and crash. The log is all that survives:
+// the file is wiped, loading the allocator has to restore the last commit.
+// The log stays far below the size that would cause a checkpoint.
+void test_wal(int threads, int len, int flags){
+    char path[] = "/tmp/btree_test_XXXXXX", wal_path[] = "/tmp/btree_test_XXXXXX";
+    int file = mkstemp(path), wal = mkstemp(wal_path);
+    if(file==-1 || wal==-1){
+        perror("Couldn't create file");
+        exit(1);
+    }
+    unlink(path);
+    unlink(wal_path);
+
+    struct bt_file_options options = {.wal_fd = wal};
+    bt_node_id *root;
+    bt_alloc_ptr alloc = btree_new_file_alloc(file, (void**)&root, sizeof(bt_node_id),
+                                              &options, NULL);
+    btree tree = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                    btree_compare_u32, 0, flags);
+    *root = tree.root;
+    pthread_t handles[threads];
+    struct wal_worker workers[threads];
+    for(int t = 0; t < threads; t++){
+        workers[t] = (struct wal_worker){tree, alloc, t, threads, len};
+        pthread_create(handles+t, NULL, wal_worker, workers+t);
+    }
+    for(int t = 0; t < threads; t++)
+        pthread_join(handles[t], NULL);
+    for(uint32_t i = 0; i < threads*len; i += 3)
+        btree_remove(tree, &i, NULL);
+    btree_file_alloc_commit(alloc);
+    // Never committed
+    for(uint32_t i = 1; i < threads*len; i += 3)
+        btree_remove(tree, &i, NULL);
+    for(uint32_t i = threads*len; i < threads*len+1000; i++)
+        btree_insert(tree, &i, &i);
+
+    struct stat file_stat;
+    fstat(file, &file_stat);
+    void *zeros = calloc(1, file_stat.st_size);
+    pwrite(file, zeros, file_stat.st_size, 0);
+    free(zeros);
+
+    alloc = btree_load_file_alloc(file, (void**)&root, &options, NULL);
+    tree = (btree){alloc, *root, btree_compare_u32};
+    for(uint32_t i = 0; i < threads*len+1000; i++)
+        if(btree_contains(tree, &i) != (i < threads*len && i%3)){
+            printf("TEST FAILED:\nTree restored from log %s %x\n",
+                   i < threads*len && i%3 ? "lost" : "contains", i);
+            exit(1);
+        }
+    struct bt_stats stats;
+    btree_stats(tree, &stats);
+    if(stats.pairs != threads*len - (threads*len+2)/3){
+        printf("TEST FAILED:\nTree restored from log has %lu pairs instead of %u\n",
+               stats.pairs, threads*len - (threads*len+2)/3);
+        exit(1);
+    }
+    // Closing commits and empties the log
+    btree_insert(tree, &(uint32_t){0}, &(uint32_t){0});
+    btree_close_file_alloc(alloc);
+    fstat(wal, &file_stat);
+    alloc = btree_load_file_alloc(file, (void**)&root, &options, NULL);
+    tree = (btree){alloc, *root, btree_compare_u32};
+    if(!btree_contains(tree, &(uint32_t){0}) || file_stat.st_size > 4096){
+        printf("TEST FAILED:\nClosing the allocator didn't commit or left a log "
+               "of %lu bytes\n", file_stat.st_size);
+        exit(1);
+    }
+    btree_close_file_alloc(alloc);
+    close(file);
+    close(wal);
+}
+
+// Thin a tree out so that its nodes are scattered over a mostly free file,
+// compacting it has to shrink the file to about the tree and keep it intact
+void test_compact(int len, int flags, bool with_wal){
+    char path[] = "/tmp/btree_test_XXXXXX", wal_path[] = "/tmp/btree_test_XXXXXX";
+    int file = mkstemp(path), wal = mkstemp(wal_path);
+    if(file==-1 || wal==-1){
+        perror("Couldn't create file");
+        exit(1);
+    }
+    unlink(path);
+    unlink(wal_path);
+
+    struct bt_file_options options = {.wal_fd = with_wal ? wal : 0};
+    bt_node_id *root;
+    bt_alloc_ptr alloc = btree_new_file_alloc(file, (void**)&root, sizeof(bt_node_id),
+                                              &options, NULL);
+    btree tree = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                    btree_compare_u32, 0, flags);
+    *root = tree.root;
+    // Distinct keys in scattered order
+    for(uint32_t i = 0; i < len; i++)
+        btree_insert(tree, &(uint32_t){i*2654435761u}, &(uint32_t){i*2654435761u});
+    for(uint32_t i = 0; i < len; i++)
+        if(i%8)
+            btree_remove(tree, &(uint32_t){i*2654435761u}, NULL);
+    btree_file_alloc_commit(alloc);
+    struct stat before, after;
+    fstat(file, &before);
+    btree_compact(tree);
+    fstat(file, &after);
+
+    struct bt_stats stats;
+    btree_stats(tree, &stats);
+    // Besides the tree, the file holds its header and the free tree
+    if(after.st_size > (stats.total_nodes+8)*alloc->node_size
+            || after.st_size >= before.st_size/2){
+        printf("TEST FAILED:\nCompacting a tree of %lu nodes shrank the file "
+               "from %lu to %lu bytes\n", stats.total_nodes, before.st_size, after.st_size);
+        exit(1);
+    }
+    uint32_t *keys = malloc(len*sizeof(uint32_t));
+    for(int reverse = 0; reverse < 2; reverse++){
+        struct collect_helper collected = {keys};
+        btree_traverse(tree, collect_callback, &collected, reverse);
+        bool sorted = collected.count == (len+7)/8;
+        for(int i = 1; i < collected.count && sorted; i++)
+            sorted = reverse ? keys[i] < keys[i-1] : keys[i] > keys[i-1];
+        if(!sorted){
+            printf("TEST FAILED:\n%s traversal of the compacted tree visited "
+                   "%d pairs out of order or instead of %d\n",
+                   reverse ? "Reverse" : "Forward", collected.count, (len+7)/8);
+            exit(1);
+        }
+    }
+    btree_traverse(tree, value_callback, &tree, false);
+    free(keys);
+
+    // The file grows again, and everything survives reloading
+    for(uint32_t i = 0; i < len; i++)
+        if(i%8)
+            btree_insert(tree, &(uint32_t){i*2654435761u}, &(uint32_t){i*2654435761u});
+    btree_close_file_alloc(alloc);
+    alloc = btree_load_file_alloc(file, (void**)&root, &options, NULL);
+    tree = (btree){alloc, *root, btree_compare_u32};
+    for(uint32_t i = 0; i < len; i++)
+        if(!btree_contains(tree, &(uint32_t){i*2654435761u})){
+            printf("TEST FAILED:\nCompacted tree lost %x\n", i*2654435761u);
+            exit(1);
+        }
+    btree_traverse(tree, value_callback, &tree, false);
+    btree_close_file_alloc(alloc);
+    close(file);
+    close(wal);
+}
+
+// Nodes read into a pool of frames too small for the tree have to be written
+// back when evicted and on closing, in the format of mapped files:
+// the file is reopened mapped, then buffered with direct I/O
+void test_buffered(uint32_t frames, int len, int flags){
+    char path[] = "/tmp/btree_test_XXXXXX";
+    int file = mkstemp(path);
+    if(file==-1){
+        perror("Couldn't create file");
+        exit(1);
+    }
+    unlink(path);
+
+    struct bt_file_options buffered = {.cache_nodes = frames, .buffered = true};
+    bt_node_id *root;
+    bt_alloc_ptr alloc = btree_new_file_alloc(file, (void**)&root, sizeof(bt_node_id),
+                                              &buffered, NULL);
+    btree tree = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                    btree_compare_u32, 0, flags);
+    *root = tree.root;
+    for(uint32_t i = 0; i < len; i++)
+        btree_insert(tree, &(uint32_t){i*2654435761u}, &(uint32_t){i*2654435761u});
+    for(uint32_t i = 0; i < len; i += 2)
+        btree_remove(tree, &(uint32_t){i*2654435761u}, NULL);
+    uint64_t hits, misses;
+    btree_file_alloc_cache_stats(alloc, &hits, &misses);
+    struct bt_stats stats;
+    btree_stats(tree, &stats);
+    if(stats.total_nodes <= frames || !misses){
+        printf("TEST FAILED:\n%lu nodes were loaded with %lu misses from %u frames\n",
+               stats.total_nodes, misses, frames);
+        exit(1);
+    }
+    btree_close_file_alloc(alloc);
+
+    for(int reopen = 0; reopen < 2; reopen++){
+        struct bt_file_options direct = {.cache_nodes = frames, .buffered = true,
+                                         .direct_io = true};
+        alloc = btree_load_file_alloc(file, (void**)&root, reopen ? &direct : NULL, NULL);
+        tree = (btree){alloc, *root, btree_compare_u32};
+        for(uint32_t i = 0; i < len; i++)
+            if(btree_contains(tree, &(uint32_t){i*2654435761u}) != (i%2 || reopen)){
+                printf("TEST FAILED:\n%s file %s %x\n", reopen ? "Direct" : "Mapped",
+                       i%2 || reopen ? "lost" : "contains", i*2654435761u);
+                exit(1);
+            }
+        btree_traverse(tree, value_callback, &tree, false);
+        for(uint32_t i = 0; i < len; i += 2)
+            btree_insert(tree, &(uint32_t){i*2654435761u}, &(uint32_t){i*2654435761u});
+        btree_close_file_alloc(alloc);
+    }
+    if(fcntl(file, F_GETFL) & O_DIRECT){
+        printf("TEST FAILED:\nO_DIRECT wasn't cleared when closing\n");
+        exit(1);
+    }
+    close(file);
+}
+
+struct flushing_bulk {
+    uint32_t state[2];
+    bt_alloc_ptr alloc;
+};
+
+// Like bulk_next(), but writes back the changed nodes before each pair
+bool flushing_bulk_next(void *key, void *value, void *param){
+    struct flushing_bulk *bulk = param;
+    btree_file_alloc_flush(bulk->alloc, true);
+    return bulk_next(key, value, bulk->state);
+}
+
+// Bulk load trees of various sizes, writing back the nodes while they are
+// filled, so that the fixes at the end have to mark them as changed again.
+// Check them after reopening.
+void test_buffered_bulk_load(uint32_t frames, int max_len, int flags){
+    char path[] = "/tmp/btree_test_XXXXXX";
+    int file = mkstemp(path);
+    if(file==-1){
+        perror("Couldn't create file");
+        exit(1);
+    }
+    unlink(path);
+
+    struct bt_file_options buffered = {.cache_nodes = frames, .buffered = true,
+                                       .max_dirty = 4096};
+    for(int len = 0; len <= max_len; len += 1+len/8){
+        bt_node_id *root;
+        bt_alloc_ptr alloc = btree_new_file_alloc(file, (void**)&root, sizeof(bt_node_id),
+                                                  &buffered, NULL);
+        struct flushing_bulk bulk = {{len, 0}, alloc};
+        btree tree = btree_bulk_load(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                        btree_compare_u32, 0, flags, 1, flushing_bulk_next, &bulk);
+        *root = tree.root;
+        btree_close_file_alloc(alloc);
+
+        alloc = btree_load_file_alloc(file, (void**)&root, NULL, NULL);
+        tree = (btree){alloc, *root, btree_compare_u32};
+        struct bt_stats stats;
+        btree_stats(tree, &stats);
+        order_helper order = {tree, 0};
+        btree_traverse(tree, order_callback, &order, false);
+        btree_traverse(tree, value_callback, &tree, false);
+        if(stats.pairs != len || order.last_key != 2*len){
+            printf("TEST FAILED:\nReopened bulk loaded tree of %d keys has %lu "
+                   "ending at %x\n", len, stats.pairs, order.last_key);
+            exit(1);
+        }
+        for(uint32_t key = 2; key <= 2*len; key += 2)
+            if(!btree_contains(tree, &key)){
+                printf("TEST FAILED:\nReopened bulk loaded tree of %d keys lost %x\n",
+                       len, key);
+                exit(1);
+            }
+        btree_close_file_alloc(alloc);
+    }
+    close(file);
+}
+
+// Changes pile up until the background flusher writes them back, a flush
+// afterwards only writes back what changed since
+void test_flush(uint32_t cache_nodes, uint64_t map_size, int len){
+    char path[] = "/tmp/btree_test_XXXXXX";
+    int file = mkstemp(path);
+    if(file==-1){
+        perror("Couldn't create file");
+        exit(1);
+    }
+    unlink(path);
+
+    struct bt_file_options options = {
+        .cache_nodes = cache_nodes,
+        .map_size = map_size,
+        .max_dirty = 32*getpagesize()
+    };
+    bt_node_id *root;
+    bt_alloc_ptr alloc = btree_new_file_alloc(file, (void**)&root, sizeof(bt_node_id),
+                                              &options, NULL);
+    struct event_counts counts = {{0}};
+    struct bt_alloc_stats stats = {
+        .event_callback = count_event,
+        .event_param = &counts
+    };
+    btree_alloc_stats(alloc, &stats);
+    btree tree = btree_create(alloc, sizeof(uint32_t), sizeof(uint32_t),
+                    btree_compare_u32, 0, 0);
+    *root = tree.root;
+    for(uint32_t i = 0; i < len; i++)
+        btree_insert(tree, &i, &i);
+    for(int i = 0; i < 1000 && !__atomic_load_n(counts.events+BT_EVENT_FLUSH,
+                                                 __ATOMIC_RELAXED); i++)
+        usleep(1000);
+    uint64_t background = __atomic_load_n(counts.events+BT_EVENT_FLUSH, __ATOMIC_RELAXED);
+    btree_file_alloc_flush(alloc, false);
+    // Changes one leaf, the root and the userdata of the allocator at most
+    btree_insert(tree, &(uint32_t){len/2}, &(uint32_t){0});
+    btree_file_alloc_flush(alloc, false);
+    if(!background || counts.last_flush == 0 || counts.last_flush > 3*getpagesize()){
+        printf("TEST FAILED:\nBackground flusher ran %lu times, "
+               "flushing one change wrote %lu bytes\n", background, counts.last_flush);
+        exit(1);
+    }
+    btree_close_file_alloc(alloc);
+
+    alloc = btree_load_file_alloc(file, (void**)&root, &options, NULL);
+    tree = (btree){alloc, *root, btree_compare_u32};
+    for(uint32_t i = 0; i < len; i++){
+        uint32_t value;
+        if(!btree_get(tree, &i, &value) || value != (i == len/2 ? 0 : i)){
+            printf("TEST FAILED:\nFlushed tree lacks %x\n", i);
+            exit(1);
+        }
+    }
+    btree_close_file_alloc(alloc);
+    close(file);
+}
+
 int main(void){
     //time_t t;
     //srand((unsigned) time(&t));
@@ -186,8 +1754,65 @@ int main(void){
 //    create_tree();
 //    remove_tree();
 
+    test_file_alloc(4, 0, 20000, 0);
+    test_file_alloc(0, 0, 20000, 0);
+    test_file_alloc(4, 1<<30, 20000, 0);
+    test_file_alloc(4, 1<<18, 20000, 0);
+    test_file_alloc(4, 0, 20000, BT_BPLUS);
+    test_file_alloc(4, 0, 20000, BT_BPLUS|BT_IDS32);
+    test_file_extents(200000);
+    test_file_format();
+    test_wal(1, 20000, 0);
+    test_wal(1, 20000, BT_BPLUS);
+    test_wal(4, 5000, BT_CONCURRENT);
+    test_compact(50000, 0, false);
+    test_compact(50000, BT_BPLUS, true);
+    test_buffered(32, 50000, 0);
+    test_buffered(32, 50000, BT_BPLUS);
+    test_buffered_bulk_load(6, 20000, 0);
+    test_buffered_bulk_load(6, 20000, BT_BPLUS);
+    test_flush(4, 0, 20000);
+    test_flush(4, 1<<30, 20000);
+
 //    bt_alloc_ptr alloc = btree_new_ram_alloc(496);
-    bt_alloc_ptr alloc = btree_new_ram_alloc(100, NULL);
+    bt_alloc_ptr alloc = btree_new_ram_alloc(100, NULL, NULL);
+    for(int flags = 0; flags <= BT_BPLUS; flags += BT_BPLUS){
+        test_bulk_load(alloc, 5000, 1, flags);
+        test_bulk_load(alloc, 5000, 0.6, flags);
+        test_insert_batch(alloc, 200, 300, flags);
+        test_get_many(alloc, 5000, 1000, flags);
+        test_cursor(alloc, 3000, 300, flags);
+        test_stats(alloc, 3000, flags);
+    }
+    test_bplus(alloc, 20, 2000);
+    test_prefetch(50000, 0);
+    test_prefetch(50000, BT_BPLUS);
+    // Leaves need more than a few pairs to share them
+    bt_alloc_ptr sharing_alloc = btree_new_ram_alloc(512, NULL, NULL);
+    test_leaf_sharing(sharing_alloc, 20000, 0);
+    test_leaf_sharing(sharing_alloc, 20000, BT_BPLUS);
+    btree_free_ram_alloc(sharing_alloc);
+    test_compact_ids(5000);
+    test_snapshots(5000);
+    test_high_ids();
+    bt_alloc_ptr concurrent_alloc = btree_new_ram_alloc(128, NULL, NULL);
+    test_concurrent(concurrent_alloc, 8, 2000, 30000);
+    btree_free_ram_alloc(concurrent_alloc);
+    concurrent_alloc = btree_new_ram_alloc(4096, NULL, NULL);
+    test_concurrent(concurrent_alloc, 4, 20000, 30000);
+    btree_free_ram_alloc(concurrent_alloc);
+    concurrent_alloc = btree_new_ram_alloc(4096,
+            &(struct bt_ram_options){.compact_ids = true}, NULL);
+    test_concurrent(concurrent_alloc, 4, 20000, 30000);
+    btree_free_ram_alloc(concurrent_alloc);
+    concurrent_alloc = btree_new_ram_alloc(128, NULL, NULL);
+    test_concurrent_cursor_insert(concurrent_alloc);
+    btree_free_ram_alloc(concurrent_alloc);
+    test_concurrent_file(16, 0, false);
+    test_concurrent_file(0, 1<<20, false);
+    test_concurrent_file(64, 0, true);
+    test_concurrent_close();
+    test_key_types(alloc, 3000);
     for(float del_chance = 0.1; del_chance < 0.6; del_chance += 0.15)
         test_random(alloc, 3000, 250, del_chance);
 //            test_random(alloc, 400, 0.25);